@@ -1,5 +1,6 @@
 #include "acpi.h"
 
+#include <stdbool.h>
 #include <limine_requests.h>
 
 #include "limine.h"
@@ -44,6 +45,30 @@ cleanup:
     return err;
 }
 
+static err_t validate_acpi_rsdp(acpi_rsdp_t* rsdp) {
+    err_t err = NO_ERROR;
+
+    // the first part is checksummed on its own, the extended
+    // checksum covers the whole structure from revision 2
+    uint8_t checksum = 0;
+    for (size_t i = 0; i < 20; i++) {
+        checksum += *((uint8_t*)rsdp + i);
+    }
+    CHECK(checksum == 0);
+
+    if (rsdp->revision >= 2) {
+        CHECK(rsdp->length >= sizeof(acpi_rsdp_t));
+        checksum = 0;
+        for (size_t i = 0; i < rsdp->length; i++) {
+            checksum += *((uint8_t*)rsdp + i);
+        }
+        CHECK(checksum == 0);
+    }
+
+cleanup:
+    return err;
+}
+
 err_t init_acpi_tables() {
     err_t err = NO_ERROR;
 
@@ -141,3 +166,319 @@ void acpi_stall(uint64_t microseconds) {
         }
     } while (times-- > 0);
 }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// NUMA topology
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Static limits of the topology, the NUMA information is parsed before
+ * we have any allocator so everything is in fixed size arrays
+ */
+#define ACPI_NUMA_MAX_MEMORY_RANGES     128
+#define ACPI_NUMA_MAX_CPUS              1024
+
+/**
+ * The default distances when there is no SLIT
+ */
+#define ACPI_NUMA_LOCAL_DISTANCE        10
+#define ACPI_NUMA_REMOTE_DISTANCE       20
+
+typedef struct acpi_numa_memory_range {
+    uint64_t base;
+    uint64_t end;
+    int node;
+} acpi_numa_memory_range_t;
+
+typedef struct acpi_numa_cpu {
+    uint32_t apic_id;
+    int node;
+} acpi_numa_cpu_t;
+
+/**
+ * The proximity domain of each node, we normalize the domains
+ * to a dense range of node ids
+ */
+static uint32_t m_numa_domains[ACPI_NUMA_MAX_NODES];
+static int m_numa_node_count = 0;
+
+/**
+ * The memory ranges, sorted by base address
+ */
+static acpi_numa_memory_range_t m_numa_memory_ranges[ACPI_NUMA_MAX_MEMORY_RANGES];
+static int m_numa_memory_range_count = 0;
+
+/**
+ * The cpus and their nodes
+ */
+static acpi_numa_cpu_t m_numa_cpus[ACPI_NUMA_MAX_CPUS];
+static int m_numa_cpu_count = 0;
+
+/**
+ * The distances between the nodes, only valid if we got a SLIT
+ */
+static uint8_t m_numa_distances[ACPI_NUMA_MAX_NODES][ACPI_NUMA_MAX_NODES];
+static bool m_numa_has_distances = false;
+
+/**
+ * Find a table by its signature, this does not depend on the
+ * rest of the acpi init and can be used as early as we want
+ */
+static acpi_description_header_t* acpi_find_table(uint32_t signature) {
+    if (g_limine_rsdp_request.response == NULL) {
+        return NULL;
+    }
+
+    acpi_rsdp_t* rsdp = g_limine_rsdp_request.response->address;
+    if (rsdp->signature != ACPI_RSDP_SIGNATURE || IS_ERROR(validate_acpi_rsdp(rsdp))) {
+        return NULL;
+    }
+
+    // get either the xsdt or rsdt based on the revision
+    acpi_description_header_t* sdt;
+    size_t entry_size;
+    if (rsdp->revision >= 2) {
+        sdt = PHYS_TO_DIRECT(rsdp->xsdt_address);
+        entry_size = sizeof(void*);
+    } else {
+        sdt = PHYS_TO_DIRECT(rsdp->rsdt_address);
+        entry_size = sizeof(uint32_t);
+    }
+
+    // don't trust any of the entries if the table is corrupt
+    if (IS_ERROR(validate_acpi_table(sdt))) {
+        return NULL;
+    }
+    size_t entry_count = (sdt->length - sizeof(acpi_description_header_t)) / entry_size;
+
+    for (size_t i = 0; i < entry_count; i++) {
+        acpi_description_header_t* table;
+        if (rsdp->revision >= 2) {
+            table = PHYS_TO_DIRECT(((acpi_description_header_t**)(sdt + 1))[i]);
+        } else {
+            table = PHYS_TO_DIRECT(((uint32_t*)(sdt + 1))[i]);
+        }
+
+        if (table->signature == signature) {
+            if (IS_ERROR(validate_acpi_table(table))) {
+                return NULL;
+            }
+            return table;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Get the node of a proximity domain, allocating a new node if needed
+ */
+static int acpi_numa_get_node(uint32_t domain) {
+    for (int i = 0; i < m_numa_node_count; i++) {
+        if (m_numa_domains[i] == domain) {
+            return i;
+        }
+    }
+
+    if (m_numa_node_count == ACPI_NUMA_MAX_NODES) {
+        WARN("acpi: too many NUMA nodes, treating domain %u as node 0", domain);
+        return 0;
+    }
+
+    m_numa_domains[m_numa_node_count] = domain;
+    return m_numa_node_count++;
+}
+
+static void acpi_numa_add_memory(uint32_t domain, uint64_t base, uint64_t length) {
+    if (length == 0) {
+        return;
+    }
+
+    if (m_numa_memory_range_count == ACPI_NUMA_MAX_MEMORY_RANGES) {
+        WARN("acpi: too many NUMA memory ranges, ignoring %016lx-%016lx", base, base + length);
+        return;
+    }
+
+    // insert it sorted
+    int i = m_numa_memory_range_count++;
+    while (i > 0 && m_numa_memory_ranges[i - 1].base > base) {
+        m_numa_memory_ranges[i] = m_numa_memory_ranges[i - 1];
+        i--;
+    }
+
+    m_numa_memory_ranges[i] = (acpi_numa_memory_range_t){
+        .base = base,
+        .end = base + length,
+        .node = acpi_numa_get_node(domain),
+    };
+}
+
+static void acpi_numa_add_cpu(uint32_t domain, uint32_t apic_id) {
+    if (m_numa_cpu_count == ACPI_NUMA_MAX_CPUS) {
+        WARN("acpi: too many NUMA cpus, ignoring APIC#%u", apic_id);
+        return;
+    }
+
+    m_numa_cpus[m_numa_cpu_count++] = (acpi_numa_cpu_t){
+        .apic_id = apic_id,
+        .node = acpi_numa_get_node(domain),
+    };
+}
+
+static void acpi_numa_parse_slit(acpi_slit_t* slit) {
+    uint64_t count = slit->locality_count;
+    if (sizeof(acpi_slit_t) + count * count > slit->header.length) {
+        WARN("acpi: SLIT is too small, ignoring");
+        return;
+    }
+
+    for (int from = 0; from < m_numa_node_count; from++) {
+        for (int to = 0; to < m_numa_node_count; to++) {
+            uint32_t from_domain = m_numa_domains[from];
+            uint32_t to_domain = m_numa_domains[to];
+            if (from_domain >= count || to_domain >= count) {
+                WARN("acpi: SLIT is missing domains, ignoring");
+                return;
+            }
+
+            // unreachable localities are not a real distance, and
+            // the values below the local distance are reserved
+            uint8_t distance = slit->entries[from_domain * count + to_domain];
+            if (distance == ACPI_SLIT_NO_PATH) {
+                if (from == to) {
+                    WARN("acpi: SLIT has a domain with no path to itself, ignoring");
+                    return;
+                }
+                distance = ACPI_NUMA_NO_PATH;
+            } else if (distance < ACPI_NUMA_LOCAL_DISTANCE) {
+                WARN("acpi: SLIT has a reserved distance %u, ignoring", distance);
+                return;
+            }
+            m_numa_distances[from][to] = distance;
+        }
+    }
+
+    m_numa_has_distances = true;
+}
+
+err_t init_acpi_numa(void) {
+    err_t err = NO_ERROR;
+
+    acpi_srat_t* srat = (acpi_srat_t*)acpi_find_table(ACPI_SRAT_SIGNATURE);
+    if (srat == NULL) {
+        TRACE("acpi: no SRAT, assuming a single NUMA node");
+        goto cleanup;
+    }
+
+    // go over all the affinity structures
+    void* ptr = srat + 1;
+    void* end = (void*)srat + srat->header.length;
+    while (ptr + sizeof(acpi_srat_entry_t) <= end) {
+        acpi_srat_entry_t* entry = ptr;
+        CHECK(entry->length >= sizeof(acpi_srat_entry_t));
+        CHECK(ptr + entry->length <= end);
+
+        switch (entry->type) {
+            case ACPI_SRAT_TYPE_PROCESSOR_AFFINITY: {
+                acpi_srat_processor_affinity_t* affinity = ptr;
+                if (affinity->flags & ACPI_SRAT_FLAGS_ENABLED) {
+                    uint32_t domain = affinity->proximity_domain_low |
+                                      (affinity->proximity_domain_high[0] << 8) |
+                                      (affinity->proximity_domain_high[1] << 16) |
+                                      (affinity->proximity_domain_high[2] << 24);
+                    acpi_numa_add_cpu(domain, affinity->apic_id);
+                }
+            } break;
+
+            case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+                acpi_srat_memory_affinity_t* affinity = ptr;
+                if (affinity->flags & ACPI_SRAT_FLAGS_ENABLED) {
+                    acpi_numa_add_memory(affinity->proximity_domain, affinity->base_address, affinity->length);
+                }
+            } break;
+
+            case ACPI_SRAT_TYPE_X2APIC_AFFINITY: {
+                acpi_srat_x2apic_affinity_t* affinity = ptr;
+                if (affinity->flags & ACPI_SRAT_FLAGS_ENABLED) {
+                    acpi_numa_add_cpu(affinity->proximity_domain, affinity->x2apic_id);
+                }
+            } break;
+
+            default:
+                break;
+        }
+
+        ptr += entry->length;
+    }
+
+    // the distances are optional
+    acpi_slit_t* slit = (acpi_slit_t*)acpi_find_table(ACPI_SLIT_SIGNATURE);
+    if (slit != NULL) {
+        acpi_numa_parse_slit(slit);
+    }
+
+    for (int i = 0; i < m_numa_memory_range_count; i++) {
+        acpi_numa_memory_range_t* range = &m_numa_memory_ranges[i];
+        TRACE("acpi: NUMA node %d: %016lx-%016lx", range->node, range->base, range->end);
+    }
+
+cleanup:
+    // a broken SRAT should not prevent us from booting, just
+    // treat everything as a single node
+    if (IS_ERROR(err)) {
+        WARN("acpi: invalid SRAT, ignoring NUMA information");
+        err = NO_ERROR;
+        m_numa_node_count = 0;
+    }
+
+    if (m_numa_node_count == 0) {
+        m_numa_node_count = 0;
+        m_numa_memory_range_count = 0;
+        m_numa_cpu_count = 0;
+        m_numa_has_distances = false;
+    } else {
+        TRACE("acpi: Found %d NUMA nodes", m_numa_node_count);
+    }
+
+    return err;
+}
+
+int acpi_numa_node_count(void) {
+    return m_numa_node_count == 0 ? 1 : m_numa_node_count;
+}
+
+int acpi_numa_memory_node(uint64_t phys, uint64_t* range_end) {
+    for (int i = 0; i < m_numa_memory_range_count; i++) {
+        acpi_numa_memory_range_t* range = &m_numa_memory_ranges[i];
+
+        // we are in a hole before this range, treat it as node zero
+        if (phys < range->base) {
+            *range_end = range->base;
+            return 0;
+        }
+
+        if (phys < range->end) {
+            *range_end = range->end;
+            return range->node;
+        }
+    }
+
+    *range_end = UINT64_MAX;
+    return 0;
+}
+
+int acpi_numa_cpu_node(uint32_t apic_id) {
+    for (int i = 0; i < m_numa_cpu_count; i++) {
+        if (m_numa_cpus[i].apic_id == apic_id) {
+            return m_numa_cpus[i].node;
+        }
+    }
+    return 0;
+}
+
+uint8_t acpi_numa_distance(int from, int to) {
+    if (m_numa_has_distances) {
+        return m_numa_distances[from][to];
+    }
+    return from == to ? ACPI_NUMA_LOCAL_DISTANCE : ACPI_NUMA_REMOTE_DISTANCE;
+}
@@ -4,6 +4,11 @@
 
 #include <lib/except.h>
 
+/**
+ * The max amount of NUMA nodes we support
+ */
+#define ACPI_NUMA_MAX_NODES     64
+
 /**
  * Initialize the early acpi subsystem, should just be enough for
  * doing whatever we need to do
@@ -19,3 +24,39 @@ uint32_t acpi_get_timer_tick(void);
  * Stall for the given amount of NS
  */
 void acpi_stall(uint64_t ns);
+
+/**
+ * Parse the NUMA topology (SRAT/SLIT), this is done before the physical
+ * memory allocator is initialized so it can't allocate any memory
+ */
+err_t init_acpi_numa(void);
+
+/**
+ * The amount of NUMA nodes in the system, always at least one
+ */
+int acpi_numa_node_count(void);
+
+/**
+ * Get the NUMA node of the given physical address
+ *
+ * @param phys          [IN] The physical address
+ * @param range_end     [OUT] The end of the range that has the same node
+ */
+int acpi_numa_memory_node(uint64_t phys, uint64_t* range_end);
+
+/**
+ * Get the NUMA node of the cpu with the given APIC id
+ */
+int acpi_numa_cpu_node(uint32_t apic_id);
+
+/**
+ * The distance between two NUMA nodes that have no path between them
+ */
+#define ACPI_NUMA_NO_PATH       UINT8_MAX
+
+/**
+ * Get the relative distance between two NUMA nodes, as reported by the SLIT, the
+ * distance of a node to itself is normalized to 10, returns ACPI_NUMA_NO_PATH if
+ * the nodes can't reach each other
+ */
+uint8_t acpi_numa_distance(int from, int to);
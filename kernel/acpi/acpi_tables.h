@@ -76,3 +76,66 @@ typedef struct acpi_facp {
     uint8_t _reserved6;
     uint32_t flags;
 } PACKED acpi_facp_t;
+
+#define ACPI_SRAT_SIGNATURE SIGNATURE_32('S', 'R', 'A', 'T')
+
+typedef struct acpi_srat {
+    acpi_description_header_t header;
+    uint32_t table_revision;
+    uint64_t _reserved;
+} PACKED acpi_srat_t;
+
+typedef struct acpi_srat_entry {
+    uint8_t type;
+    uint8_t length;
+} PACKED acpi_srat_entry_t;
+
+#define ACPI_SRAT_TYPE_PROCESSOR_AFFINITY   0
+#define ACPI_SRAT_TYPE_MEMORY_AFFINITY      1
+#define ACPI_SRAT_TYPE_X2APIC_AFFINITY      2
+
+#define ACPI_SRAT_FLAGS_ENABLED             BIT0
+
+typedef struct acpi_srat_processor_affinity {
+    acpi_srat_entry_t header;
+    uint8_t proximity_domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t local_sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+} PACKED acpi_srat_processor_affinity_t;
+
+typedef struct acpi_srat_memory_affinity {
+    acpi_srat_entry_t header;
+    uint32_t proximity_domain;
+    uint16_t _reserved1;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t _reserved2;
+    uint32_t flags;
+    uint64_t _reserved3;
+} PACKED acpi_srat_memory_affinity_t;
+
+typedef struct acpi_srat_x2apic_affinity {
+    acpi_srat_entry_t header;
+    uint16_t _reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t _reserved2;
+} PACKED acpi_srat_x2apic_affinity_t;
+
+#define ACPI_SLIT_SIGNATURE SIGNATURE_32('S', 'L', 'I', 'T')
+
+/**
+ * An entry of the SLIT for localities that can't reach each other
+ */
+#define ACPI_SLIT_NO_PATH   0xFF
+
+typedef struct acpi_slit {
+    acpi_description_header_t header;
+    uint64_t locality_count;
+    uint8_t entries[];
+} PACKED acpi_slit_t;
@@ -237,6 +237,28 @@ void lapic_eoi(void) {
     lapic_write(XAPIC_EOI_OFFSET, 0);
 }
 
+void lapic_send_ipi_all_excluding_self(uint8_t vector) {
+    uint32_t icr = vector |
+                   (LOCAL_APIC_DELIVERY_MODE_FIXED << 8) |
+                   BIT14 |
+                   (LOCAL_APIC_DESTINATION_SHORTHAND_ALL_EXCLUDING_SELF << 18);
+
+    if (m_x2apic_mode) {
+        // the x2apic msr writes are not serializing, make sure
+        // that everything is visible before the ipi arrives
+        asm volatile ("mfence" ::: "memory");
+        __wrmsr(X2APIC_MSR_ICR_ADDRESS, icr);
+    } else {
+        lapic_write(XAPIC_ICR_HIGH_OFFSET, 0);
+        lapic_write(XAPIC_ICR_LOW_OFFSET, icr);
+
+        // wait for the ipi to be sent
+        while (lapic_read(XAPIC_ICR_LOW_OFFSET) & BIT12) {
+            cpu_relax();
+        }
+    }
+}
+
 void lapic_timer_set_deadline(uint64_t tsc_deadline) {
     // calculate the amount of ticks we need to set, if too much then
     // just truncate, its up to the timer subsystem to be able to handle
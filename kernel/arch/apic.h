@@ -19,5 +19,10 @@ void init_lapic_per_core(void);
  */
 void lapic_eoi(void);
 
+/**
+ * Send a fixed IPI to all the other cores
+ */
+void lapic_send_ipi_all_excluding_self(uint8_t vector);
+
 void lapic_timer_set_deadline(uint64_t tsc_deadline);
 void lapic_timer_clear(void);
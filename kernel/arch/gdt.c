@@ -105,31 +105,21 @@ static spinlock_t m_tss_lock = SPINLOCK_INIT;
 err_t init_tss(void) {
     err_t err = NO_ERROR;
 
-    tss64_t* tss = phys_alloc(sizeof(tss64_t));
-    void* ist1 = phys_alloc(SIZE_4KB);
-    void* ist2 = phys_alloc(SIZE_4KB);
-    void* ist3 = phys_alloc(SIZE_4KB);
-    void* ist4 = phys_alloc(SIZE_4KB);
-    void* ist5 = phys_alloc(SIZE_4KB);
-    void* ist6 = phys_alloc(SIZE_4KB);
-    void* ist7 = phys_alloc(SIZE_4KB);
-    CHECK_ERROR(tss != NULL, ERROR_OUT_OF_MEMORY);
-    CHECK_ERROR(ist1 != NULL, ERROR_OUT_OF_MEMORY);
-    CHECK_ERROR(ist2 != NULL, ERROR_OUT_OF_MEMORY);
-    CHECK_ERROR(ist3 != NULL, ERROR_OUT_OF_MEMORY);
-    CHECK_ERROR(ist4 != NULL, ERROR_OUT_OF_MEMORY);
-    CHECK_ERROR(ist5 != NULL, ERROR_OUT_OF_MEMORY);
-    CHECK_ERROR(ist6 != NULL, ERROR_OUT_OF_MEMORY);
-    CHECK_ERROR(ist7 != NULL, ERROR_OUT_OF_MEMORY);
+    // allocate the tss and all the ist stacks at once
+    void* pages[8];
+    RETHROW(phys_alloc_bulk(SIZE_4KB, ARRAY_LENGTH(pages), pages));
+
+    tss64_t* tss = pages[0];
+    memset(tss, 0, sizeof(*tss));
 
     // set the ists
-    tss->ist1 = (uintptr_t)ist1 + SIZE_4KB - 16;
-    tss->ist2 = (uintptr_t)ist2 + SIZE_4KB - 16;
-    tss->ist3 = (uintptr_t)ist3 + SIZE_4KB - 16;
-    tss->ist4 = (uintptr_t)ist4 + SIZE_4KB - 16;
-    tss->ist5 = (uintptr_t)ist5 + SIZE_4KB - 16;
-    tss->ist6 = (uintptr_t)ist6 + SIZE_4KB - 16;
-    tss->ist7 = (uintptr_t)ist7 + SIZE_4KB - 16;
+    tss->ist1 = (uintptr_t)pages[1] + SIZE_4KB - 16;
+    tss->ist2 = (uintptr_t)pages[2] + SIZE_4KB - 16;
+    tss->ist3 = (uintptr_t)pages[3] + SIZE_4KB - 16;
+    tss->ist4 = (uintptr_t)pages[4] + SIZE_4KB - 16;
+    tss->ist5 = (uintptr_t)pages[5] + SIZE_4KB - 16;
+    tss->ist6 = (uintptr_t)pages[6] + SIZE_4KB - 16;
+    tss->ist7 = (uintptr_t)pages[7] + SIZE_4KB - 16;
 
     spinlock_acquire(&m_tss_lock);
 
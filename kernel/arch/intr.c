@@ -1,6 +1,7 @@
 #include "intr.h"
 
 #include <debug/debug.h>
+#include <mem/gc/gc.h>
 #include <mem/phys.h>
 #include <mem/virt.h>
 #include <sync/spinlock.h>
@@ -345,6 +346,28 @@ static void timer_interrupt_handler(interrupt_frame_t* frame) {
     scheduler_preempt_enable();
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// TLB shootdown interrupt
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+__attribute__((interrupt))
+static void tlb_shootdown_interrupt_handler(interrupt_frame_t* frame) {
+    virt_handle_tlb_shootdown();
+    lapic_eoi();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// GC stop the world interrupt
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+__attribute__((interrupt))
+static void gc_stop_interrupt_handler(interrupt_frame_t* frame) {
+    // we can eoi right away, the handler will wait
+    // with interrupts disabled until the gc is done
+    lapic_eoi();
+    gc_handle_stop_request();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////but it
 // IDT setup
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -407,7 +430,9 @@ void init_idt() {
     set_idt_entry(0x1D, exception_handler_0x1D, 0, true);
     set_idt_entry(0x1E, exception_handler_0x1E, 0, true);
     set_idt_entry(0x1F, exception_handler_0x1F, 0, true);
-    set_idt_entry(0x20, timer_interrupt_handler, 0, true);
+    set_idt_entry(INTR_VECTOR_TIMER, timer_interrupt_handler, 0, true);
+    set_idt_entry(INTR_VECTOR_TLB_SHOOTDOWN, tlb_shootdown_interrupt_handler, 0, true);
+    set_idt_entry(INTR_VECTOR_GC_STOP, gc_stop_interrupt_handler, 0, true);
 
     idt_t idt = {
         .limit = sizeof(m_idt_entries) - 1,
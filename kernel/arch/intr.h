@@ -29,4 +29,11 @@ typedef struct interrupt_frame {
 #define EXCEPT_IA32_MACHINE_CHECK    18
 #define EXCEPT_IA32_SIMD             19
 
+/**
+ * The vectors we are using for our own interrupts
+ */
+#define INTR_VECTOR_TIMER           0x20
+#define INTR_VECTOR_TLB_SHOOTDOWN   0x21
+#define INTR_VECTOR_GC_STOP         0x22
+
 void init_idt();
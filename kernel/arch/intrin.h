@@ -38,6 +38,10 @@ static inline INTRIN_ATTR void cpu_relax() {
     __builtin_ia32_pause();
 }
 
+static inline INTRIN_ATTR void __sfence(void) {
+    asm volatile ("sfence" : : : "memory");
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Control register access
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
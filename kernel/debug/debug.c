@@ -4,18 +4,26 @@
 #include <lib/except.h>
 #include <lib/string.h>
 #include <mem/alloc.h>
+#include <mem/phys.h>
 #include <limine.h>
 #include <lib/printf.h>
+#include <sync/spinlock.h>
 
+/**
+ * The symbols sorted by address, inserting can move the array so the
+ * lock must be held while searching it, the names are never freed
+ */
 static symbol_t* m_symbols = NULL;
 static int m_symbols_count = 0;
+static irq_spinlock_t m_symbols_lock = IRQ_SPINLOCK_INIT;
 
 static void do_insert_symbol(int index, symbol_t symbol) {
     // increase the count
     m_symbols_count++;
 
-    // reallocate the array
-    symbol_t* ptr = mem_realloc(m_symbols, m_symbols_count * sizeof(symbol_t));
+    // reallocate the array, most of the time this will
+    // either fit or grow in place
+    symbol_t* ptr = phys_realloc(m_symbols, m_symbols_count * sizeof(symbol_t));
     ASSERT(ptr != NULL);
 
     // move the items after the element we want
@@ -57,6 +65,34 @@ static void insert_symbol(symbol_t symbol) {
     }
 }
 
+/**
+ * Find the symbol containing the address, the lock must be held
+ */
+static symbol_t* find_symbol(uintptr_t addr) {
+    if (m_symbols_count == 0) {
+        return NULL;
+    }
+
+    int l = 0;
+    int r = m_symbols_count - 1;
+    while (l <= r) {
+        int m = l + (r - l) / 2;
+
+        // found the exact symbol
+        if (m_symbols[m].address <= addr && addr < m_symbols[m].address + m_symbols[m].size) {
+            return &m_symbols[m];
+        }
+
+        // continue searching
+        if (m_symbols[m].address < addr) {
+            l = m + 1;
+        } else {
+            r = m - 1;
+        }
+    }
+    return NULL;
+}
+
 static char* strdup(const char* str) {
     int len = strlen(str);
     char* str2 = mem_alloc(len + 1);
@@ -65,16 +101,26 @@ static char* strdup(const char* str) {
 }
 
 void debug_create_symbol(const char* name, uintptr_t addr, size_t size) {
+    // copy the name before taking the lock
+    char* copy = strdup(name);
+
+    bool irq_state = irq_spinlock_acquire(&m_symbols_lock);
+
     // don't insert one if already exists
-    if (debug_lookup_symbol(addr) != NULL) {
-        return;
+    bool exists = find_symbol(addr) != NULL;
+    if (!exists) {
+        insert_symbol((symbol_t){
+            .address = addr,
+            .size = size,
+            .name = copy
+        });
     }
 
-    insert_symbol((symbol_t){
-        .address = addr,
-        .size = size,
-        .name = strdup(name)
-    });
+    irq_spinlock_release(&m_symbols_lock, irq_state);
+
+    if (exists) {
+        mem_free(copy);
+    }
 }
 
 static void swap_symbols(int i, int j) {
@@ -144,10 +190,11 @@ void debug_load_symbols() {
     // get the strtab of the symtab
     char* strtab = kernel + sections[symtab->sh_link].sh_offset;
 
-    // load all the symbols into an array
+    // load all the symbols into an array, this runs on the bsp before the other
+    // cores are up so nothing can look symbols up under us
     Elf64_Sym* symbols = kernel + symtab->sh_offset;
     m_symbols_count = symtab->sh_size / sizeof(Elf64_Sym);
-    m_symbols = mem_realloc(m_symbols, m_symbols_count * sizeof(symbol_t));
+    m_symbols = phys_realloc(m_symbols, m_symbols_count * sizeof(symbol_t));
     ASSERT(m_symbols != NULL);
     for (int i = 0; i < m_symbols_count; i++) {
         symbol_t* symbol = &m_symbols[i];
@@ -162,36 +209,21 @@ void debug_load_symbols() {
     TRACE("debug: Loaded %d symbols", m_symbols_count);
 }
 
-symbol_t* debug_lookup_symbol(uintptr_t addr) {
-    if (m_symbols_count == 0) {
-        return NULL;
-    }
-
-    int l = 0;
-    int r = m_symbols_count;
-    while (l <= r) {
-        int m = l + (r - l) / 2;
-
-        // found the exact symbol
-        if (m_symbols[m].address <= addr && addr < m_symbols[m].address + m_symbols[m].size) {
-            return &m_symbols[m];
-        }
-
-        // continue searching
-        if (m_symbols[m].address < addr) {
-            l = m + 1;
-        } else {
-            r = m - 1;
-        }
+bool debug_lookup_symbol(uintptr_t addr, symbol_t* symbol) {
+    bool irq_state = irq_spinlock_acquire(&m_symbols_lock);
+    symbol_t* sym = find_symbol(addr);
+    if (sym != NULL) {
+        *symbol = *sym;
     }
-    return NULL;
+    irq_spinlock_release(&m_symbols_lock, irq_state);
+    return sym != NULL;
 }
 
 void debug_format_symbol(uintptr_t addr, char* buffer, size_t buffer_size) {
-    symbol_t* sym = debug_lookup_symbol(addr);
-    if (sym == NULL) {
+    symbol_t sym;
+    if (!debug_lookup_symbol(addr, &sym)) {
         ksnprintf(buffer, buffer_size, "%016lx", addr);
     } else {
-        ksnprintf(buffer, buffer_size, "%s+0x%03lx", sym->name, addr - sym->address);
+        ksnprintf(buffer, buffer_size, "%s+0x%03lx", sym.name, addr - sym.address);
     }
 }
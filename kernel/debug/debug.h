@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -20,9 +21,10 @@ void debug_load_symbols(void);
 void debug_create_symbol(const char* name, uintptr_t addr, size_t size);
 
 /**
- * Lookup for a symbol, returns NULL if unknown
+ * Lookup for a symbol, the symbol is copied out since the table can
+ * move once a symbol is created, returns false if unknown
  */
-symbol_t* debug_lookup_symbol(uintptr_t addr);
+bool debug_lookup_symbol(uintptr_t addr, symbol_t* symbol);
 
 /**
  * Format the address into a symbol
@@ -0,0 +1,256 @@
+#include "heap_profile.h"
+
+#include <stdint.h>
+
+#include <lib/printf.h>
+#include <lib/string.h>
+#include <mem/alloc.h>
+#include <mem/memory.h>
+#include <mem/virt.h>
+#include <sync/spinlock.h>
+#include <thread/pcpu.h>
+#include <thread/scheduler.h>
+#include <thread/thread.h>
+#include <time/timer.h>
+
+#include "debug.h"
+#include "log.h"
+
+/**
+ * The max amount of frames we keep from each backtrace
+ */
+#define HEAP_PROFILE_MAX_DEPTH      24
+
+/**
+ * The amount of unique stacks we can track, the table is static so
+ * sampling never has to allocate from the allocator it profiles
+ */
+#define HEAP_PROFILE_MAX_STACKS     2048
+
+/**
+ * How often the report is dumped
+ */
+#define HEAP_PROFILE_DUMP_PERIOD_MS 10000
+
+typedef struct heap_profile_stack {
+    // the hash of the frames, zero if the entry is unused
+    uint64_t hash;
+
+    // the kind of the allocator
+    heap_profile_kind_t kind;
+
+    // the amount of samples and the estimated amount of bytes
+    size_t samples;
+    size_t bytes;
+
+    // the return addresses, leaf first
+    size_t depth;
+    uintptr_t frames[HEAP_PROFILE_MAX_DEPTH];
+} heap_profile_stack_t;
+
+size_t g_heap_profile_interval = 0;
+
+/**
+ * The bytes left on the current cpu until the next sample
+ */
+static CPU_LOCAL int64_t m_heap_profile_countdown;
+
+/**
+ * The aggregated stacks, protected by the lock
+ */
+static heap_profile_stack_t m_heap_profile_stacks[HEAP_PROFILE_MAX_STACKS];
+static size_t m_heap_profile_dropped = 0;
+static irq_spinlock_t m_heap_profile_lock = IRQ_SPINLOCK_INIT;
+
+static const char* m_heap_profile_kind_names[HEAP_PROFILE_KIND_COUNT] = {
+    [HEAP_PROFILE_KERNEL] = "[kernel heap]",
+    [HEAP_PROFILE_GC] = "[gc heap]",
+};
+
+/**
+ * Walk the frame pointers, we don't trust them so every
+ * frame is checked to be mapped and moving up the stack
+ */
+static size_t heap_profile_backtrace(uintptr_t* frames) {
+    size_t depth = 0;
+    uintptr_t* base_ptr = __builtin_frame_address(0);
+    while (depth < HEAP_PROFILE_MAX_DEPTH) {
+        if (((uintptr_t)base_ptr & 7) != 0 ||
+            !virt_is_mapped((uintptr_t)&base_ptr[0]) ||
+            !virt_is_mapped((uintptr_t)&base_ptr[1])
+        ) {
+            break;
+        }
+
+        uintptr_t old_bp = base_ptr[0];
+        uintptr_t ret_addr = base_ptr[1];
+        if (ret_addr == 0) {
+            break;
+        }
+        frames[depth++] = ret_addr;
+
+        if (old_bp <= (uintptr_t)base_ptr) {
+            break;
+        }
+        base_ptr = (uintptr_t*)old_bp;
+    }
+    return depth;
+}
+
+static uint64_t heap_profile_hash(heap_profile_kind_t kind, uintptr_t* frames, size_t depth) {
+    // fnv1a over the frames, never zero since
+    // zero marks an empty entry
+    uint64_t hash = 0xcbf29ce484222325ULL ^ kind;
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ frames[i]) * 0x100000001b3ULL;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+static void heap_profile_record(heap_profile_kind_t kind, size_t samples, size_t bytes) {
+    uintptr_t frames[HEAP_PROFILE_MAX_DEPTH];
+    size_t depth = heap_profile_backtrace(frames);
+    uint64_t hash = heap_profile_hash(kind, frames, depth);
+
+    bool irq_state = irq_spinlock_acquire(&m_heap_profile_lock);
+
+    // linear probing, gives up after a short walk so a full
+    // table does not turn every sample into a full scan
+    size_t index = hash % HEAP_PROFILE_MAX_STACKS;
+    heap_profile_stack_t* stack = NULL;
+    for (int i = 0; i < 32; i++) {
+        heap_profile_stack_t* entry = &m_heap_profile_stacks[(index + i) % HEAP_PROFILE_MAX_STACKS];
+        if (entry->hash == hash && entry->kind == kind && entry->depth == depth &&
+            memcmp(entry->frames, frames, depth * sizeof(uintptr_t)) == 0
+        ) {
+            stack = entry;
+            break;
+        }
+
+        if (entry->hash == 0) {
+            entry->hash = hash;
+            entry->kind = kind;
+            entry->depth = depth;
+            memcpy(entry->frames, frames, depth * sizeof(uintptr_t));
+            stack = entry;
+            break;
+        }
+    }
+
+    if (stack != NULL) {
+        stack->samples += samples;
+        stack->bytes += bytes;
+    } else {
+        m_heap_profile_dropped += samples;
+    }
+
+    irq_spinlock_release(&m_heap_profile_lock, irq_state);
+}
+
+void heap_profile_sample(heap_profile_kind_t kind, size_t size) {
+    size_t interval = g_heap_profile_interval;
+    size_t samples = 0;
+
+    bool irq_state = irq_save();
+    int64_t* countdown = pcpu_get_pointer(&m_heap_profile_countdown);
+    *countdown -= size;
+    if (*countdown <= 0) {
+        // every interval we crossed counts as a sample, each
+        // one standing for interval bytes
+        samples = 1 + (size_t)(-*countdown) / interval;
+        *countdown += (int64_t)(samples * interval);
+    }
+    irq_restore(irq_state);
+
+    if (samples != 0) {
+        heap_profile_record(kind, samples, samples * interval);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Report
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Append a single frame to the line, jitted methods are resolved as
+ * long as the jit registered a symbol for them
+ */
+static size_t heap_profile_format_frame(char* line, size_t size, uintptr_t addr) {
+    symbol_t sym;
+    if (debug_lookup_symbol(addr, &sym)) {
+        return ksnprintf(line, size, ";%s", sym.name);
+    } else if (addr >= JIT_ADDR) {
+        return ksnprintf(line, size, ";[jit] 0x%lx", addr);
+    } else {
+        return ksnprintf(line, size, ";0x%lx", addr);
+    }
+}
+
+void heap_profile_dump(void) {
+    // snapshot the table first, we can't print while holding the lock and
+    // allocating while holding it would deadlock on the sampling path
+    heap_profile_stack_t* stacks = mem_alloc(sizeof(m_heap_profile_stacks));
+    if (stacks == NULL) {
+        WARN("heap_profile: not enough memory for the report");
+        return;
+    }
+
+    bool irq_state = irq_spinlock_acquire(&m_heap_profile_lock);
+    memcpy(stacks, m_heap_profile_stacks, sizeof(m_heap_profile_stacks));
+    size_t dropped = m_heap_profile_dropped;
+    irq_spinlock_release(&m_heap_profile_lock, irq_state);
+
+    TRACE("heap_profile: folded stacks, sampled every %lu bytes, %lu samples dropped",
+          g_heap_profile_interval, dropped);
+
+    char line[1024];
+    for (size_t i = 0; i < HEAP_PROFILE_MAX_STACKS; i++) {
+        heap_profile_stack_t* stack = &stacks[i];
+        if (stack->hash == 0) {
+            continue;
+        }
+
+        // the folded format goes from the root to the leaf, we
+        // cut frames that don't fit rather than the count
+        size_t len = ksnprintf(line, sizeof(line), "%s", m_heap_profile_kind_names[stack->kind]);
+        for (size_t j = stack->depth; j > 0 && len < sizeof(line) - 64; j--) {
+            len += heap_profile_format_frame(line + len, sizeof(line) - 64 - len, stack->frames[j - 1]);
+        }
+        if (len > sizeof(line) - 64) {
+            len = sizeof(line) - 64;
+        }
+        len += ksnprintf(line + len, sizeof(line) - len, " %lu\n", stack->bytes);
+
+        debugcon_write(line, len);
+    }
+
+    TRACE("heap_profile: end of report");
+
+    mem_free(stacks);
+}
+
+static void heap_profile_thread(void* arg) {
+    for (;;) {
+        timer_sleep(HEAP_PROFILE_DUMP_PERIOD_MS);
+        heap_profile_dump();
+    }
+}
+
+err_t init_heap_profile(size_t interval) {
+    err_t err = NO_ERROR;
+
+    CHECK(interval != 0);
+
+    // the countdowns start at zero, so the first
+    // allocation on each cpu is sampled
+    g_heap_profile_interval = interval;
+
+    thread_t* thread = thread_create(heap_profile_thread, NULL, "heap profile");
+    CHECK_ERROR(thread != NULL, ERROR_OUT_OF_MEMORY);
+    scheduler_wakeup_thread(thread);
+
+    TRACE("heap_profile: sampling allocations every %lu bytes", interval);
+
+cleanup:
+    return err;
+}
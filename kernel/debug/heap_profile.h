@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lib/except.h"
+
+typedef enum heap_profile_kind {
+    // allocations from mem_alloc
+    HEAP_PROFILE_KERNEL,
+
+    // allocations from tdn_host_gc_alloc
+    HEAP_PROFILE_GC,
+
+    HEAP_PROFILE_KIND_COUNT,
+} heap_profile_kind_t;
+
+/**
+ * The amount of bytes between samples, zero when the profiler is disabled
+ */
+extern size_t g_heap_profile_interval;
+
+/**
+ * Start sampling allocations every interval bytes, and dump the
+ * report periodically over the debugcon
+ */
+err_t init_heap_profile(size_t interval);
+
+/**
+ * Account an allocation, takes a backtrace when the sample
+ * interval is crossed
+ */
+void heap_profile_sample(heap_profile_kind_t kind, size_t size);
+
+/**
+ * Called by allocators on every allocation, cheap
+ * when the profiler is disabled
+ */
+static inline void heap_profile_account(heap_profile_kind_t kind, size_t size) {
+    if (__builtin_expect(g_heap_profile_interval != 0, 0)) {
+        heap_profile_sample(kind, size);
+    }
+}
+
+/**
+ * Dump the folded stacks report over the debugcon, every line
+ * is `kind;root;...;leaf bytes` as expected by flamegraph.pl
+ */
+void heap_profile_dump(void);
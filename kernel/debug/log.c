@@ -80,3 +80,11 @@ void debug_vprint(const char* prefix, const char* suffix, const char* fmt, va_li
     kprintf("%s", suffix);
     irq_spinlock_release(&m_debug_lock, irq_state);
 }
+
+void debugcon_write(const char* str, size_t len) {
+    bool irq_state = irq_spinlock_acquire(&m_debug_lock);
+    for (size_t i = 0; i < len; i++) {
+        __outbyte(0xE9, str[i]);
+    }
+    irq_spinlock_release(&m_debug_lock, irq_state);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdarg.h>
+#include <stddef.h>
 
 // log levels
 #define DEBUG(fmt, ...)     debug_print("[?] " fmt "\n", ##__VA_ARGS__)
@@ -23,3 +24,9 @@ void init_logging(void);
  */
 void debug_print(const char* fmt, ...) __attribute__((format(printf, (1), (2))));
 void debug_vprint(const char* prefix, const char* suffix, const char* fmt, va_list va);
+
+/**
+ * Write a raw string only to the debugcon, for large
+ * machine readable dumps that should not go to the screen
+ */
+void debugcon_write(const char* str, size_t len);
@@ -19,6 +19,32 @@ void* memset(void* s, int c, size_t n) {
     return d;
 }
 
+void memzero_nt(void* s, size_t n) {
+    uint64_t* d = s;
+
+    // a full cache line at a time, so the write combining
+    // buffer is flushed as a whole line
+    for (; n >= 64; n -= 64, d += 8) {
+        asm volatile (
+            "movnti %1, 0(%0)\n"
+            "movnti %1, 8(%0)\n"
+            "movnti %1, 16(%0)\n"
+            "movnti %1, 24(%0)\n"
+            "movnti %1, 32(%0)\n"
+            "movnti %1, 40(%0)\n"
+            "movnti %1, 48(%0)\n"
+            "movnti %1, 56(%0)\n"
+            :
+            : "r"(d), "r"(0ull)
+            : "memory"
+        );
+    }
+
+    for (; n >= 8; n -= 8, d++) {
+        asm volatile ("movnti %1, (%0)" : : "r"(d), "r"(0ull) : "memory");
+    }
+}
+
 __attribute__((always_inline))
 static inline void __rep_movsb(void* dest, const void* src, size_t n) {
     asm volatile (
@@ -7,6 +7,13 @@
 #define memmove __builtin_memmove
 #define memcmp __builtin_memcmp
 
+/**
+ * Zero the buffer with non-temporal stores, so it doesn't take over the cache, the
+ * buffer and size must be 8 byte aligned, and an sfence must be done before the
+ * memory is handed to another cpu
+ */
+void memzero_nt(void* s, size_t n);
+
 #define strlen __builtin_strlen
 #define strcmp __builtin_strcmp
 
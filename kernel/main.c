@@ -14,11 +14,13 @@
 #include "mem/virt.h"
 #include "arch/regs.h"
 #include "mem/alloc.h"
+#include "mem/reclaim.h"
 
 #include <stddef.h>
 #include <stdatomic.h>
 #include <arch/apic.h>
 #include <debug/debug.h>
+#include <debug/heap_profile.h>
 #include <lib/string.h>
 #include <mem/gc/gc.h>
 #include <thread/pcpu.h>
@@ -56,8 +58,22 @@ static void init_thread_entry(void* arg) {
 
      TRACE("Init thread started");
 
+     // start reclaiming memory in the background when needed
+     RETHROW(init_reclaim());
+     RETHROW(init_alloc_decommit());
+
+#ifdef ALLOC_BENCHMARK
+     // opt-in benchmark of the kernel heap
+     alloc_benchmark();
+#endif
+
+#ifdef HEAP_PROFILE_INTERVAL
+     // opt-in sampling of heap allocations
+     RETHROW(init_heap_profile(HEAP_PROFILE_INTERVAL));
+#endif
+
      // initialize the garbage collector
-     gc_init();
+     RETHROW(gc_init());
 
     // setup the tdn configuration
     tdn_config_t* config = tdn_get_config();
@@ -273,6 +289,7 @@ void _start() {
     // setup the basic memory management
     //
     RETHROW(init_virt_early());
+    RETHROW(init_acpi_numa());
     RETHROW(init_phys());
     init_logging();
 
@@ -302,6 +319,7 @@ void _start() {
     init_timers();
 
     // setup the scheduler structures
+    RETHROW(init_threads());
     RETHROW(init_scheduler());
 
     // perform cpu startup
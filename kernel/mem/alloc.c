@@ -1,83 +1,545 @@
 #include "alloc.h"
 
+#include <stdatomic.h>
+
+#include <arch/smp.h>
+#include <debug/heap_profile.h>
 #include <lib/list.h>
 #include <lib/string.h>
 #include <sync/spinlock.h>
+#include <thread/pcpu.h>
+#include <thread/scheduler.h>
+#include <time/timer.h>
+#include <time/tsc.h>
 
 #include "memory.h"
 #include "phys.h"
+#include "reclaim.h"
+#include "virt.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Size classes
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The kernel heap is split into 64 regions of 256GB each, one for each size class. Each region starts
+// with an array of slab descriptors (faulted in lazily like the rest of the heap) followed by the
+// slabs themselves. This means that both the size class and the slab of a pointer can be found just
+// from the address, without any lookup.
+//
+// The small classes are spaced so the waste is at most 25%, anything above 2kb is a power of two
+// and gets its own slab once it is large enough.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define ALLOC_HEAP_BASE         0xFFFFC00000000000ULL
+#define ALLOC_REGION_SIZE       SIZE_256GB
+
+/**
+ * The top and bottom address of the heap region of the given class
+ */
+#define ALLOC_REGION_BOTTOM(class)     (((class) * ALLOC_REGION_SIZE) + ALLOC_HEAP_BASE)
+#define ALLOC_REGION_TOP(class)        ((((class) + 1) * ALLOC_REGION_SIZE) + ALLOC_HEAP_BASE)
+
+/**
+ * The minimum size of a slab, classes larger than this
+ * get a slab per object
+ */
+#define ALLOC_SLAB_SIZE         SIZE_64KB
+
+/**
+ * The size of each of the classes, the last one must be
+ * the largest allocation we support
+ */
+static const uint32_t m_class_sizes[] = {
+    8, 16, 24, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    SIZE_4KB, SIZE_8KB, SIZE_16KB, SIZE_32KB, SIZE_64KB, SIZE_128KB, SIZE_256KB, SIZE_512KB,
+    SIZE_1MB, SIZE_2MB, SIZE_4MB, SIZE_8MB, SIZE_16MB, SIZE_32MB, SIZE_64MB, SIZE_128MB,
+};
+
+#define ALLOC_CLASS_COUNT       ARRAY_LENGTH(m_class_sizes)
+STATIC_ASSERT(ALLOC_CLASS_COUNT * ALLOC_REGION_SIZE <= SIZE_16TB);
 
 /**
- * The top and bottom address of the GC region of the given order
+ * The largest size handled by the small class lookup table, and
+ * the first power of two class after it
  */
-#define ALLOC_REGION_BOTTOM(order)     ((order * SIZE_512GB) + 0xFFFFC00000000000ULL)
-#define ALLOC_REGION_TOP(order)        (((order + 1) * SIZE_512GB) + 0xFFFFC00000000000ULL)
+#define ALLOC_SMALL_MAX         2048
+#define ALLOC_FIRST_LARGE_CLASS 26
 
-typedef struct alloc_region {
-    // lock to protect the order
-    // TODO: replace with mutex
-    spinlock_t lock;
+/**
+ * Maps (size + 7) / 8 to the class for small sizes
+ */
+static uint8_t m_small_class_lookup[ALLOC_SMALL_MAX / 8 + 1];
 
-    // already allocated blocks that can be used
+typedef struct alloc_slab {
+    // the free blocks of this slab
     void** freelist;
 
-    // the watermark in the region
-    void* watermark;
+    // the amount of allocated blocks in the slab
+    uint32_t used;
+
+    // the amount of blocks that were ever handed out, anything
+    // above this was never touched
+    uint32_t watermark;
+
+    // link in one of the slab lists of the class, NULL
+    // if the slab is not in any list
+    list_entry_t link;
+
+    // the tsc of when the slab became empty
+    uint64_t empty_since;
+} alloc_slab_t;
+
+typedef struct alloc_class {
+    // lock to protect the class, we take it with interrupts disabled
+    // so the holder can't be preempted while someone waits for it with
+    // interrupts disabled
+    irq_spinlock_t lock;
+
+    // the size of each block
+    size_t size;
 
-    // the max objects we can fit in this allocator level
-    void* top;
-} alloc_region_t;
+    // the size of each slab, and how many blocks fit in it
+    size_t slab_size;
+    size_t slab_blocks;
+
+    // the slab descriptors, and the address of the first slab
+    alloc_slab_t* slabs;
+    void* slabs_base;
+
+    // the amount of slabs that were ever used, and
+    // the max amount that fits in the region
+    size_t slab_watermark;
+    size_t slab_count;
+
+    // slabs that have both free and used blocks in them
+    list_t partial;
+
+    // slabs that are completely free but still have memory committed to them,
+    // ordered by the time they became empty, oldest first
+    list_t empty;
+    size_t empty_count;
+
+    // slabs that had all their memory returned
+    list_t decommitted;
+} alloc_class_t;
 
 /**
- * The allocator regions
- * goes from 8 bytes to 128mb
+ * The allocator classes
  */
-static alloc_region_t m_mem_global_regions[24];
+static alloc_class_t m_classes[ALLOC_CLASS_COUNT];
+
+/**
+ * The amount of classes that have a per-cpu cache, from 8 bytes to 4kb,
+ * larger allocations are rare enough to just go to the global region
+ */
+#define ALLOC_MAGAZINE_CLASSES  (ALLOC_FIRST_LARGE_CLASS + 1)
+
+/**
+ * The amount of blocks each magazine can hold, and the amount
+ * of blocks we move from/to the global region at once
+ */
+#define ALLOC_MAGAZINE_SIZE     32
+#define ALLOC_MAGAZINE_BATCH    (ALLOC_MAGAZINE_SIZE / 2)
+
+typedef struct alloc_magazine {
+    // the amount of blocks in the magazine
+    size_t count;
+
+    // the blocks themselves
+    void* blocks[ALLOC_MAGAZINE_SIZE];
+} alloc_magazine_t;
+
+/**
+ * The per-cpu cache of blocks, accessed only with interrupts
+ * disabled so we won't get migrated or interrupted while using it
+ */
+static CPU_LOCAL alloc_magazine_t m_magazines[ALLOC_MAGAZINE_CLASSES];
+
+#ifdef ALLOC_BENCHMARK
+/**
+ * Cleared by the benchmark to measure the heap without the magazines
+ */
+static bool m_magazines_enabled = true;
+#endif
+
+/**
+ * Should the class go through the per-cpu magazines
+ */
+static inline bool class_uses_magazine(int class_idx) {
+#ifdef ALLOC_BENCHMARK
+    if (!m_magazines_enabled) {
+        return false;
+    }
+#endif
+    return class_idx < ALLOC_MAGAZINE_CLASSES;
+}
 
 void init_alloc(void) {
-    for (int i = 0; i < ARRAY_LENGTH(m_mem_global_regions); i++) {
-        alloc_region_t* order = &m_mem_global_regions[i];
-        order->freelist = NULL;
-        order->lock = SPINLOCK_INIT;
-        order->watermark = (void*)ALLOC_REGION_BOTTOM(i);
-        order->top = (void*)ALLOC_REGION_TOP(i);
+    for (int i = 0; i < ALLOC_CLASS_COUNT; i++) {
+        alloc_class_t* class = &m_classes[i];
+        class->lock = IRQ_SPINLOCK_INIT;
+        class->size = m_class_sizes[i];
+        list_init(&class->partial);
+        list_init(&class->empty);
+        list_init(&class->decommitted);
+
+        // small classes share a slab, large classes get a slab each
+        class->slab_size = class->size > ALLOC_SLAB_SIZE ? class->size : ALLOC_SLAB_SIZE;
+        class->slab_blocks = class->slab_size / class->size;
+
+        // the slab descriptors are at the start of the region, the
+        // slabs come right after and are aligned to their size
+        size_t max_slabs = ALLOC_REGION_SIZE / class->slab_size;
+        size_t descriptors_size = ALIGN_UP(max_slabs * sizeof(alloc_slab_t), class->slab_size);
+        class->slabs = (alloc_slab_t*)ALLOC_REGION_BOTTOM(i);
+        class->slabs_base = (void*)ALLOC_REGION_BOTTOM(i) + descriptors_size;
+        class->slab_count = (ALLOC_REGION_SIZE - descriptors_size) / class->slab_size;
+        class->slab_watermark = 0;
+    }
+
+    // setup the small lookup table, each entry is the
+    // smallest class that can fit the size
+    int class = 0;
+    for (int i = 0; i < ARRAY_LENGTH(m_small_class_lookup); i++) {
+        while (m_class_sizes[class] < i * 8) {
+            class++;
+        }
+        m_small_class_lookup[i] = class;
     }
 }
 
-void* mem_alloc(size_t size) {
-    // align to the smallest size we can allocate
-    if (size < 8) {
-        size = 8;
+/**
+ * Get the class of the given size, -1 if too large
+ */
+static int get_class_by_size(size_t size) {
+    if (size <= ALLOC_SMALL_MAX) {
+        return m_small_class_lookup[(size + 7) / 8];
     }
 
-    // get the region for the correct order
-    size_t aligned_size = 1 << ((sizeof(size) * 8) - __builtin_clzl(size - 1));
-    int order = ((sizeof(aligned_size) * 8) - 1 - __builtin_clzl(aligned_size)) - 3;
-    if (order < 0) {
-        order = 0;
-    } else if (order >= ARRAY_LENGTH(m_mem_global_regions)) {
-        WARN("Failed to allocate an object of size %lu", size);
-        return NULL;
+    if (size > SIZE_128MB) {
+        return -1;
     }
 
-    // TODO: per-cpu cache
+    // power of two classes from 4kb
+    int log2 = (sizeof(size) * 8) - __builtin_clzl(size - 1);
+    return ALLOC_FIRST_LARGE_CLASS + (log2 - 12);
+}
+
+/**
+ * Get the class of an allocated pointer
+ */
+static int get_class_by_ptr(void* ptr) {
+    return ((uintptr_t)ptr - ALLOC_HEAP_BASE) / ALLOC_REGION_SIZE;
+}
+
+static alloc_slab_t* get_slab_by_ptr(alloc_class_t* class, void* ptr) {
+    return &class->slabs[(ptr - class->slabs_base) / class->slab_size];
+}
+
+static void* get_slab_base(alloc_class_t* class, alloc_slab_t* slab) {
+    return class->slabs_base + (slab - class->slabs) * class->slab_size;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Slab management
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    alloc_region_t* region = &m_mem_global_regions[order];
+/**
+ * Pop a single block from the class, must be called with the lock held
+ */
+static void* class_pop(alloc_class_t* class) {
+    alloc_slab_t* slab;
+    if (!list_is_empty(&class->partial)) {
+        slab = containerof(class->partial.next, alloc_slab_t, link);
+    } else if (!list_is_empty(&class->empty)) {
+        // take the most recently emptied slab, it is the most likely
+        // to still be in the cache, and leaves the old ones for decommit
+        slab = containerof(class->empty.prev, alloc_slab_t, link);
+        list_del(&slab->link);
+        list_add(&class->partial, &slab->link);
+        class->empty_count--;
+    } else if (!list_is_empty(&class->decommitted)) {
+        // reuse a decommitted slab, the memory will be faulted in again
+        slab = containerof(list_pop(&class->decommitted), alloc_slab_t, link);
+        list_add(&class->partial, &slab->link);
+    } else if (class->slab_watermark < class->slab_count) {
+        // take a new slab, the descriptor is zeroed when first faulted
+        slab = &class->slabs[class->slab_watermark++];
+        list_add(&class->partial, &slab->link);
+    } else {
+        return NULL;
+    }
 
-    // pop a block from the region
-    spinlock_acquire(&region->lock);
-    void** block = region->freelist;
+    // take either a free block or a new one
+    void** block = slab->freelist;
     if (block != NULL) {
-        region->freelist = *block;
-    } else if (region->watermark < region->top) {
-        block = region->watermark;
-        region->watermark += aligned_size;
+        slab->freelist = *block;
+    } else {
+        ASSERT(slab->watermark < class->slab_blocks);
+        block = get_slab_base(class, slab) + slab->watermark * class->size;
+        slab->watermark++;
+    }
+
+    // the slab is full, remove it from the partial list
+    slab->used++;
+    if (slab->used == class->slab_blocks) {
+        list_del(&slab->link);
+        slab->link.next = NULL;
     }
-    spinlock_release(&region->lock);
 
     return block;
 }
 
+/**
+ * Push a single block to its slab, must be called with the lock held
+ */
+static void class_push(alloc_class_t* class, void* ptr) {
+    alloc_slab_t* slab = get_slab_by_ptr(class, ptr);
+    ASSERT(slab->used != 0);
+
+    void** block = ptr;
+    *block = slab->freelist;
+    slab->freelist = block;
+
+    // the slab has room again
+    if (slab->link.next == NULL) {
+        list_add(&class->partial, &slab->link);
+    }
+
+    // the slab is completely free, move it to the empty list
+    // so it can be decommitted if it stays like that
+    slab->used--;
+    if (slab->used == 0) {
+        list_del(&slab->link);
+        list_add_tail(&class->empty, &slab->link);
+        class->empty_count++;
+        slab->empty_since = get_tsc();
+    }
+}
+
+/**
+ * Fill the magazine with a batch of blocks from the class,
+ * returns false if the class is out of memory
+ */
+static bool magazine_fill(alloc_magazine_t* magazine, alloc_class_t* class) {
+    bool irq_state = irq_spinlock_acquire(&class->lock);
+    while (magazine->count < ALLOC_MAGAZINE_BATCH) {
+        void* block = class_pop(class);
+        if (block == NULL) {
+            break;
+        }
+        magazine->blocks[magazine->count++] = block;
+    }
+    irq_spinlock_release(&class->lock, irq_state);
+
+    return magazine->count != 0;
+}
+
+/**
+ * Return a batch of blocks from the magazine to the class
+ */
+static void magazine_flush(alloc_magazine_t* magazine, alloc_class_t* class) {
+    bool irq_state = irq_spinlock_acquire(&class->lock);
+    while (magazine->count > ALLOC_MAGAZINE_SIZE - ALLOC_MAGAZINE_BATCH) {
+        class_push(class, magazine->blocks[--magazine->count]);
+    }
+    irq_spinlock_release(&class->lock, irq_state);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decommit
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * How long a slab needs to be empty before the background
+ * decommit will return its memory, and how often it runs
+ */
+#define ALLOC_DECOMMIT_DELAY_MS     1000
+
+/**
+ * The amount of empty slabs the background decommit
+ * leaves in each class to absorb allocation spikes
+ */
+#define ALLOC_DECOMMIT_KEEP_EMPTY   1
+
+/**
+ * Decommit empty slabs from the class, only slabs that became empty before
+ * the cutoff are decommitted, returns the amount of pages that were freed
+ */
+static size_t class_decommit(alloc_class_t* class, uint64_t cutoff, size_t keep, size_t target_pages) {
+    size_t freed = 0;
+
+    while (freed < target_pages) {
+        // take the oldest empty slab
+        bool irq_state = irq_spinlock_acquire(&class->lock);
+        if (class->empty_count <= keep) {
+            irq_spinlock_release(&class->lock, irq_state);
+            break;
+        }
+
+        alloc_slab_t* slab = containerof(class->empty.next, alloc_slab_t, link);
+        if (slab->empty_since > cutoff) {
+            irq_spinlock_release(&class->lock, irq_state);
+            break;
+        }
+
+        // remove it from the lists so no one will allocate from it
+        // while we are releasing the memory
+        list_del(&slab->link);
+        slab->link.next = NULL;
+        class->empty_count--;
+        size_t used_bytes = slab->watermark * class->size;
+        irq_spinlock_release(&class->lock, irq_state);
+
+        // only the part of the slab that was ever handed out can be mapped
+        void* base = get_slab_base(class, slab);
+        freed += virt_decommit_range((uintptr_t)base, SIZE_TO_PAGES(used_bytes));
+
+        // the slab is now as good as new
+        irq_state = irq_spinlock_acquire(&class->lock);
+        slab->freelist = NULL;
+        slab->watermark = 0;
+        list_add(&class->decommitted, &slab->link);
+        irq_spinlock_release(&class->lock, irq_state);
+    }
+
+    return freed;
+}
+
+static size_t alloc_shrinker_reclaim(size_t target_pages) {
+    // under pressure we ignore the delay and don't keep anything around
+    size_t freed = 0;
+    for (int i = ALLOC_CLASS_COUNT - 1; i >= 0 && freed < target_pages; i--) {
+        freed += class_decommit(&m_classes[i], UINT64_MAX, 0, target_pages - freed);
+    }
+    return freed;
+}
+
+/**
+ * Return all the blocks in the magazines of the current core to their classes,
+ * so the slabs they came from can become empty and decommitted
+ */
+static void alloc_drain_cpu(void) {
+    for (int i = 0; i < ALLOC_MAGAZINE_CLASSES; i++) {
+        alloc_magazine_t* magazine = pcpu_get_pointer(&m_magazines[i]);
+        if (magazine->count == 0) {
+            continue;
+        }
+
+        alloc_class_t* class = &m_classes[i];
+        bool irq_state = irq_spinlock_acquire(&class->lock);
+        while (magazine->count != 0) {
+            class_push(class, magazine->blocks[--magazine->count]);
+        }
+        irq_spinlock_release(&class->lock, irq_state);
+    }
+}
+
+static shrinker_t m_alloc_shrinker = {
+    .name = "kernel heap",
+    .reclaim = alloc_shrinker_reclaim,
+    .drain_cpu = alloc_drain_cpu,
+};
+
+static void alloc_decommit_thread(void* arg) {
+    for (;;) {
+        timer_sleep(ALLOC_DECOMMIT_DELAY_MS);
+
+        uint64_t cutoff = get_tsc() - ms_to_tsc(ALLOC_DECOMMIT_DELAY_MS);
+        size_t freed = 0;
+        for (int i = 0; i < ALLOC_CLASS_COUNT; i++) {
+            freed += class_decommit(&m_classes[i], cutoff, ALLOC_DECOMMIT_KEEP_EMPTY, SIZE_MAX);
+        }
+
+        if (freed != 0) {
+            TRACE("memory: decommitted %zu heap pages", freed);
+        }
+    }
+}
+
+err_t init_alloc_decommit(void) {
+    err_t err = NO_ERROR;
+
+    thread_t* thread = thread_create(alloc_decommit_thread, NULL, "heap decommit");
+    CHECK_ERROR(thread != NULL, ERROR_OUT_OF_MEMORY);
+    scheduler_wakeup_thread(thread);
+
+    reclaim_register_shrinker(&m_alloc_shrinker);
+
+cleanup:
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation API
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void* alloc_from_class(int class_idx) {
+    alloc_class_t* class = &m_classes[class_idx];
+
+    heap_profile_account(HEAP_PROFILE_KERNEL, class->size);
+
+    // small allocations go through the per-cpu cache
+    if (class_uses_magazine(class_idx)) {
+        void* block = NULL;
+
+        bool irq_state = irq_save();
+        alloc_magazine_t* magazine = pcpu_get_pointer(&m_magazines[class_idx]);
+        if (magazine->count != 0 || magazine_fill(magazine, class)) {
+            block = magazine->blocks[--magazine->count];
+        }
+        irq_restore(irq_state);
+
+        return block;
+    }
+
+    // pop a block from the class
+    bool irq_state = irq_spinlock_acquire(&class->lock);
+    void* block = class_pop(class);
+    irq_spinlock_release(&class->lock, irq_state);
+
+    return block;
+}
+
+void* mem_alloc(size_t size) {
+    int class_idx = get_class_by_size(size);
+    if (class_idx < 0) {
+        WARN("Failed to allocate an object of size %lu", size);
+        return NULL;
+    }
+
+    return alloc_from_class(class_idx);
+}
+
+void* mem_alloc_aligned(size_t size, size_t align) {
+    // every block is at least 8 byte aligned
+    if (align <= 8) {
+        return mem_alloc(size);
+    }
+    ASSERT((align & (align - 1)) == 0);
+
+    // the slabs are aligned to their size and the blocks are laid out
+    // back to back, so a block is aligned to the largest power of two
+    // that divides its size, the classes from 4kb and up are powers of
+    // two so we will always find one if the alignment is not too large
+    int class_idx = get_class_by_size(size > align ? size : align);
+    while (class_idx >= 0 && class_idx < ALLOC_CLASS_COUNT && (m_class_sizes[class_idx] & (align - 1)) != 0) {
+        class_idx++;
+    }
+
+    if (class_idx < 0 || class_idx >= ALLOC_CLASS_COUNT) {
+        WARN("Failed to allocate an object of size %lu aligned to %lu", size, align);
+        return NULL;
+    }
+
+    return alloc_from_class(class_idx);
+}
+
 void* mem_realloc(void* ptr, size_t size) {
     if (size == 0) {
         mem_free(ptr);
@@ -87,9 +549,8 @@ void* mem_realloc(void* ptr, size_t size) {
     // if we have a non-null pointer we can attempt and reuse it
     size_t old_max_size = 0;
     if (ptr != NULL) {
-        // figure the current order
-        int order = ((uintptr_t)ptr - 0xFFFFC00000000000ULL) / SIZE_512GB;
-        old_max_size = 1ull << (order + 3);
+        // figure the current class
+        old_max_size = m_classes[get_class_by_ptr(ptr)].size;
 
         // the size still fits within the current block,
         // return as is
@@ -120,13 +581,120 @@ void mem_free(void* ptr) {
         return;
     }
 
-    int order = ((uintptr_t)ptr - 0xFFFFC00000000000ULL) / SIZE_512GB;
-    alloc_region_t* region = &m_mem_global_regions[order];
+    int class_idx = get_class_by_ptr(ptr);
+    alloc_class_t* class = &m_classes[class_idx];
+
+    // small allocations go back to the per-cpu cache
+    if (class_uses_magazine(class_idx)) {
+        bool irq_state = irq_save();
+        alloc_magazine_t* magazine = pcpu_get_pointer(&m_magazines[class_idx]);
+        if (magazine->count == ALLOC_MAGAZINE_SIZE) {
+            magazine_flush(magazine, class);
+        }
+        magazine->blocks[magazine->count++] = ptr;
+        irq_restore(irq_state);
+        return;
+    }
 
     // push a the pointer back
-    spinlock_acquire(&region->lock);
-    void** block = ptr;
-    *block = region->freelist;
-    region->freelist = block;
-    spinlock_release(&region->lock);
+    bool irq_state = irq_spinlock_acquire(&class->lock);
+    class_push(class, ptr);
+    irq_spinlock_release(&class->lock, irq_state);
+}
+
+#ifdef ALLOC_BENCHMARK
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Benchmark
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// A thread is pinned to each core, and all of them allocate and free batches of the same size at the same time,
+// once through the magazines and once straight from the classes, so the cost of the class locks under contention
+// can be compared to the per-cpu path.
+//
+
+/**
+ * The amount of blocks each thread holds at once, and the amount of times it allocates and frees them
+ */
+#define ALLOC_BENCH_BATCH       64
+#define ALLOC_BENCH_ROUNDS      2000
+
+static const size_t m_alloc_bench_sizes[] = { 16, 64, 256, 1024 };
+
+typedef struct alloc_bench {
+    size_t size;
+
+    // the threads wait until all of them started so they actually contend
+    atomic_size_t started;
+    atomic_bool go;
+    atomic_size_t done;
+
+    // the total cycles of all the threads
+    atomic_uint_fast64_t cycles;
+} alloc_bench_t;
+
+static void alloc_bench_thread(void* arg) {
+    alloc_bench_t* bench = arg;
+    void* blocks[ALLOC_BENCH_BATCH];
+
+    atomic_fetch_add(&bench->started, 1);
+    while (!atomic_load(&bench->go)) {
+        scheduler_yield();
+    }
+
+    uint64_t start = get_tsc();
+    for (int i = 0; i < ALLOC_BENCH_ROUNDS; i++) {
+        for (int j = 0; j < ALLOC_BENCH_BATCH; j++) {
+            blocks[j] = mem_alloc(bench->size);
+            ASSERT(blocks[j] != NULL);
+        }
+        for (int j = 0; j < ALLOC_BENCH_BATCH; j++) {
+            mem_free(blocks[j]);
+        }
+    }
+    atomic_fetch_add(&bench->cycles, get_tsc() - start);
+
+    // the bench lives on the stack of the caller, so
+    // it must not be touched after this
+    atomic_fetch_add(&bench->done, 1);
 }
+
+/**
+ * Run a single round on all the cores, returns the average cycles per operation
+ */
+static uint64_t alloc_bench_run(size_t size, bool magazines) {
+    alloc_bench_t bench = { .size = size };
+    m_magazines_enabled = magazines;
+
+    for (int i = 0; i < g_cpu_count; i++) {
+        thread_t* thread = thread_create(alloc_bench_thread, &bench, "alloc bench %d", i);
+        ASSERT(thread != NULL);
+        scheduler_wakeup_thread_on(thread, i);
+    }
+
+    while (atomic_load(&bench.started) != g_cpu_count) {
+        scheduler_yield();
+    }
+    atomic_store(&bench.go, true);
+
+    while (atomic_load(&bench.done) != g_cpu_count) {
+        scheduler_yield();
+    }
+
+    m_magazines_enabled = true;
+
+    // every round is an allocation and a free of each block
+    return atomic_load(&bench.cycles) / (g_cpu_count * ALLOC_BENCH_ROUNDS * ALLOC_BENCH_BATCH * 2);
+}
+
+void alloc_benchmark(void) {
+    TRACE("memory: heap benchmark on %zu cores, cycles per operation:", g_cpu_count);
+    for (int i = 0; i < ARRAY_LENGTH(m_alloc_bench_sizes); i++) {
+        size_t size = m_alloc_bench_sizes[i];
+        uint64_t with = alloc_bench_run(size, true);
+        uint64_t without = alloc_bench_run(size, false);
+        TRACE("memory: \t%4zu bytes: %lu with magazines, %lu without", size, with, without);
+    }
+}
+
+#endif
@@ -2,11 +2,32 @@
 
 #include <stddef.h>
 #include <lib/string.h>
+#include <lib/except.h>
 
 void init_alloc(void);
 
+/**
+ * Start returning the memory of empty heap slabs
+ * back to the physical allocator
+ */
+err_t init_alloc_decommit(void);
+
 void* mem_alloc(size_t size);
 
+/**
+ * Allocate a block aligned to the given power of two, the alignment is
+ * not kept when the block is reallocated to a larger size
+ */
+void* mem_alloc_aligned(size_t size, size_t align);
+
 void* mem_realloc(void* ptr, size_t size);
 
 void mem_free(void* ptr);
+
+#ifdef ALLOC_BENCHMARK
+/**
+ * Measure the heap from all the cores, with and without the per-cpu
+ * magazines, needs the scheduler to be running
+ */
+void alloc_benchmark(void);
+#endif
@@ -0,0 +1,131 @@
+#include "arena.h"
+
+#include <stdbool.h>
+
+#include <lib/defs.h>
+#include <lib/except.h>
+#include <lib/string.h>
+
+#include "alloc.h"
+
+/**
+ * The default size of a chunk, allocations that don't
+ * fit in it get a chunk of their own
+ */
+#define ARENA_CHUNK_SIZE    SIZE_64KB
+
+struct arena_chunk {
+    // the next (older) chunk
+    arena_chunk_t* next;
+    uint64_t _reserved;
+};
+
+/**
+ * Every allocation has its size and alignment right before it, used for realloc
+ */
+typedef struct arena_header {
+    size_t size;
+    size_t align;
+} arena_header_t;
+
+#define ARENA_HEADER(ptr)   (&((arena_header_t*)(ptr))[-1])
+
+void arena_init(arena_t* arena) {
+    arena->chunks = NULL;
+    arena->current = NULL;
+    arena->end = NULL;
+    arena->last = NULL;
+}
+
+/**
+ * Take a new chunk that can fit the given allocation
+ */
+static bool arena_grow(arena_t* arena, size_t size, size_t align) {
+    size_t chunk_size = sizeof(arena_chunk_t) + sizeof(arena_header_t) + align + size;
+    if (chunk_size < ARENA_CHUNK_SIZE) {
+        chunk_size = ARENA_CHUNK_SIZE;
+    }
+
+    arena_chunk_t* chunk = mem_alloc(chunk_size);
+    if (chunk == NULL) {
+        return false;
+    }
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->current = chunk + 1;
+    arena->end = (void*)chunk + chunk_size;
+    arena->last = NULL;
+
+    return true;
+}
+
+void* arena_alloc(arena_t* arena, size_t size, size_t align) {
+    if (align < sizeof(size_t)) {
+        align = sizeof(size_t);
+    }
+    ASSERT((align & (align - 1)) == 0);
+
+    // leave room for the header right before the allocation
+    void* ptr = ALIGN_UP(arena->current + sizeof(arena_header_t), align);
+    if (arena->current == NULL || ptr + size > arena->end) {
+        if (!arena_grow(arena, size, align)) {
+            return NULL;
+        }
+        ptr = ALIGN_UP(arena->current + sizeof(arena_header_t), align);
+    }
+
+    ARENA_HEADER(ptr)->size = size;
+    ARENA_HEADER(ptr)->align = align;
+    arena->current = ptr + size;
+    arena->last = ptr;
+
+    return ptr;
+}
+
+void* arena_realloc(arena_t* arena, void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return arena_alloc(arena, size, sizeof(size_t));
+    }
+
+    // still fits
+    size_t old_size = ARENA_HEADER(ptr)->size;
+    if (size <= old_size) {
+        return ptr;
+    }
+
+    // the last allocation can just move the bump pointer,
+    // this is the common case of a growing array
+    if (ptr == arena->last && ptr + size <= arena->end) {
+        ARENA_HEADER(ptr)->size = size;
+        arena->current = ptr + size;
+        return ptr;
+    }
+
+    // keep the alignment the allocation was made with
+    void* new_ptr = arena_alloc(arena, size, ARENA_HEADER(ptr)->align);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size);
+
+    return new_ptr;
+}
+
+void arena_free(arena_t* arena, void* ptr) {
+    if (ptr != NULL && ptr == arena->last) {
+        arena->current = ptr - sizeof(arena_header_t);
+        arena->last = NULL;
+    }
+}
+
+void arena_reset(arena_t* arena) {
+    arena_chunk_t* chunk = arena->chunks;
+    while (chunk != NULL) {
+        arena_chunk_t* next = chunk->next;
+        mem_free(chunk);
+        chunk = next;
+    }
+
+    arena_init(arena);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct arena_chunk arena_chunk_t;
+
+/**
+ * A bump allocator for short lived allocations that are all freed
+ * at once, an arena is owned by a single thread and is not locked
+ */
+typedef struct arena {
+    // the chunks of the arena, newest first
+    arena_chunk_t* chunks;
+
+    // the bump pointer inside of the newest chunk
+    void* current;
+    void* end;
+
+    // the last allocation, can be grown or freed in place
+    void* last;
+} arena_t;
+
+/**
+ * Initialize an empty arena, no memory is taken until the first allocation
+ */
+void arena_init(arena_t* arena);
+
+/**
+ * Allocate from the arena, the memory is not zeroed
+ */
+void* arena_alloc(arena_t* arena, size_t size, size_t align);
+
+/**
+ * Grow an allocation from the arena, done in place when it is the last
+ * allocation, the allocation keeps the alignment it was made with
+ */
+void* arena_realloc(arena_t* arena, void* ptr, size_t size);
+
+/**
+ * Free an allocation from the arena, the memory is only
+ * reclaimed when it is the last allocation
+ */
+void arena_free(arena_t* arena, void* ptr);
+
+/**
+ * Free all the memory of the arena at once, the arena can be used again
+ */
+void arena_reset(arena_t* arena);
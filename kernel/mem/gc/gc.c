@@ -1,95 +1,884 @@
 #include "gc.h"
 
+#include <arch/smp.h>
+#include <debug/heap_profile.h>
 #include <lib/list.h>
+#include <lib/string.h>
+#include <limine_requests.h>
+#include <mem/alloc.h>
+#include <mem/reclaim.h>
+#include <runtime/tdn.h>
 #include <sync/spinlock.h>
 #include <thread/pcpu.h>
+#include <thread/scheduler.h>
+#include <time/tsc.h>
 
 #include "tomatodotnet/types/basic.h"
+#include "gc_internal.h"
+
+gc_region_t g_gc_regions[GC_REGION_COUNT];
+
+/**
+ * The block size of each of the regions
+ */
+static const uint32_t m_gc_size_classes[GC_REGION_COUNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384, 20480, 24576, 28672, 32768,
+};
+
+atomic_bool g_gc_allocate_black = false;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The statistics that are updated once per cycle by the collector
+ */
+static size_t m_gc_major_cycles = 0;
+static size_t m_gc_total_allocated = 0;
+static size_t m_gc_total_freed = 0;
+static uint64_t m_gc_max_pause_us = 0;
+static size_t m_gc_pauses[GC_PAUSE_BUCKETS] = {};
+static irq_spinlock_t m_gc_stats_lock = IRQ_SPINLOCK_INIT;
+
+/**
+ * Trace every cycle and dump the statistics and the heap at the end of it, set by gcstats on the cmdline
+ */
+static bool m_gc_dump_stats = false;
+
+static void gc_stats_record_pause(uint64_t pause) {
+    uint64_t us = pause * 1000 / ms_to_tsc(1);
+
+    int bucket = us < 2 ? 0 : 63 - __builtin_clzl(us);
+    if (bucket >= GC_PAUSE_BUCKETS) {
+        bucket = GC_PAUSE_BUCKETS - 1;
+    }
+
+    bool irq_state = irq_spinlock_acquire(&m_gc_stats_lock);
+    m_gc_pauses[bucket]++;
+    if (us > m_gc_max_pause_us) {
+        m_gc_max_pause_us = us;
+    }
+    irq_spinlock_release(&m_gc_stats_lock, irq_state);
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// CPU Local caches
+// Pacing
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// After every cycle we set a heap goal based on the live heap and GOGC, the same as the Go runtime: with the default
+// of 100 the heap may grow to twice the live heap before the next cycle must be done. The next cycle is triggered
+// early enough that, given the allocation rate and the time the last cycles took, it will finish before the heap
+// reaches the goal.
+//
+
+/**
+ * The default GOGC, can be set with `gogc=<percent>` or disabled with `gogc=off` in the kernel cmdline
+ */
+#define GC_DEFAULT_GOGC     100
+
+/**
+ * The heap goal is never set below this
+ */
+#define GC_MIN_HEAP_GOAL    SIZE_16MB
+
+/**
+ * The GOGC percent, zero if the pacer is disabled
+ */
+static size_t m_gc_gogc = GC_DEFAULT_GOGC;
+
+/**
+ * The amount of bytes that were taken from the heap and not yet freed,
+ * blocks in the TLABs are counted as soon as they are taken
+ */
+static atomic_size_t m_gc_heap_in_use = 0;
 
 /**
- * The top and bottom address of the GC region of the given order
+ * The amount of bytes allocated since the last cycle ended
  */
-#define GC_REGION_BOTTOM(order)     ((order * SIZE_512GB) + 0xFFFF810000000000ULL)
-#define GC_REGION_TOP(order)        (((order + 1) * SIZE_512GB) + 0xFFFF810000000000ULL)
+static atomic_size_t m_gc_allocated_bytes = 0;
 
-typedef struct gc_region {
-    // lock to protect the order
-    // TODO: replace with mutex
-    spinlock_t lock;
+/**
+ * Start a new cycle once the heap in use reaches the trigger
+ */
+static atomic_size_t m_gc_trigger = GC_MIN_HEAP_GOAL / 2;
+
+/**
+ * The state of the pacer, only touched by the collector
+ */
+static size_t m_gc_heap_goal = GC_MIN_HEAP_GOAL;
+static size_t m_gc_alloc_rate = 0;
+static uint64_t m_gc_cycle_time = 0;
+static uint64_t m_gc_last_cycle_end = 0;
+
+static void gc_account_alloc(size_t bytes) {
+    atomic_fetch_add_explicit(&m_gc_heap_in_use, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m_gc_allocated_bytes, bytes, memory_order_relaxed);
+}
+
+/**
+ * Set the goal and trigger of the next cycle, called once the cycle is done
+ */
+static void gc_pacer_update(uint64_t cycle_start, size_t freed) {
+    uint64_t now = get_tsc();
+    size_t live = atomic_fetch_sub_explicit(&m_gc_heap_in_use, freed, memory_order_relaxed) - freed;
 
-    // already allocated blocks that can be used
-    void** freelist;
+    // smooth the cycle time and the allocation rate so a single
+    // cycle won't throw the trigger off too much
+    uint64_t cycle_time = now - cycle_start;
+    m_gc_cycle_time = m_gc_cycle_time == 0 ? cycle_time : (m_gc_cycle_time * 3 + cycle_time) / 4;
 
-    // the watermark in the region
-    void* watermark;
+    size_t allocated = atomic_exchange_explicit(&m_gc_allocated_bytes, 0, memory_order_relaxed);
+
+    bool irq_state = irq_spinlock_acquire(&m_gc_stats_lock);
+    m_gc_total_allocated += allocated;
+    m_gc_total_freed += freed;
+    irq_spinlock_release(&m_gc_stats_lock, irq_state);
+    uint64_t elapsed_ms = (now - m_gc_last_cycle_end) / ms_to_tsc(1);
+    if (elapsed_ms != 0) {
+        size_t rate = allocated / elapsed_ms;
+        m_gc_alloc_rate = m_gc_alloc_rate == 0 ? rate : (m_gc_alloc_rate * 3 + rate) / 4;
+    }
+    m_gc_last_cycle_end = now;
 
-    // the max objects we can fit in this allocator level
-    void* top;
-} gc_region_t;
+    if (m_gc_gogc == 0) {
+        atomic_store_explicit(&m_gc_trigger, SIZE_MAX, memory_order_relaxed);
+        return;
+    }
 
-static gc_region_t m_gc_global_regions[27];
+    size_t goal = live + live / 100 * m_gc_gogc;
+    if (goal < GC_MIN_HEAP_GOAL) {
+        goal = GC_MIN_HEAP_GOAL;
+    }
 
-void gc_init() {
-    for (int i = 0; i < ARRAY_LENGTH(m_gc_global_regions); i++) {
-        gc_region_t* order = &m_gc_global_regions[i];
-        order->freelist = NULL;
-        order->lock = SPINLOCK_INIT;
-        order->watermark = (void*)GC_REGION_BOTTOM(i);
-        order->top = (void*)GC_REGION_TOP(i);
+    // leave enough room for what is going to be allocated while the next
+    // cycle runs, with some margin, but don't start right away
+    size_t runway = m_gc_alloc_rate * (m_gc_cycle_time / ms_to_tsc(1) + 1);
+    runway += runway / 4;
+    size_t min_trigger = live + (goal - live) / 4;
+    size_t max_trigger = goal - (goal - live) / 16;
+    size_t trigger = goal > runway ? goal - runway : 0;
+    if (trigger < min_trigger) {
+        trigger = min_trigger;
+    } else if (trigger > max_trigger) {
+        trigger = max_trigger;
     }
+
+    m_gc_heap_goal = goal;
+    atomic_store_explicit(&m_gc_trigger, trigger, memory_order_relaxed);
 }
 
-Object tdn_host_gc_alloc(ObjectVTable* vtable, size_t size, size_t alignment) {
-    // align to the smallest size we can allocate
-    if (size < 32) {
-        size = 32;
-    }
-
-    // get the region for the correct order
-    size_t aligned_size = 1 << ((sizeof(size) * 8) - __builtin_clzl(size - 1));
-    int order = ((sizeof(aligned_size) * 8) - 1 - __builtin_clzl(aligned_size)) - 5;
-    if (order < 0) {
-        order = 0;
-    } else if (order >= ARRAY_LENGTH(m_gc_global_regions)) {
-        WARN("Failed to allocate an object of size %lu", size);
-        return NULL;
+/**
+ * Should a new cycle be started
+ */
+static bool gc_pacer_should_trigger(void) {
+    return atomic_load_explicit(&m_gc_heap_in_use, memory_order_relaxed) >=
+           atomic_load_explicit(&m_gc_trigger, memory_order_relaxed);
+}
+
+/**
+ * Parse the GOGC and the gcstats flag from the kernel cmdline
+ */
+static void gc_parse_cmdline(void) {
+    if (g_limine_executable_file_request.response == NULL) {
+        return;
+    }
+
+    const char* cmdline = g_limine_executable_file_request.response->executable_file->string;
+    if (cmdline == NULL) {
+        return;
+    }
+
+    static const char option[] = "gogc=";
+    while (*cmdline != '\0') {
+        // find the next option
+        while (*cmdline == ' ') {
+            cmdline++;
+        }
+        const char* end = cmdline;
+        while (*end != '\0' && *end != ' ') {
+            end++;
+        }
+
+        if (end - cmdline == 7 && memcmp(cmdline, "gcstats", 7) == 0) {
+            m_gc_dump_stats = true;
+        } else if (end - cmdline > sizeof(option) - 1 && memcmp(cmdline, option, sizeof(option) - 1) == 0) {
+            const char* value = cmdline + sizeof(option) - 1;
+            if (end - value == 3 && memcmp(value, "off", 3) == 0) {
+                m_gc_gogc = 0;
+            } else {
+                size_t gogc = 0;
+                for (; value < end && '0' <= *value && *value <= '9'; value++) {
+                    gogc = gogc * 10 + (*value - '0');
+                }
+
+                if (value != end || gogc == 0) {
+                    WARN("gc: invalid gogc value, using the default");
+                } else {
+                    m_gc_gogc = gogc;
+                }
+            }
+        }
+
+        cmdline = end;
+    }
+
+    if (m_gc_gogc == 0) {
+        TRACE("gc: pacer is disabled");
+        atomic_store_explicit(&m_gc_trigger, SIZE_MAX, memory_order_relaxed);
+    } else {
+        TRACE("gc: using gogc=%lu", m_gc_gogc);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The collector thread
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef enum gc_state {
+    // the thread is running a cycle
+    GC_STATE_RUNNING,
+
+    // the thread is parked waiting to be kicked
+    GC_STATE_PARKED,
+
+    // the thread was kicked while running, it
+    // should do another cycle before parking
+    GC_STATE_KICKED,
+} gc_state_t;
+
+static thread_t* m_gc_thread = NULL;
+static _Atomic(gc_state_t) m_gc_state = GC_STATE_RUNNING;
+
+/**
+ * The amount of cycles that were started and completed, and the threads that
+ * are waiting for a cycle to complete, protected by the waiters lock
+ */
+static size_t m_gc_cycles_started = 0;
+static size_t m_gc_cycles = 0;
+static list_t m_gc_waiters = LIST_INIT(&m_gc_waiters);
+static irq_spinlock_t m_gc_waiters_lock = IRQ_SPINLOCK_INIT;
+
+/**
+ * Kick the collector to start a new cycle
+ */
+static void gc_kick(void) {
+    if (m_gc_thread == NULL) {
+        return;
+    }
+
+    if (atomic_exchange(&m_gc_state, GC_STATE_KICKED) == GC_STATE_PARKED) {
+        scheduler_wakeup_thread(m_gc_thread);
+    }
+}
+
+/**
+ * Set by the shrinker when a cycle is running, the next sweep gives back all the
+ * free pages it can instead of keeping the ones it expects to be used again soon
+ */
+static atomic_bool m_gc_memory_pressure = false;
+
+/**
+ * Taken by the collector for the whole cycle, and by the shrinker while it
+ * decommits the freelists, so the shrinker only sees a fully swept heap
+ */
+static atomic_bool m_gc_heap_busy = false;
+
+static size_t gc_shrinker_reclaim(size_t target_pages) {
+    // we can't wait for the cycle, the collector might need memory for
+    // itself, so the pages are given back in the background by its sweep
+    if (atomic_exchange(&m_gc_heap_busy, true)) {
+        atomic_store(&m_gc_memory_pressure, true);
+        gc_kick();
+        return 0;
+    }
+
+    size_t freed = gc_decommit_free(target_pages);
+    atomic_store(&m_gc_heap_busy, false);
+
+    return freed;
+}
+
+static shrinker_t m_gc_shrinker = {
+    .name = "gc heap",
+    .reclaim = gc_shrinker_reclaim,
+};
+
+/**
+ * The amount of minor cycles we do between full cycles
+ */
+#define GC_MINOR_CYCLES_PER_MAJOR   8
+
+static size_t m_gc_minor_cycles = 0;
+
+/**
+ * Set when someone explicitly asked for a full collection
+ */
+static atomic_bool m_gc_major_requested = false;
+
+static void gc_retire_tlabs(void);
+
+static void gc_cycle(bool major) {
+    uint64_t start = get_tsc();
+
+    // prepare for the cycle, a major cycle starts from scratch while a minor cycle
+    // keeps the marks, anything allocated from now on and until the final pause
+    // is going to be kept alive
+    if (major) {
+        gc_clear_marks();
+    }
+    atomic_store(&g_gc_allocate_black, true);
+    gc_clear_dirty(!major);
+
+    // take the roots
+    uint64_t pause_start = get_tsc();
+    gc_stop_the_world();
+    gc_mark_roots();
+    gc_resume_the_world(false);
+    uint64_t first_pause = get_tsc() - pause_start;
+
+    // the old objects that were written since the last cycle might
+    // point to young objects, so they are roots as well
+    if (!major) {
+        gc_mark_cards();
+    }
+
+    // mark concurrently with the mutators on all the cores, reading the heap
+    // through the RO shadow, the mutators writes are tracked with the dirty bits
+    gc_mark_parallel();
+
+    // finish the marking with the world stopped, rescan the roots and
+    // any marked object that was written to while we were marking
+    pause_start = get_tsc();
+    gc_stop_the_world();
+    gc_mark_roots();
+    gc_mark_dirty();
+    gc_mark_drain();
+    gc_process_handles();
+
+    // a full sweep rebuilds the freelists, so drop whatever the TLABs still hold, a minor
+    // sweep only adds the dead blocks to them so the TLABs are kept, but then the blocks
+    // taken from the unswept freelists are allocated black until the sweep is done
+    gc_sweep_start(!major);
+    if (major) {
+        gc_retire_tlabs();
+        atomic_store(&g_gc_allocate_black, false);
+    }
+    gc_resume_the_world(true);
+    uint64_t second_pause = get_tsc() - pause_start;
+
+    // the mutators sweep on demand, the collector sweeps whatever is left to know
+    // how much was freed, free pages above the goal (with some slack, so we won't
+    // thrash on the steady churn) are given back, or all of them if we are low on memory
+    size_t retain = m_gc_heap_goal + m_gc_heap_goal / 10;
+    if (atomic_exchange(&m_gc_memory_pressure, false)) {
+        retain = 0;
+    }
+    size_t decommitted;
+    size_t freed = gc_sweep(retain, &decommitted);
+    atomic_store(&g_gc_allocate_black, false);
+
+    gc_pacer_update(start, freed);
+
+    gc_stats_record_pause(first_pause);
+    gc_stats_record_pause(second_pause);
+    if (major) {
+        bool irq_state = irq_spinlock_acquire(&m_gc_stats_lock);
+        m_gc_major_cycles++;
+        irq_spinlock_release(&m_gc_stats_lock, irq_state);
+    }
+
+    // logging is slow, so the cycles are only traced when asked to
+    if (m_gc_dump_stats) {
+        TRACE("gc: %s cycle done in %lums, freed %lu bytes (%lu pages decommitted, pauses %luus, %luus), goal %luMB, trigger %luMB",
+              major ? "major" : "minor", (get_tsc() - start) / ms_to_tsc(1), freed, decommitted,
+              first_pause * 1000 / ms_to_tsc(1),
+              second_pause * 1000 / ms_to_tsc(1),
+              (size_t)(m_gc_heap_goal / SIZE_1MB),
+              (size_t)(atomic_load_explicit(&m_gc_trigger, memory_order_relaxed) / SIZE_1MB));
+    }
+}
+
+static bool gc_park_callback(void* arg) {
+    // only park if no one kicked us while we were running
+    gc_state_t expected = GC_STATE_RUNNING;
+    return atomic_compare_exchange_strong(&m_gc_state, &expected, GC_STATE_PARKED);
+}
+
+static void gc_thread_entry(void* arg) {
+    for (;;) {
+        // wait until someone asks for a cycle
+        scheduler_park(gc_park_callback, NULL);
+        atomic_store(&m_gc_state, GC_STATE_RUNNING);
+
+        bool irq_state = irq_spinlock_acquire(&m_gc_waiters_lock);
+        m_gc_cycles_started++;
+        irq_spinlock_release(&m_gc_waiters_lock, irq_state);
+
+        // most cycles only collect the young objects
+        bool major = atomic_exchange(&m_gc_major_requested, false) ||
+                     m_gc_minor_cycles >= GC_MINOR_CYCLES_PER_MAJOR;
+        m_gc_minor_cycles = major ? 0 : m_gc_minor_cycles + 1;
+
+        // the shrinker might be decommitting the freelists
+        while (atomic_exchange(&m_gc_heap_busy, true)) {
+            scheduler_yield();
+        }
+        gc_cycle(major);
+
+        // take everyone waiting for the cycle, we wake them up
+        // outside the lock since waking up might yield
+        list_t waiters = LIST_INIT(&waiters);
+        irq_state = irq_spinlock_acquire(&m_gc_waiters_lock);
+        m_gc_cycles++;
+        list_entry_t* entry;
+        while ((entry = list_pop(&m_gc_waiters)) != NULL) {
+            list_add_tail(&waiters, entry);
+        }
+        irq_spinlock_release(&m_gc_waiters_lock, irq_state);
+
+        while ((entry = list_pop(&waiters)) != NULL) {
+            scheduler_wakeup_thread(containerof(entry, thread_t, link));
+        }
+
+        // and let the finalizers run
+        gc_finalizer_kick();
+
+        // we are not sweeping anymore, so the heap can be walked safely
+        if (m_gc_dump_stats) {
+            gc_dump_stats();
+        }
+
+        atomic_store(&m_gc_heap_busy, false);
+    }
+}
+
+typedef struct gc_wait {
+    thread_t* thread;
+    size_t cycle;
+} gc_wait_t;
+
+static bool gc_wait_callback(void* arg) {
+    gc_wait_t* wait = arg;
+
+    bool irq_state = irq_spinlock_acquire(&m_gc_waiters_lock);
+    bool park = m_gc_cycles < wait->cycle;
+    if (park) {
+        list_add_tail(&m_gc_waiters, &wait->thread->link);
+    }
+    irq_spinlock_release(&m_gc_waiters_lock, irq_state);
+
+    return park;
+}
+
+void gc_collect(void) {
+    // a cycle that is already running might have missed our
+    // garbage, so wait for the next one to start and finish
+    bool irq_state = irq_spinlock_acquire(&m_gc_waiters_lock);
+    gc_wait_t wait = {
+        .thread = scheduler_get_current_thread(),
+        .cycle = m_gc_cycles_started + 1,
+    };
+    irq_spinlock_release(&m_gc_waiters_lock, irq_state);
+
+    atomic_store(&m_gc_major_requested, true);
+    gc_kick();
+    scheduler_park(gc_wait_callback, &wait);
+}
+
+void gc_get_stats(gc_stats_t* stats) {
+    bool irq_state = irq_spinlock_acquire(&m_gc_waiters_lock);
+    stats->collections = m_gc_cycles;
+    irq_spinlock_release(&m_gc_waiters_lock, irq_state);
+
+    irq_state = irq_spinlock_acquire(&m_gc_stats_lock);
+    stats->major_collections = m_gc_major_cycles;
+    stats->total_allocated = m_gc_total_allocated;
+    stats->total_freed = m_gc_total_freed;
+    stats->max_pause_us = m_gc_max_pause_us;
+    memcpy(stats->pauses, m_gc_pauses, sizeof(m_gc_pauses));
+    irq_spinlock_release(&m_gc_stats_lock, irq_state);
+
+    // include what was allocated since the last cycle
+    stats->total_allocated += atomic_load_explicit(&m_gc_allocated_bytes, memory_order_relaxed);
+    stats->heap_in_use = atomic_load_explicit(&m_gc_heap_in_use, memory_order_relaxed);
+    stats->heap_goal = m_gc_heap_goal;
+}
+
+/**
+ * Can the current context wait for a collection
+ */
+static bool gc_can_wait(void) {
+    return m_gc_thread != NULL &&
+           scheduler_get_current_thread() != NULL &&
+           scheduler_get_current_thread() != m_gc_thread &&
+           is_irq_enabled() &&
+           !scheduler_is_preempt_disabled();
+}
+
+err_t gc_init() {
+    err_t err = NO_ERROR;
+
+    for (int i = 0; i < ARRAY_LENGTH(g_gc_regions); i++) {
+        gc_region_t* region = &g_gc_regions[i];
+        region->freelist = NULL;
+        region->lock = IRQ_SPINLOCK_INIT;
+        region->bottom = (void*)GC_REGION_BOTTOM(i);
+        region->watermark = region->bottom;
+        region->decommitted = RB_ROOT;
+        region->decommitted_bytes = 0;
+        region->top = (void*)GC_REGION_TOP(i);
+        region->size = m_gc_size_classes[i];
     }
 
-    // TODO: per-cpu cache
+#ifdef __DEBUG__
+    gc_sweep_self_test();
+#endif
+
+    gc_parse_cmdline();
+    m_gc_last_cycle_end = get_tsc();
+
+    // the collector runs on the current core
+    RETHROW(gc_init_markers());
+    RETHROW(gc_init_finalizer());
+
+    m_gc_thread = thread_create(gc_thread_entry, NULL, "gc");
+    CHECK_ERROR(m_gc_thread != NULL, ERROR_OUT_OF_MEMORY);
+    scheduler_wakeup_thread(m_gc_thread);
+
+    reclaim_register_shrinker(&m_gc_shrinker);
+
+cleanup:
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Objects up to this size are allocated from the per-cpu TLABs, each
+ * refill takes about this many bytes worth of blocks from the region
+ */
+#define GC_TLAB_MAX_OBJECT  SIZE_2KB
+#define GC_TLAB_SIZE        SIZE_32KB
+
+typedef struct gc_tlab {
+    // a run of fresh blocks carved from the watermark
+    void* ptr;
+    void* end;
+
+    // blocks taken in a batch from the region's freelist
+    // or from a chunk that we just swept
+    void* freelist;
+    size_t free_count;
+} gc_tlab_t;
 
-    gc_region_t* region = &m_gc_global_regions[order];
+static CPU_LOCAL gc_tlab_t m_gc_tlabs[GC_REGION_COUNT];
+
+/**
+ * Take a single block from the region, must be called with interrupts disabled
+ */
+static void* gc_region_alloc(gc_region_t* region) {
+    bool irq_state = irq_spinlock_acquire(&region->lock);
+    void* block = region->freelist;
+    if (block != NULL) {
+        region->freelist = *gc_free_link(block);
+        *gc_free_link(block) = NULL;
+    }
+    irq_spinlock_release(&region->lock, irq_state);
+
+    if (block != NULL) {
+        return block;
+    }
 
-    // pop a block from the region
-    spinlock_acquire(&region->lock);
-    void** block = region->freelist;
+    // no freed blocks, sweep some more of the region, we
+    // keep the first block and give the rest to the region
+    void* tail;
+    size_t count;
+    block = gc_sweep_lazy(region, &tail, &count);
     if (block != NULL) {
-        region->freelist = *block;
-    } else if (region->watermark < region->top) {
+        void* rest = *gc_free_link(block);
+        *gc_free_link(block) = NULL;
+        if (rest != NULL) {
+            irq_state = irq_spinlock_acquire(&region->lock);
+            *gc_free_link(tail) = region->freelist;
+            region->freelist = rest;
+            irq_spinlock_release(&region->lock, irq_state);
+        }
+        return block;
+    }
+
+    // the region is fully swept, reuse a decommitted
+    // block, and only then move the watermark
+    size_t taken;
+    gc_span_t* unused;
+    irq_state = irq_spinlock_acquire(&region->lock);
+    block = gc_take_decommitted(region, 1, &taken, &unused);
+    if (block == NULL && region->watermark < region->top) {
         block = region->watermark;
-        region->watermark += aligned_size;
+        __atomic_store_n(&region->watermark, region->watermark + region->size, __ATOMIC_RELEASE);
     }
-    spinlock_release(&region->lock);
+    irq_spinlock_release(&region->lock, irq_state);
 
-    // if we did not allocate anything, request a GC
-    // and try again
-    if (block == NULL) {
-        // TODO: request a gc and try again
+    mem_free(unused);
+    return block;
+}
+
+/**
+ * Refill an empty TLAB from the region, prefers the freed blocks, then sweeping more of the region
+ * and only moves the watermark if there are none, returns the amount of bytes taken
+ */
+static size_t gc_tlab_refill(gc_tlab_t* tlab, gc_region_t* region) {
+    size_t count = GC_TLAB_SIZE / region->size;
+    size_t taken = 0;
+
+    bool irq_state = irq_spinlock_acquire(&region->lock);
+    if (region->freelist != NULL) {
+        // cut a batch from the head of the freelist
+        void* last = region->freelist;
+        taken = 1;
+        while (taken < count && *gc_free_link(last) != NULL) {
+            last = *gc_free_link(last);
+            taken++;
+        }
+        tlab->freelist = region->freelist;
+        tlab->free_count = taken;
+        region->freelist = *gc_free_link(last);
+        *gc_free_link(last) = NULL;
+    }
+    irq_spinlock_release(&region->lock, irq_state);
+
+    if (taken != 0) {
+        return taken * region->size;
+    }
+
+    // sweep a chunk of the region, the memory we just swept is hot
+    // in the cache so it is the best to allocate from it
+    void* tail;
+    tlab->freelist = gc_sweep_lazy(region, &tail, &taken);
+    if (tlab->freelist != NULL) {
+        tlab->free_count = taken;
+        return taken * region->size;
+    }
+
+    // carve a run from the decommitted blocks, they are already zeroed, the
+    // region is fully swept so the sweep won't look at them this cycle
+    gc_span_t* unused;
+    irq_state = irq_spinlock_acquire(&region->lock);
+    void* run = gc_take_decommitted(region, count, &taken, &unused);
+    if (run == NULL && region->watermark < region->top) {
+        // carve a fresh run, the sweep only looks at
+        // the blocks below the watermark
+        taken = (size_t)(region->top - region->watermark) / region->size;
+        if (taken > count) {
+            taken = count;
+        }
+        run = region->watermark;
+        __atomic_store_n(&region->watermark, run + taken * region->size, __ATOMIC_RELEASE);
+    }
+    irq_spinlock_release(&region->lock, irq_state);
+
+    if (run != NULL) {
+        tlab->ptr = run;
+        tlab->end = run + taken * region->size;
+    }
+
+    mem_free(unused);
+    return taken * region->size;
+}
+
+/**
+ * Allocate a block from the TLAB of the current cpu, this is a pointer bump or a pop
+ * without any atomics in the common case, must be called with interrupts disabled
+ */
+static void* gc_tlab_alloc(gc_region_t* region, int size_class) {
+    void* block = NULL;
+    gc_tlab_t* tlab = pcpu_get_pointer(&m_gc_tlabs[size_class]);
+
+    if (tlab->freelist == NULL && tlab->ptr == tlab->end) {
+        size_t taken = gc_tlab_refill(tlab, region);
+        gc_account_alloc(taken);
+    }
+
+    if (tlab->freelist != NULL) {
+        block = tlab->freelist;
+        tlab->freelist = *gc_free_link(block);
+        tlab->free_count--;
+        *gc_free_link(block) = NULL;
+    } else if (tlab->ptr != tlab->end) {
+        block = tlab->ptr;
+        tlab->ptr += region->size;
+    }
+
+    return block;
+}
+
+/**
+ * Drop the blocks in all of the TLABs, must be called with the world stopped
+ * before a full sweep starts, since the sweep rebuilds the freelists
+ */
+static void gc_retire_tlabs(void) {
+    size_t dropped = 0;
+    for (int cpu = 0; cpu < g_cpu_count; cpu++) {
+        for (int i = 0; i < GC_REGION_COUNT; i++) {
+            gc_tlab_t* tlab = pcpu_get_pointer_of(&m_gc_tlabs[i], cpu);
+            dropped += (size_t)(tlab->end - tlab->ptr) + tlab->free_count * g_gc_regions[i].size;
+            tlab->ptr = NULL;
+            tlab->end = NULL;
+            tlab->freelist = NULL;
+            tlab->free_count = 0;
+        }
+    }
+
+    // they were counted when taken, but they were never used
+    atomic_fetch_sub_explicit(&m_gc_heap_in_use, dropped, memory_order_relaxed);
+}
+
+/**
+ * Set the vtable of a new object, once it is set the object is considered allocated
+ */
+static void gc_init_object(void* block, ObjectVTable* vtable) {
+    // the mark must be visible before the vtable, the
+    // sweep decides based on both
+    if (atomic_load_explicit(&g_gc_allocate_black, memory_order_relaxed)) {
+        gc_try_mark(block);
     }
 
-    // return whatever we allocated
     Object obj = (Object)block;
-    obj->VTable = vtable;
-    return obj;
+    __atomic_store_n(&obj->VTable, vtable, __ATOMIC_RELEASE);
 }
 
-void tdn_host_gc_register_root(void* root) {
-    // TODO: register a new root for the collector
+static void* gc_alloc_block(gc_region_t* region, int size_class, ObjectVTable* vtable) {
+    // the object must be initialized with interrupts disabled, otherwise the world
+    // could be stopped while we have a block that is not in any freelist but has no
+    // vtable yet, and the sweep would consider it free
+    bool irq_state = irq_save();
+
+    void* block;
+    if (region->size <= GC_TLAB_MAX_OBJECT) {
+        block = gc_tlab_alloc(region, size_class);
+    } else {
+        block = gc_region_alloc(region);
+        if (block != NULL) {
+            gc_account_alloc(region->size);
+        }
+    }
+
+    if (block != NULL) {
+        gc_set_young_range(block, block + region->size);
+        gc_init_object(block, vtable);
+    }
+
+    irq_restore(irq_state);
+
+    return block;
 }
 
-void tdn_host_gc_pin_object(void* object) {
-    // TODO: pin an object so it won't get collected
-}
\ No newline at end of file
+/**
+ * Get the size class of the given size, the classes are multiples of 16 up to
+ * 128 and then four classes for every power of two, so the internal
+ * fragmentation is at most 25%
+ */
+static int gc_size_class(size_t size) {
+    if (size <= 128) {
+        return DIV_ROUND_UP(size, 16) - 1;
+    }
+
+    int log2 = 63 - __builtin_clzl(size - 1);
+    size_t step = 1ull << (log2 - 2);
+    return 8 + (log2 - 7) * 4 + DIV_ROUND_UP(size - (1ull << log2), step) - 1;
+}
+
+static void* gc_alloc_large(size_t size, ObjectVTable* vtable) {
+    // the object is initialized by the large object space, under its lock
+    void* block = gc_los_alloc(size, vtable);
+    if (block != NULL) {
+        gc_account_alloc(ALIGN_UP(size, PAGE_SIZE));
+    }
+    return block;
+}
+
+Object tdn_host_gc_alloc(ObjectVTable* vtable, size_t size, size_t alignment) {
+    // we need at least the vtable and the freelist link
+    if (size < 16) {
+        size = 16;
+    }
+
+    // the power of two classes are aligned to their size,
+    // and large objects are always page aligned
+    if (alignment > PAGE_SIZE) {
+        WARN("gc: unsupported alignment %lu for an object of size %lu", alignment, size);
+        return NULL;
+    } else if (alignment > 16 && size <= GC_MAX_SMALL_OBJECT) {
+        if (size < alignment) {
+            size = alignment;
+        }
+        size = 1ull << (64 - __builtin_clzl(size - 1));
+    }
+
+    void* block;
+    gc_region_t* region = NULL;
+    int size_class = 0;
+    if (size <= GC_MAX_SMALL_OBJECT) {
+        size_class = gc_size_class(size);
+        region = &g_gc_regions[size_class];
+        heap_profile_account(HEAP_PROFILE_GC, region->size);
+        block = gc_alloc_block(region, size_class, vtable);
+    } else {
+        heap_profile_account(HEAP_PROFILE_GC, ALIGN_UP(size, PAGE_SIZE));
+        block = gc_alloc_large(size, vtable);
+    }
+
+    // if we did not allocate anything, run a
+    // collection and try again
+    if (block == NULL && gc_can_wait()) {
+        gc_collect();
+        block = region != NULL ? gc_alloc_block(region, size_class, vtable) : gc_alloc_large(size, vtable);
+    }
+
+    if (block == NULL) {
+        WARN("gc: out of memory allocating an object of size %lu", size);
+        return NULL;
+    }
+
+    gc_finalize_track(block, vtable);
+
+    // kick a new cycle if the pacer says so, the bytes
+    // are counted when blocks are taken from the region
+    if (gc_pacer_should_trigger() &&
+        atomic_load_explicit(&m_gc_state, memory_order_relaxed) == GC_STATE_PARKED &&
+        gc_can_wait()) {
+        gc_kick();
+    }
+
+    // no need to clear anything, fresh pages are zeroed when faulted
+    // in and freed blocks are zeroed by the sweep
+    return (Object)block;
+}
+
+size_t tdn_host_gc_get_total_memory(bool force_full_collection) {
+    if (force_full_collection && gc_can_wait()) {
+        gc_collect();
+    }
+    return atomic_load_explicit(&m_gc_heap_in_use, memory_order_relaxed);
+}
+
+size_t tdn_host_gc_collection_count(int generation) {
+    gc_stats_t stats;
+    gc_get_stats(&stats);
+
+    // every cycle collects the young objects, only the major
+    // cycles collect the old ones
+    if (generation < 0) {
+        return 0;
+    } else if (generation == 0) {
+        return stats.collections;
+    } else {
+        return stats.major_collections;
+    }
+}
@@ -1,7 +1,134 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
+
+#include <lib/except.h>
+
+/**
+ * Global gc init, starts the collector thread
+ */
+err_t gc_init();
+
+/**
+ * Run a full collection and wait for it to finish, must
+ * be called from a thread that can sleep
+ */
+void gc_collect(void);
+
+/**
+ * Called from the stop-the-world IPI, parks the
+ * core until the collector resumes the world
+ */
+void gc_handle_stop_request(void);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Statistics
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Bucket N of the pause histogram counts the pauses that took [2^N, 2^(N+1)) microseconds,
+ * the first bucket also counts the shorter pauses and the last one the longer pauses
+ */
+#define GC_PAUSE_BUCKETS    16
+
+typedef struct gc_stats {
+    // the completed collections, all of them and only the major ones
+    size_t collections;
+    size_t major_collections;
+
+    // the bytes taken from the heap and not yet freed, blocks
+    // in the allocation buffers are counted as soon as they are taken
+    size_t heap_in_use;
+
+    // the heap size at which the next collection should be done
+    size_t heap_goal;
+
+    // the bytes that were ever taken from the heap and freed
+    size_t total_allocated;
+    size_t total_freed;
+
+    // the stop-the-world pauses
+    uint64_t max_pause_us;
+    size_t pauses[GC_PAUSE_BUCKETS];
+} gc_stats_t;
+
+/**
+ * Get a snapshot of the collector statistics
+ */
+void gc_get_stats(gc_stats_t* stats);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Handles
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef enum gc_handle_type {
+    // the slot is free
+    GC_HANDLE_FREE,
+
+    // keeps the object alive
+    GC_HANDLE_STRONG,
+
+    // keeps the object alive, the object never moves
+    // so this is the same as a strong handle
+    GC_HANDLE_PINNED,
+
+    // does not keep the object alive, cleared once the object is collected
+    GC_HANDLE_WEAK,
+
+    // keeps the secondary object alive as long as the primary object is alive,
+    // both are cleared once the primary object is collected
+    GC_HANDLE_DEPENDENT,
+
+    // used internally to track objects that have a finalizer, and
+    // to keep them alive until their finalizer is done
+    GC_HANDLE_FINALIZABLE,
+    GC_HANDLE_FINALIZING,
+} gc_handle_type_t;
+
+typedef struct gc_handle gc_handle_t;
+
+/**
+ * Allocate a new handle to the object, the secondary object is only used by dependent
+ * handles, returns NULL if there is not enough memory
+ */
+gc_handle_t* gc_handle_alloc(gc_handle_type_t type, void* object, void* secondary);
+
+/**
+ * Free the handle, it must not be used afterwards
+ */
+void gc_handle_free(gc_handle_t* handle);
+
+/**
+ * Get the object of the handle, NULL if a weak or dependent handle was cleared
+ */
+void* gc_handle_get(gc_handle_t* handle);
+
+/**
+ * Set the object of the handle
+ */
+void gc_handle_set(gc_handle_t* handle, void* object);
+
+/**
+ * Get the secondary object of a dependent handle
+ */
+void* gc_handle_get_secondary(gc_handle_t* handle);
+
+/**
+ * Set the secondary object of a dependent handle
+ */
+void gc_handle_set_secondary(gc_handle_t* handle, void* secondary);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Finalization
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Called on the finalizer thread once the object is no longer reachable
+ */
+typedef void (*gc_finalizer_t)(void* object);
 
 /**
- * Global gc init
+ * Set the finalizer of all the objects of the given vtable, must be
+ * called before any object of the vtable is allocated
  */
-void gc_init();
+err_t gc_register_finalizer(void* vtable, gc_finalizer_t finalizer);
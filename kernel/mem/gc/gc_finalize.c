@@ -0,0 +1,222 @@
+#include "gc.h"
+#include "gc_internal.h"
+
+#include <debug/log.h>
+#include <lib/string.h>
+#include <mem/alloc.h>
+#include <runtime/tdn.h>
+#include <thread/scheduler.h>
+
+#include "tomatodotnet/types/basic.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Finalizers
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Finalizers are registered per vtable, every object allocated with such a vtable gets a finalizable handle which
+// does not keep it alive. Once the collector finds the object dead it is resurrected and queued, and the finalizer
+// thread calls its finalizer and frees the handle, so the object is freed by the next cycle that sees it dead.
+//
+
+/**
+ * The maximum amount of vtables with a finalizer, the table is never resized so
+ * lookups from the allocation path don't need a lock
+ */
+#define GC_FINALIZER_TABLE_SIZE     1024
+STATIC_ASSERT(GC_FINALIZER_TABLE_SIZE == 1 << 10);
+
+typedef struct gc_finalizer_entry {
+    void* vtable;
+    gc_finalizer_t finalizer;
+} gc_finalizer_entry_t;
+
+static gc_finalizer_entry_t m_gc_finalizers[GC_FINALIZER_TABLE_SIZE];
+static atomic_size_t m_gc_finalizer_count = 0;
+static irq_spinlock_t m_gc_finalizers_lock = IRQ_SPINLOCK_INIT;
+
+static size_t gc_finalizer_hash(void* vtable) {
+    return (((uintptr_t)vtable >> 4) * 0x9E3779B97F4A7C15ull) >> (64 - 10);
+}
+
+err_t gc_register_finalizer(void* vtable, gc_finalizer_t finalizer) {
+    err_t err = NO_ERROR;
+
+    bool irq_state = irq_spinlock_acquire(&m_gc_finalizers_lock);
+
+    size_t count = atomic_load_explicit(&m_gc_finalizer_count, memory_order_relaxed);
+    CHECK_ERROR(count < GC_FINALIZER_TABLE_SIZE / 2, ERROR_OUT_OF_MEMORY);
+
+    size_t index = gc_finalizer_hash(vtable);
+    while (m_gc_finalizers[index].vtable != NULL && m_gc_finalizers[index].vtable != vtable) {
+        index = (index + 1) % GC_FINALIZER_TABLE_SIZE;
+    }
+
+    // the finalizer must be visible before the vtable
+    m_gc_finalizers[index].finalizer = finalizer;
+    if (m_gc_finalizers[index].vtable == NULL) {
+        __atomic_store_n(&m_gc_finalizers[index].vtable, vtable, __ATOMIC_RELEASE);
+        atomic_store_explicit(&m_gc_finalizer_count, count + 1, memory_order_release);
+    }
+
+cleanup:
+    irq_spinlock_release(&m_gc_finalizers_lock, irq_state);
+    return err;
+}
+
+/**
+ * Get the finalizer of the objects of the vtable, NULL if they don't have one
+ */
+static gc_finalizer_t gc_get_finalizer(void* vtable) {
+    // the common case, no one registered anything
+    if (atomic_load_explicit(&m_gc_finalizer_count, memory_order_acquire) == 0) {
+        return NULL;
+    }
+
+    size_t index = gc_finalizer_hash(vtable);
+    for (;;) {
+        void* entry = __atomic_load_n(&m_gc_finalizers[index].vtable, __ATOMIC_ACQUIRE);
+        if (entry == vtable) {
+            return m_gc_finalizers[index].finalizer;
+        } else if (entry == NULL) {
+            return NULL;
+        }
+        index = (index + 1) % GC_FINALIZER_TABLE_SIZE;
+    }
+}
+
+void gc_finalize_track(void* object, void* vtable) {
+    // if we can't track it then the finalizer won't run, but that's
+    // the same as the object staying alive forever which is allowed
+    if (gc_get_finalizer(vtable) != NULL && gc_handle_alloc(GC_HANDLE_FINALIZABLE, object, NULL) == NULL) {
+        WARN("gc: out of memory registering an object for finalization");
+    }
+}
+
+bool tdn_host_gc_register_finalizer(void* vtable, void (*finalizer)(void* object)) {
+    return !IS_ERROR(gc_register_finalizer(vtable, finalizer));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Finalization queue
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The initial capacity of the queue, it can't grow while the world
+ * is stopped so it is grown once a cycle is done if it ran out
+ */
+#define GC_FINALIZE_QUEUE_INITIAL   256
+
+/**
+ * The handles of the objects waiting to be finalized, protected by the lock, the
+ * lock is taken by the collector while the world is stopped so it is an irq lock
+ */
+static gc_handle_t** m_gc_finalize_queue = NULL;
+static size_t m_gc_finalize_count = 0;
+static size_t m_gc_finalize_capacity = 0;
+static bool m_gc_finalize_overflow = false;
+static irq_spinlock_t m_gc_finalize_lock = IRQ_SPINLOCK_INIT;
+
+static thread_t* m_gc_finalizer_thread = NULL;
+static bool m_gc_finalizer_parked = false;
+
+bool gc_finalize_enqueue(gc_handle_t* handle) {
+    bool queued = false;
+
+    bool irq_state = irq_spinlock_acquire(&m_gc_finalize_lock);
+    if (m_gc_finalize_count < m_gc_finalize_capacity) {
+        m_gc_finalize_queue[m_gc_finalize_count++] = handle;
+        queued = true;
+    } else {
+        m_gc_finalize_overflow = true;
+    }
+    irq_spinlock_release(&m_gc_finalize_lock, irq_state);
+
+    return queued;
+}
+
+void gc_finalizer_kick(void) {
+    // grow the queue if it ran out during the cycle, the objects
+    // that did not fit will be queued by the next cycle
+    bool irq_state = irq_spinlock_acquire(&m_gc_finalize_lock);
+    size_t capacity = m_gc_finalize_overflow ? m_gc_finalize_capacity * 2 : 0;
+    irq_spinlock_release(&m_gc_finalize_lock, irq_state);
+
+    gc_handle_t** queue = NULL;
+    if (capacity != 0) {
+        queue = mem_alloc(capacity * sizeof(gc_handle_t*));
+        if (queue == NULL) {
+            WARN("gc: out of memory growing the finalization queue");
+        }
+    }
+
+    irq_state = irq_spinlock_acquire(&m_gc_finalize_lock);
+
+    // swap in the larger queue
+    gc_handle_t** old_queue = NULL;
+    if (queue != NULL) {
+        memcpy(queue, m_gc_finalize_queue, m_gc_finalize_count * sizeof(gc_handle_t*));
+        old_queue = m_gc_finalize_queue;
+        m_gc_finalize_queue = queue;
+        m_gc_finalize_capacity = capacity;
+        m_gc_finalize_overflow = false;
+    }
+
+    bool wakeup = m_gc_finalizer_parked && m_gc_finalize_count != 0;
+    if (wakeup) {
+        m_gc_finalizer_parked = false;
+    }
+
+    irq_spinlock_release(&m_gc_finalize_lock, irq_state);
+
+    mem_free(old_queue);
+
+    if (wakeup) {
+        scheduler_wakeup_thread(m_gc_finalizer_thread);
+    }
+}
+
+static bool gc_finalizer_park_callback(void* arg) {
+    bool irq_state = irq_spinlock_acquire(&m_gc_finalize_lock);
+    bool park = m_gc_finalize_count == 0;
+    m_gc_finalizer_parked = park;
+    irq_spinlock_release(&m_gc_finalize_lock, irq_state);
+    return park;
+}
+
+static void gc_finalizer_thread_entry(void* arg) {
+    for (;;) {
+        scheduler_park(gc_finalizer_park_callback, NULL);
+
+        for (;;) {
+            bool irq_state = irq_spinlock_acquire(&m_gc_finalize_lock);
+            gc_handle_t* handle = m_gc_finalize_count != 0 ? m_gc_finalize_queue[--m_gc_finalize_count] : NULL;
+            irq_spinlock_release(&m_gc_finalize_lock, irq_state);
+
+            if (handle == NULL) {
+                break;
+            }
+
+            // the handle keeps the object alive while we run the finalizer,
+            // once it is freed the object will be freed by the next cycle
+            Object object = gc_handle_get(handle);
+            gc_finalizer_t finalizer = gc_get_finalizer(object->VTable);
+            finalizer(object);
+            gc_handle_free(handle);
+        }
+    }
+}
+
+err_t gc_init_finalizer(void) {
+    err_t err = NO_ERROR;
+
+    m_gc_finalize_queue = mem_alloc(GC_FINALIZE_QUEUE_INITIAL * sizeof(gc_handle_t*));
+    CHECK_ERROR(m_gc_finalize_queue != NULL, ERROR_OUT_OF_MEMORY);
+    m_gc_finalize_capacity = GC_FINALIZE_QUEUE_INITIAL;
+
+    m_gc_finalizer_thread = thread_create(gc_finalizer_thread_entry, NULL, "gc finalizer");
+    CHECK_ERROR(m_gc_finalizer_thread != NULL, ERROR_OUT_OF_MEMORY);
+    scheduler_wakeup_thread(m_gc_finalizer_thread);
+
+cleanup:
+    return err;
+}
@@ -0,0 +1,318 @@
+#include "gc.h"
+#include "gc_internal.h"
+
+#include <mem/alloc.h>
+#include <runtime/tdn.h>
+#include <thread/pcpu.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handle table
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Handles are slots allocated from segments on the kernel heap, which is not scanned by the collector, the handle
+// decides how the collector treats the object in it. The segments are never freed, free slots are kept on per-cpu
+// lists that are refilled from and spilled to a global list in batches.
+//
+
+struct gc_handle {
+    // the object, NULL if the handle was cleared
+    void* object;
+
+    union {
+        // the secondary object of a dependent handle
+        void* secondary;
+
+        // the freelist link of a free handle
+        gc_handle_t* next;
+    };
+
+    gc_handle_type_t type;
+};
+
+/**
+ * The amount of handles in each segment
+ */
+#define GC_HANDLE_SEGMENT_SIZE  256
+
+/**
+ * The amount of handles moved between the per-cpu and the global lists at once
+ */
+#define GC_HANDLE_BATCH         32
+
+typedef struct gc_handle_segment {
+    struct gc_handle_segment* next;
+    gc_handle_t handles[GC_HANDLE_SEGMENT_SIZE];
+} gc_handle_segment_t;
+
+typedef struct gc_handle_cache {
+    gc_handle_t* free;
+    size_t count;
+} gc_handle_cache_t;
+
+static CPU_LOCAL gc_handle_cache_t m_gc_handle_cache;
+
+/**
+ * All the segments and the global free handles, the collector walks the
+ * segments while the world is stopped so the lock must be an irq lock
+ */
+static gc_handle_segment_t* m_gc_handle_segments = NULL;
+static gc_handle_t* m_gc_handle_free = NULL;
+static irq_spinlock_t m_gc_handle_lock = IRQ_SPINLOCK_INIT;
+
+/**
+ * Take a batch of free handles from the global list
+ */
+static void gc_handle_cache_refill(gc_handle_cache_t* cache) {
+    bool irq_state = irq_spinlock_acquire(&m_gc_handle_lock);
+    while (cache->count < GC_HANDLE_BATCH && m_gc_handle_free != NULL) {
+        gc_handle_t* handle = m_gc_handle_free;
+        m_gc_handle_free = handle->next;
+        handle->next = cache->free;
+        cache->free = handle;
+        cache->count++;
+    }
+    irq_spinlock_release(&m_gc_handle_lock, irq_state);
+}
+
+/**
+ * Give a batch of free handles back to the global list
+ */
+static void gc_handle_cache_spill(gc_handle_cache_t* cache) {
+    bool irq_state = irq_spinlock_acquire(&m_gc_handle_lock);
+    for (int i = 0; i < GC_HANDLE_BATCH; i++) {
+        gc_handle_t* handle = cache->free;
+        cache->free = handle->next;
+        cache->count--;
+        handle->next = m_gc_handle_free;
+        m_gc_handle_free = handle;
+    }
+    irq_spinlock_release(&m_gc_handle_lock, irq_state);
+}
+
+/**
+ * Add a new segment, returns false if there is not enough memory
+ */
+static bool gc_handle_grow(void) {
+    gc_handle_segment_t* segment = mem_alloc(sizeof(gc_handle_segment_t));
+    if (segment == NULL) {
+        return false;
+    }
+
+    for (int i = 0; i < GC_HANDLE_SEGMENT_SIZE; i++) {
+        segment->handles[i].object = NULL;
+        segment->handles[i].type = GC_HANDLE_FREE;
+        segment->handles[i].next = i + 1 < GC_HANDLE_SEGMENT_SIZE ? &segment->handles[i + 1] : NULL;
+    }
+
+    bool irq_state = irq_spinlock_acquire(&m_gc_handle_lock);
+    segment->handles[GC_HANDLE_SEGMENT_SIZE - 1].next = m_gc_handle_free;
+    m_gc_handle_free = &segment->handles[0];
+    segment->next = m_gc_handle_segments;
+    m_gc_handle_segments = segment;
+    irq_spinlock_release(&m_gc_handle_lock, irq_state);
+
+    return true;
+}
+
+gc_handle_t* gc_handle_alloc(gc_handle_type_t type, void* object, void* secondary) {
+    ASSERT(type != GC_HANDLE_FREE);
+
+    for (;;) {
+        // interrupts are disabled so we won't move cores and so the world
+        // won't be stopped with a half initialized handle
+        bool irq_state = irq_save();
+
+        gc_handle_cache_t* cache = pcpu_get_pointer(&m_gc_handle_cache);
+        if (cache->free == NULL) {
+            gc_handle_cache_refill(cache);
+        }
+
+        gc_handle_t* handle = cache->free;
+        if (handle != NULL) {
+            cache->free = handle->next;
+            cache->count--;
+            handle->object = object;
+            handle->secondary = secondary;
+            handle->type = type;
+        }
+
+        irq_restore(irq_state);
+
+        if (handle != NULL) {
+            return handle;
+        }
+
+        if (!gc_handle_grow()) {
+            return NULL;
+        }
+    }
+}
+
+void gc_handle_free(gc_handle_t* handle) {
+    if (handle == NULL) {
+        return;
+    }
+
+    bool irq_state = irq_save();
+
+    handle->type = GC_HANDLE_FREE;
+    handle->object = NULL;
+
+    gc_handle_cache_t* cache = pcpu_get_pointer(&m_gc_handle_cache);
+    handle->next = cache->free;
+    cache->free = handle;
+    cache->count++;
+    if (cache->count >= GC_HANDLE_BATCH * 2) {
+        gc_handle_cache_spill(cache);
+    }
+
+    irq_restore(irq_state);
+}
+
+void* gc_handle_get(gc_handle_t* handle) {
+    return __atomic_load_n(&handle->object, __ATOMIC_ACQUIRE);
+}
+
+void gc_handle_set(gc_handle_t* handle, void* object) {
+    __atomic_store_n(&handle->object, object, __ATOMIC_RELEASE);
+}
+
+void* gc_handle_get_secondary(gc_handle_t* handle) {
+    ASSERT(handle->type == GC_HANDLE_DEPENDENT);
+    return __atomic_load_n(&handle->secondary, __ATOMIC_ACQUIRE);
+}
+
+void gc_handle_set_secondary(gc_handle_t* handle, void* secondary) {
+    ASSERT(handle->type == GC_HANDLE_DEPENDENT);
+    __atomic_store_n(&handle->secondary, secondary, __ATOMIC_RELEASE);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Host hooks
+//----------------------------------------------------------------------------------------------------------------------
+
+void* tdn_host_gc_handle_alloc(tdn_gc_handle_type_t type, void* object, void* secondary) {
+    gc_handle_type_t handle_type;
+    switch (type) {
+        case TDN_GC_HANDLE_WEAK: handle_type = GC_HANDLE_WEAK; break;
+        case TDN_GC_HANDLE_NORMAL: handle_type = GC_HANDLE_STRONG; break;
+        case TDN_GC_HANDLE_PINNED: handle_type = GC_HANDLE_PINNED; break;
+        case TDN_GC_HANDLE_DEPENDENT: handle_type = GC_HANDLE_DEPENDENT; break;
+        default: ASSERT(!"gc: unsupported handle type"); return NULL;
+    }
+
+    return gc_handle_alloc(handle_type, object, handle_type == GC_HANDLE_DEPENDENT ? secondary : NULL);
+}
+
+void tdn_host_gc_handle_free(void* handle) {
+    gc_handle_free(handle);
+}
+
+void* tdn_host_gc_handle_get(void* handle) {
+    return gc_handle_get(handle);
+}
+
+void tdn_host_gc_handle_set(void* handle, void* object) {
+    gc_handle_set(handle, object);
+}
+
+void* tdn_host_gc_handle_get_secondary(void* handle) {
+    return gc_handle_get_secondary(handle);
+}
+
+void tdn_host_gc_handle_set_secondary(void* handle, void* secondary) {
+    gc_handle_set_secondary(handle, secondary);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Collector side
+//----------------------------------------------------------------------------------------------------------------------
+
+void gc_mark_handles(void) {
+    for (gc_handle_segment_t* segment = m_gc_handle_segments; segment != NULL; segment = segment->next) {
+        for (int i = 0; i < GC_HANDLE_SEGMENT_SIZE; i++) {
+            gc_handle_t* handle = &segment->handles[i];
+            if ((handle->type == GC_HANDLE_STRONG ||
+                 handle->type == GC_HANDLE_PINNED ||
+                 handle->type == GC_HANDLE_FINALIZING) &&
+                handle->object != NULL
+            ) {
+                gc_mark_object(handle->object);
+            }
+        }
+    }
+}
+
+/**
+ * Mark the secondary objects of the dependent handles whose primary object is alive, marking a
+ * secondary can make more primaries alive so go until nothing changes
+ */
+static void gc_mark_dependent_handles(void) {
+    bool changed;
+    do {
+        changed = false;
+        for (gc_handle_segment_t* segment = m_gc_handle_segments; segment != NULL; segment = segment->next) {
+            for (int i = 0; i < GC_HANDLE_SEGMENT_SIZE; i++) {
+                gc_handle_t* handle = &segment->handles[i];
+                if (handle->type != GC_HANDLE_DEPENDENT || handle->object == NULL || handle->secondary == NULL) {
+                    continue;
+                }
+
+                if (gc_is_marked(handle->object) && !gc_is_marked(handle->secondary)) {
+                    gc_mark_object(handle->secondary);
+                    changed = true;
+                }
+            }
+        }
+        gc_mark_drain();
+    } while (changed);
+}
+
+/**
+ * Clear all the handles of the given type whose object is dead
+ */
+static void gc_clear_dead_handles(gc_handle_type_t type) {
+    for (gc_handle_segment_t* segment = m_gc_handle_segments; segment != NULL; segment = segment->next) {
+        for (int i = 0; i < GC_HANDLE_SEGMENT_SIZE; i++) {
+            gc_handle_t* handle = &segment->handles[i];
+            if (handle->type != type || handle->object == NULL || gc_is_marked(handle->object)) {
+                continue;
+            }
+
+            handle->object = NULL;
+            if (type == GC_HANDLE_DEPENDENT) {
+                handle->secondary = NULL;
+            }
+        }
+    }
+}
+
+void gc_process_handles(void) {
+    gc_mark_dependent_handles();
+
+    // weak handles don't track resurrection, so they
+    // are cleared before the finalizers resurrect anything
+    gc_clear_dead_handles(GC_HANDLE_WEAK);
+
+    // dead objects with a finalizer are kept alive, along with everything they
+    // reference, until their finalizer runs, if the queue is full they are just
+    // kept alive for another cycle
+    for (gc_handle_segment_t* segment = m_gc_handle_segments; segment != NULL; segment = segment->next) {
+        for (int i = 0; i < GC_HANDLE_SEGMENT_SIZE; i++) {
+            gc_handle_t* handle = &segment->handles[i];
+            if (handle->type != GC_HANDLE_FINALIZABLE || gc_is_marked(handle->object)) {
+                continue;
+            }
+
+            if (gc_finalize_enqueue(handle)) {
+                handle->type = GC_HANDLE_FINALIZING;
+            }
+            gc_mark_object(handle->object);
+        }
+    }
+    gc_mark_drain();
+
+    // the resurrected objects can keep more secondaries alive
+    gc_mark_dependent_handles();
+    gc_clear_dead_handles(GC_HANDLE_DEPENDENT);
+}
@@ -0,0 +1,434 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lib/defs.h>
+#include <lib/except.h>
+#include <lib/rbtree/rbtree.h>
+#include <mem/memory.h>
+#include <sync/spinlock.h>
+#include <thread/thread.h>
+
+#include "gc.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Heap layout
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The small object part of the heap is split into regions, each region holds blocks of a single size class that are
+// bump allocated from the bottom of the region. A block is allocated when its first word (the vtable) is non-zero,
+// free blocks have a zero first word and keep the freelist link in their second word, so the collector can tell if a
+// pointer points to a live object without any extra metadata.
+//
+// Objects above the largest size class are allocated in the large object space, each gets its own page-granular
+// range that is unmapped once the object is freed.
+//
+
+/**
+ * The top and bottom address of the GC region of the given size class
+ */
+#define GC_REGION_SIZE              SIZE_256GB
+#define GC_REGION_COUNT             40
+#define GC_REGION_BOTTOM(class)     (((class) * GC_REGION_SIZE) + GC_HEAP_ADDR)
+#define GC_REGION_TOP(class)        ((((class) + 1) * GC_REGION_SIZE) + GC_HEAP_ADDR)
+
+/**
+ * The large object space takes the rest of the heap
+ */
+#define GC_LOS_ADDR                 GC_REGION_BOTTOM(GC_REGION_COUNT)
+#define GC_LOS_ADDR_END             GC_HEAP_ADDR_END
+
+/**
+ * Objects above this size go to the large object space
+ */
+#define GC_MAX_SMALL_OBJECT         SIZE_32KB
+
+typedef struct gc_region {
+    // lock to protect the region, the collector takes it while the world
+    // is stopped so it must be held with interrupts disabled
+    irq_spinlock_t lock;
+
+    // already allocated blocks that can be used
+    void* freelist;
+
+    // the watermark in the region
+    void* watermark;
+
+    // the part of the region that is yet to be swept
+    void* sweep_cursor;
+    void* sweep_end;
+
+    // free runs of blocks below the watermark whose pages were
+    // returned, they are allocated from before the watermark
+    rb_root_t decommitted;
+    size_t decommitted_bytes;
+
+    // the bytes of the live blocks found by the last full sweep
+    size_t live_bytes;
+
+    // the bounds of the region
+    void* bottom;
+    void* top;
+
+    // the size of each block
+    size_t size;
+} gc_region_t;
+
+extern gc_region_t g_gc_regions[GC_REGION_COUNT];
+
+/**
+ * A run of free blocks that was decommitted, the pages that are fully inside
+ * of it are unmapped and the rest of it is zeroed
+ */
+typedef struct gc_span {
+    rb_node_t node;
+    void* start;
+    void* end;
+} gc_span_t;
+
+/**
+ * Get the link of a free block
+ */
+static inline void** gc_free_link(void* block) {
+    return &((void**)block)[1];
+}
+
+/**
+ * The collector only reads the heap through the RO shadow
+ */
+static inline void* gc_shadow(void* ptr) {
+    return ptr + GC_HEAP_SHADOW_OFFSET;
+}
+
+static inline gc_region_t* gc_get_region(void* ptr) {
+    return &g_gc_regions[((uintptr_t)ptr - GC_HEAP_ADDR) / GC_REGION_SIZE];
+}
+
+/**
+ * Get the block of the region that the pointer points into
+ */
+static inline void* gc_region_block(gc_region_t* region, void* ptr) {
+    return region->bottom + ((size_t)(ptr - region->bottom) / region->size) * region->size;
+}
+
+static inline bool gc_is_large_object(void* ptr) {
+    return GC_LOS_ADDR <= (uintptr_t)ptr && (uintptr_t)ptr < GC_LOS_ADDR_END;
+}
+
+/**
+ * Get the watermark of the region without the lock, the
+ * watermark only moves up while mutators are running
+ */
+static inline void* gc_region_watermark(gc_region_t* region) {
+    return __atomic_load_n(&region->watermark, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Find the object that the given pointer points into, interior pointers are
+ * allowed, returns NULL if it does not point into an allocated object
+ */
+void* gc_find_object(uintptr_t ptr);
+
+/**
+ * Get the size of the block of an allocated object
+ */
+size_t gc_object_size(void* obj);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Large object space
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Allocate a large object, the object is zeroed and its vtable is set,
+ * returns NULL if we ran out of address space
+ */
+void* gc_los_alloc(size_t size, void* vtable);
+
+/**
+ * Find the large object that the pointer points into, the
+ * object must have a vtable, same as gc_find_object
+ */
+void* gc_los_find_object(uintptr_t ptr);
+
+/**
+ * Get the size of an allocated large object
+ */
+size_t gc_los_object_size(void* obj);
+
+/**
+ * Find the first large object that starts at or above the given address,
+ * returns NULL if there is none, used to iterate the large objects
+ * without holding any lock. The vtable is read under the lock if
+ * requested, so it can't be freed while it is read
+ */
+void* gc_los_next_object(void* ptr, size_t* size, void** vtable);
+
+/**
+ * The top of the part of the large object space that was ever used
+ */
+void* gc_los_watermark(void);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Mark bits
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Every 16 bytes of the heap have a mark bit, only the bit of the first
+ * granule of an object is used
+ */
+#define GC_GRANULE_SHIFT            4
+#define GC_MARK_BITS                ((_Atomic(uint64_t)*)GC_METADATA_ADDR)
+
+static inline size_t gc_mark_index(void* obj) {
+    return ((uintptr_t)obj - GC_HEAP_ADDR) >> GC_GRANULE_SHIFT;
+}
+
+static inline bool gc_is_marked(void* obj) {
+    size_t index = gc_mark_index(obj);
+    return (atomic_load_explicit(&GC_MARK_BITS[index / 64], memory_order_relaxed) & (1ull << (index % 64))) != 0;
+}
+
+/**
+ * Set the mark bit, returns true if we were the one to set it
+ */
+static inline bool gc_try_mark(void* obj) {
+    size_t index = gc_mark_index(obj);
+    uint64_t bit = 1ull << (index % 64);
+    return (atomic_fetch_or_explicit(&GC_MARK_BITS[index / 64], bit, memory_order_relaxed) & bit) == 0;
+}
+
+static inline void gc_clear_mark(void* obj) {
+    size_t index = gc_mark_index(obj);
+    atomic_fetch_and_explicit(&GC_MARK_BITS[index / 64], ~(1ull << (index % 64)), memory_order_relaxed);
+}
+
+/**
+ * Clear the mark bits of the used parts of the heap
+ */
+void gc_clear_marks(void);
+
+/**
+ * New objects are allocated black while a cycle is running, so
+ * the cycle won't free objects that it did not see
+ */
+extern atomic_bool g_gc_allocate_black;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Generations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The heap does not move objects, so the generations are defined by the mark bits: a minor collection does not clear
+// the marks, so the objects that survived a collection stay marked and are considered old, and only the unmarked young
+// objects are traced and swept. The old objects that may point to young objects are found with the card table, every
+// page of the heap that was written since the last collection has its card set, based on the hardware dirty bits.
+//
+
+/**
+ * Every page of the heap has a card bit
+ */
+#define GC_CARD_TABLE               ((uint64_t*)(GC_METADATA_ADDR + SIZE_512GB))
+
+static inline size_t gc_card_index(void* ptr) {
+    return ((uintptr_t)ptr - GC_HEAP_ADDR) >> PAGE_SHIFT;
+}
+
+/**
+ * Every chunk of the heap has a young bit, set when an object is allocated in it, there are
+ * two tables that are swapped on every cycle, so a minor sweep only has to look at the
+ * chunks that had objects allocated in them since the last cycle
+ */
+#define GC_YOUNG_CHUNK_SHIFT        18
+#define GC_YOUNG_TABLE_SIZE         SIZE_8MB
+#define GC_YOUNG_TABLE(epoch)       ((_Atomic(uint64_t)*)(GC_METADATA_ADDR + SIZE_512GB + SIZE_1GB + \
+                                                          (epoch) * GC_YOUNG_TABLE_SIZE))
+STATIC_ASSERT(((GC_HEAP_ADDR_END - GC_HEAP_ADDR) >> GC_YOUNG_CHUNK_SHIFT) / 8 <= GC_YOUNG_TABLE_SIZE);
+
+static inline size_t gc_young_index(void* ptr) {
+    return ((uintptr_t)ptr - GC_HEAP_ADDR) >> GC_YOUNG_CHUNK_SHIFT;
+}
+
+/**
+ * Set the young bits of all the chunks in the range, must be called with interrupts
+ * disabled so the tables can't be swapped in the middle
+ */
+void gc_set_young_range(void* start, void* end);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Marking
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Mark an object and queue it for scanning
+ */
+void gc_mark_object(void* obj);
+
+/**
+ * Conservatively scan a range of native memory for heap pointers
+ */
+void gc_scan_range(void* start, void* end);
+
+/**
+ * Scan all the queued objects until there is nothing left, only the
+ * current core marks so this is used while the world is stopped
+ */
+void gc_mark_drain(void);
+
+/**
+ * Scan all the queued objects until there is nothing left, the
+ * markers of all the cores help and steal work from each other
+ */
+void gc_mark_parallel(void);
+
+/**
+ * Create the marker threads of all the cores but the current one
+ */
+err_t gc_init_markers(void);
+
+/**
+ * Rescan all the marked objects that are on pages written since
+ * the last call, must be called with the world stopped
+ */
+void gc_mark_dirty(void);
+
+/**
+ * Clear the dirty bits of the heap, so we can know which pages are written while we are
+ * marking, the pages that were written since the last cycle are remembered as cards if
+ * requested, otherwise the cards are cleared as well
+ */
+void gc_clear_dirty(bool remember);
+
+/**
+ * Rescan all the marked objects on the remembered cards, clearing the cards
+ */
+void gc_mark_cards(void);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Roots
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Mark all the roots, must be called with the world stopped
+ */
+void gc_mark_roots(void);
+
+/**
+ * Mark the objects of the strong and pinned handles, must be called with the world stopped
+ */
+void gc_mark_handles(void);
+
+/**
+ * Mark the secondary objects of the dependent handles whose primary object is alive, clear the
+ * weak and dependent handles of dead objects and queue the dead objects that have a finalizer,
+ * must be called with the world stopped once everything else is marked
+ */
+void gc_process_handles(void);
+
+/**
+ * Stop all the other cores, they will wait with interrupts disabled until
+ * the world is resumed so no tlb shootdowns can be done in between
+ */
+void gc_stop_the_world(void);
+
+/**
+ * Resume the world, flushing the tlb of all the cores if requested
+ */
+void gc_resume_the_world(bool flush_tlb);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sweeping
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Start sweeping the heap, must be called with the world stopped once the marking is done. A full sweep
+ * rebuilds the freelists, so there must be no free blocks outside of them (in the TLABs for example), a
+ * minor sweep only adds the dead blocks of the young chunks to the freelists, so objects allocated until
+ * it is done must be allocated black
+ */
+void gc_sweep_start(bool minor);
+
+/**
+ * Sweep the next part of the region, returns a list of the blocks that are free linked in
+ * address order or NULL if the whole region was swept
+ */
+void* gc_sweep_lazy(gc_region_t* region, void** tail, size_t* count);
+
+/**
+ * Sweep the rest of the heap, returns once everything is swept and returns the amount of bytes
+ * that were freed by this sweep. Free pages are returned to the physical allocator as long as
+ * more than retain bytes are committed in the regions, the amount of pages returned is
+ * written to decommitted
+ */
+size_t gc_sweep(size_t retain, size_t* decommitted);
+
+/**
+ * Take up to count blocks from the lowest decommitted span of the region, the blocks are
+ * zeroed, returns the first block and sets the amount that was taken. Must be called with
+ * the region lock held, if the span was used up it is returned in unused and must be freed
+ */
+void* gc_take_decommitted(gc_region_t* region, size_t count, size_t* taken, gc_span_t** unused);
+
+/**
+ * Give back the pages of the long runs of free blocks in the freelists, must only be called
+ * between cycles once the heap is fully swept, returns the amount of pages freed
+ */
+size_t gc_decommit_free(size_t target_pages);
+
+/**
+ * Start sweeping the large objects, objects allocated
+ * from now until the sweep is done are kept alive
+ */
+void gc_los_sweep_start(void);
+
+/**
+ * Free all the unmarked large objects, unmapping their
+ * pages, returns the amount of bytes that were freed
+ */
+size_t gc_los_sweep(void);
+
+#ifdef __DEBUG__
+/**
+ * Check that sweeping a dead block leaves its neighbours intact, must
+ * be called by gc_init before anything is allocated from the heap
+ */
+void gc_sweep_self_test(void);
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Finalization
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Track a new object if its vtable has a finalizer, so the finalizer
+ * will run once the object is no longer reachable
+ */
+void gc_finalize_track(void* object, void* vtable);
+
+/**
+ * Queue the handle of an object to be finalized, must be called with the world
+ * stopped, returns false if the queue is full and it should be tried again later
+ */
+bool gc_finalize_enqueue(gc_handle_t* handle);
+
+/**
+ * Wake the finalizer thread if there is anything to finalize
+ */
+void gc_finalizer_kick(void);
+
+/**
+ * Create the finalizer thread
+ */
+err_t gc_init_finalizer(void);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Dump the statistics, the occupancy of each size class and the objects in the heap by their
+ * vtable to the debug log, walks the whole heap so it is only done when gcstats is on the cmdline,
+ * must be called by the collector outside of the sweep, which can decommit parts of the heap
+ */
+void gc_dump_stats(void);
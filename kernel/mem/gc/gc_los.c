@@ -0,0 +1,269 @@
+#include "gc_internal.h"
+
+#include <lib/list.h>
+#include <lib/rbtree/rbtree.h>
+#include <mem/alloc.h>
+#include <mem/virt.h>
+
+typedef struct gc_los_range {
+    // the node in the objects tree
+    rb_node_t node;
+
+    // the link in the free ranges list
+    list_entry_t link;
+
+    void* start;
+    size_t size;
+} gc_los_range_t;
+
+/**
+ * The allocated objects sorted by address, and the free address ranges sorted
+ * by address, the collector looks up objects while the world is stopped so
+ * the lock must be taken with interrupts disabled
+ */
+static rb_root_t m_los_objects = RB_ROOT;
+static list_t m_los_free_ranges = LIST_INIT(&m_los_free_ranges);
+static irq_spinlock_t m_los_lock = IRQ_SPINLOCK_INIT;
+
+/**
+ * Everything above this was never used
+ */
+static void* m_los_watermark = (void*)GC_LOS_ADDR;
+
+/**
+ * Set from the end of the marking until the large objects are swept, objects
+ * allocated in between are marked so the sweep won't free them
+ */
+static bool m_los_sweep_pending = false;
+
+static bool gc_los_less(rb_node_t* a, const rb_node_t* b) {
+    return containerof(a, gc_los_range_t, node)->start < containerof(b, gc_los_range_t, node)->start;
+}
+
+static int gc_los_cmp(const void* key, const rb_node_t* node) {
+    gc_los_range_t* range = containerof(node, gc_los_range_t, node);
+    if (key < range->start) {
+        return -1;
+    } else if (key >= range->start + range->size) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static gc_los_range_t* gc_los_find_range(void* ptr) {
+    rb_node_t* node = rb_find(ptr, &m_los_objects, gc_los_cmp);
+    return node != NULL ? containerof(node, gc_los_range_t, node) : NULL;
+}
+
+void* gc_los_alloc(size_t size, void* vtable) {
+    size = ALIGN_UP(size, PAGE_SIZE);
+
+    // allocate outside the lock, we might not need the
+    // free range we take, in which case we free it after
+    gc_los_range_t* object = mem_alloc(sizeof(gc_los_range_t));
+    if (object == NULL) {
+        return NULL;
+    }
+    gc_los_range_t* unused = NULL;
+
+    bool irq_state = irq_spinlock_acquire(&m_los_lock);
+
+    // first fit from the freed ranges, the pages of freed ranges are
+    // already unmapped so they are going to be zero when faulted in
+    object->start = NULL;
+    for (list_entry_t* entry = m_los_free_ranges.next; entry != &m_los_free_ranges; entry = entry->next) {
+        gc_los_range_t* range = containerof(entry, gc_los_range_t, link);
+        if (range->size < size) {
+            continue;
+        }
+
+        object->start = range->start;
+        range->start += size;
+        range->size -= size;
+        if (range->size == 0) {
+            list_del(&range->link);
+            unused = range;
+        }
+        break;
+    }
+
+    // otherwise take from the top
+    if (object->start == NULL && (size_t)((void*)GC_LOS_ADDR_END - m_los_watermark) >= size) {
+        object->start = m_los_watermark;
+        m_los_watermark += size;
+    }
+
+    if (object->start != NULL) {
+        object->size = size;
+
+        // the object is marked and gets its vtable in one step under the lock, otherwise the
+        // world could be stopped in between and the sweep would free an object with a vtable
+        // that was never marked, the mark must be visible before the vtable
+        if (m_los_sweep_pending || atomic_load_explicit(&g_gc_allocate_black, memory_order_relaxed)) {
+            gc_try_mark(object->start);
+        }
+        __atomic_store_n((void**)object->start, vtable, __ATOMIC_RELEASE);
+
+        rb_add(&object->node, &m_los_objects, gc_los_less);
+    } else {
+        unused = object;
+        object = NULL;
+    }
+
+    irq_spinlock_release(&m_los_lock, irq_state);
+
+    mem_free(unused);
+    return object != NULL ? object->start : NULL;
+}
+
+void* gc_los_find_object(uintptr_t ptr) {
+    bool irq_state = irq_spinlock_acquire(&m_los_lock);
+    gc_los_range_t* range = gc_los_find_range((void*)ptr);
+    void* obj = range != NULL ? range->start : NULL;
+    irq_spinlock_release(&m_los_lock, irq_state);
+
+    // the vtable is set before the range is published, but the object might
+    // have been freed since we looked it up, and then its pages read as zero
+    if (obj == NULL || *(void* volatile*)gc_shadow(obj) == NULL) {
+        return NULL;
+    }
+
+    return obj;
+}
+
+size_t gc_los_object_size(void* obj) {
+    bool irq_state = irq_spinlock_acquire(&m_los_lock);
+    gc_los_range_t* range = gc_los_find_range(obj);
+    size_t size = range != NULL ? range->size : 0;
+    irq_spinlock_release(&m_los_lock, irq_state);
+    return size;
+}
+
+void* gc_los_next_object(void* ptr, size_t* size, void** vtable) {
+    gc_los_range_t* next = NULL;
+
+    bool irq_state = irq_spinlock_acquire(&m_los_lock);
+    rb_node_t* node = m_los_objects.rb_node;
+    while (node != NULL) {
+        gc_los_range_t* range = containerof(node, gc_los_range_t, node);
+        if (range->start >= ptr) {
+            next = range;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+
+    void* obj = NULL;
+    if (next != NULL) {
+        obj = next->start;
+        *size = next->size;
+
+        // the sweep takes dead objects out of the tree before it unmaps
+        // them, so as long as we hold the lock the object is mapped
+        if (vtable != NULL) {
+            *vtable = __atomic_load_n((void**)obj, __ATOMIC_ACQUIRE);
+        }
+    }
+    irq_spinlock_release(&m_los_lock, irq_state);
+
+    return obj;
+}
+
+void* gc_los_watermark(void) {
+    bool irq_state = irq_spinlock_acquire(&m_los_lock);
+    void* watermark = m_los_watermark;
+    irq_spinlock_release(&m_los_lock, irq_state);
+    return watermark;
+}
+
+/**
+ * Return a range to the free ranges, merging it with its neighbours,
+ * returns a range that is no longer needed and should be freed
+ */
+static gc_los_range_t* gc_los_free_range(gc_los_range_t* freed) {
+    gc_los_range_t* prev = NULL;
+    gc_los_range_t* next = NULL;
+
+    for (list_entry_t* entry = m_los_free_ranges.next; entry != &m_los_free_ranges; entry = entry->next) {
+        gc_los_range_t* range = containerof(entry, gc_los_range_t, link);
+        if (range->start > freed->start) {
+            next = range;
+            break;
+        }
+        prev = range;
+    }
+
+    if (prev != NULL && prev->start + prev->size == freed->start) {
+        prev->size += freed->size;
+        if (next != NULL && prev->start + prev->size == next->start) {
+            prev->size += next->size;
+            list_del(&next->link);
+            return next;
+        }
+        return freed;
+    }
+
+    if (next != NULL && freed->start + freed->size == next->start) {
+        next->start = freed->start;
+        next->size += freed->size;
+        return freed;
+    }
+
+    // add it in place, adding before the next one keeps the list sorted
+    if (next != NULL) {
+        list_add_tail(&next->link, &freed->link);
+    } else {
+        list_add_tail(&m_los_free_ranges, &freed->link);
+    }
+    return NULL;
+}
+
+void gc_los_sweep_start(void) {
+    bool irq_state = irq_spinlock_acquire(&m_los_lock);
+    m_los_sweep_pending = true;
+    irq_spinlock_release(&m_los_lock, irq_state);
+}
+
+size_t gc_los_sweep(void) {
+    size_t freed = 0;
+
+    // take all the dead objects out of the tree, once they are
+    // out no one will find them so we can unmap them freely
+    list_t dead = LIST_INIT(&dead);
+    bool irq_state = irq_spinlock_acquire(&m_los_lock);
+    rb_node_t* node = rb_first(&m_los_objects);
+    while (node != NULL) {
+        gc_los_range_t* range = containerof(node, gc_los_range_t, node);
+        node = rb_next(node);
+
+        if (__atomic_load_n((void**)range->start, __ATOMIC_ACQUIRE) == NULL || gc_is_marked(range->start)) {
+            continue;
+        }
+
+        rb_erase(&range->node, &m_los_objects);
+        list_add_tail(&dead, &range->link);
+    }
+    m_los_sweep_pending = false;
+    irq_spinlock_release(&m_los_lock, irq_state);
+
+    list_entry_t* entry;
+    while ((entry = list_pop(&dead)) != NULL) {
+        gc_los_range_t* range = containerof(entry, gc_los_range_t, link);
+
+        // give back the pages, the collector might still have the
+        // shadow cached so flush it as well before reusing the range
+        virt_decommit_range((uintptr_t)range->start, SIZE_TO_PAGES(range->size));
+        virt_flush_tlb_range((uintptr_t)gc_shadow(range->start), SIZE_TO_PAGES(range->size));
+        freed += range->size;
+
+        irq_state = irq_spinlock_acquire(&m_los_lock);
+        gc_los_range_t* unused = gc_los_free_range(range);
+        irq_spinlock_release(&m_los_lock, irq_state);
+
+        mem_free(unused);
+    }
+
+    return freed;
+}
@@ -0,0 +1,587 @@
+#include "gc_internal.h"
+
+#include <arch/intrin.h>
+#include <arch/smp.h>
+#include <lib/string.h>
+#include <mem/alloc.h>
+#include <mem/virt.h>
+#include <thread/pcpu.h>
+#include <thread/scheduler.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Heap lookup
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void* gc_find_object(uintptr_t ptr) {
+    if (ptr < GC_HEAP_ADDR || ptr >= GC_HEAP_ADDR_END) {
+        return NULL;
+    }
+
+    if (gc_is_large_object((void*)ptr)) {
+        return gc_los_find_object(ptr);
+    }
+
+    // anything above the watermark was never allocated
+    gc_region_t* region = gc_get_region((void*)ptr);
+    if (ptr >= (uintptr_t)gc_region_watermark(region)) {
+        return NULL;
+    }
+
+    void* block = gc_region_block(region, (void*)ptr);
+
+    // free blocks have no vtable
+    if (*(void* volatile*)gc_shadow(block) == NULL) {
+        return NULL;
+    }
+
+    return block;
+}
+
+size_t gc_object_size(void* obj) {
+    if (gc_is_large_object(obj)) {
+        return gc_los_object_size(obj);
+    }
+    return gc_get_region(obj)->size;
+}
+
+void gc_clear_marks(void) {
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+        void* watermark = gc_region_watermark(region);
+        if (watermark == region->bottom) {
+            continue;
+        }
+
+        // the regions are aligned way above a full word of mark bits
+        size_t first = gc_mark_index(region->bottom) / 64;
+        size_t last = DIV_ROUND_UP(gc_mark_index(watermark), 64);
+        memset((void*)&GC_MARK_BITS[first], 0, (last - first) * sizeof(uint64_t));
+    }
+
+    // the large objects are sparse, so only clear their bits
+    size_t size;
+    for (void* obj = gc_los_next_object(NULL, &size, NULL); obj != NULL;
+         obj = gc_los_next_object(obj + size, &size, NULL)) {
+        gc_clear_mark(obj);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Mark stacks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Every core has its own marker with a private mark stack that is accessed without any locks, and a small shared
+// chunk that other markers can steal from. When the private stack grows the marker moves a chunk of entries to the
+// shared chunk so idle markers can take them.
+//
+
+/**
+ * The initial amount of entries in the mark stack
+ */
+#define GC_MARK_STACK_MIN   4096
+
+/**
+ * The amount of entries that are moved to the shared chunk at once
+ */
+#define GC_MARK_CHUNK       256
+
+/**
+ * The amount of times an idle marker polls for work before it starts
+ * yielding its core to the mutators between polls
+ */
+#define GC_MARKER_SPIN      128
+
+typedef enum gc_marker_state {
+    // the marker is running
+    GC_MARKER_RUNNING,
+
+    // the marker thread is parked waiting to be kicked
+    GC_MARKER_PARKED,
+
+    // the marker was kicked while running
+    GC_MARKER_KICKED,
+} gc_marker_state_t;
+
+typedef struct gc_marker {
+    // the objects that were marked but not scanned yet, only
+    // accessed by the thread that marks on this core
+    void** stack;
+    size_t count;
+    size_t capacity;
+
+    // entries that can be stolen by other markers
+    irq_spinlock_t lock;
+    size_t shared_count;
+    void* shared[GC_MARK_CHUNK];
+
+    // the thread that marks on this core, NULL for the collector's core
+    thread_t* thread;
+    _Atomic(gc_marker_state_t) state;
+} gc_marker_t;
+
+static CPU_LOCAL gc_marker_t m_gc_marker;
+
+/**
+ * The amount of markers that might still have work, once it reaches zero no marker can join the phase
+ * again so the marking is done
+ */
+static atomic_size_t m_gc_markers_active = 0;
+
+/**
+ * Set when we failed to grow a mark stack, in which case we
+ * will find the objects we dropped by rescanning the heap
+ */
+static atomic_bool m_gc_mark_stack_overflow = false;
+
+static void gc_mark_stack_push(gc_marker_t* marker, void* obj) {
+    if (marker->count == marker->capacity) {
+        size_t capacity = marker->capacity == 0 ? GC_MARK_STACK_MIN : marker->capacity * 2;
+        void** stack = mem_realloc(marker->stack, capacity * sizeof(void*));
+        if (stack == NULL) {
+            atomic_store_explicit(&m_gc_mark_stack_overflow, true, memory_order_relaxed);
+            return;
+        }
+
+        marker->stack = stack;
+        marker->capacity = capacity;
+    }
+
+    marker->stack[marker->count++] = obj;
+}
+
+void gc_mark_object(void* obj) {
+    if (gc_try_mark(obj)) {
+        gc_mark_stack_push(pcpu_get_pointer(&m_gc_marker), obj);
+    }
+}
+
+/**
+ * Move entries from the private stack to the shared chunk if it is empty
+ */
+static void gc_marker_share(gc_marker_t* marker) {
+    if (marker->count < GC_MARK_CHUNK * 2 ||
+        __atomic_load_n(&marker->shared_count, __ATOMIC_RELAXED) != 0) {
+        return;
+    }
+
+    bool irq_state = irq_spinlock_acquire(&marker->lock);
+    if (marker->shared_count == 0) {
+        marker->count -= GC_MARK_CHUNK;
+        memcpy(marker->shared, marker->stack + marker->count, GC_MARK_CHUNK * sizeof(void*));
+        __atomic_store_n(&marker->shared_count, GC_MARK_CHUNK, __ATOMIC_RELAXED);
+    }
+    irq_spinlock_release(&marker->lock, irq_state);
+}
+
+/**
+ * Take the shared chunk of the victim into our private stack
+ */
+static bool gc_marker_take(gc_marker_t* marker, gc_marker_t* victim) {
+    if (__atomic_load_n(&victim->shared_count, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+
+    void* chunk[GC_MARK_CHUNK];
+    size_t count = 0;
+
+    bool irq_state = irq_spinlock_acquire(&victim->lock);
+    count = victim->shared_count;
+    memcpy(chunk, victim->shared, count * sizeof(void*));
+    __atomic_store_n(&victim->shared_count, 0, __ATOMIC_RELAXED);
+    irq_spinlock_release(&victim->lock, irq_state);
+
+    for (size_t i = 0; i < count; i++) {
+        gc_mark_stack_push(marker, chunk[i]);
+    }
+
+    return count != 0;
+}
+
+/**
+ * Try to get more work, first from our own shared chunk and then from the other cores
+ */
+static bool gc_marker_steal(gc_marker_t* marker) {
+    if (gc_marker_take(marker, marker)) {
+        return true;
+    }
+
+    int cpu_id = get_cpu_id();
+    for (int i = 1; i < g_cpu_count; i++) {
+        gc_marker_t* victim = pcpu_get_pointer_of(&m_gc_marker, (cpu_id + i) % g_cpu_count);
+        if (gc_marker_take(marker, victim)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool gc_mark_work_available(void) {
+    for (int i = 0; i < g_cpu_count; i++) {
+        gc_marker_t* marker = pcpu_get_pointer_of(&m_gc_marker, i);
+        if (__atomic_load_n(&marker->shared_count, __ATOMIC_RELAXED) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Join the marking phase, fails if the phase already terminated
+ */
+static bool gc_marker_join(void) {
+    size_t active = atomic_load(&m_gc_markers_active);
+    while (active != 0) {
+        if (atomic_compare_exchange_weak(&m_gc_markers_active, &active, active + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scanning
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Scan a range of words, the range must be readable
+ */
+static void gc_scan_words(uintptr_t* start, uintptr_t* end) {
+    for (uintptr_t* word = start; word < end; word++) {
+        void* obj = gc_find_object(*word);
+        if (obj != NULL) {
+            gc_mark_object(obj);
+        }
+    }
+}
+
+void gc_scan_range(void* start, void* end) {
+    gc_scan_words(ALIGN_UP(start, sizeof(uintptr_t)), ALIGN_DOWN(end, sizeof(uintptr_t)));
+}
+
+/**
+ * Scan part of an object through the shadow, large objects are scanned
+ * a page at a time so we won't fault in pages that were never touched
+ */
+static void gc_scan_object_range(void* start, void* end) {
+    if (end - start <= PAGE_SIZE) {
+        gc_scan_words(gc_shadow(start), gc_shadow(end));
+        return;
+    }
+
+    while (start < end) {
+        void* page_end = ALIGN_DOWN(start, PAGE_SIZE) + PAGE_SIZE;
+        if (page_end > end) {
+            page_end = end;
+        }
+
+        if (virt_is_mapped((uintptr_t)start)) {
+            gc_scan_words(gc_shadow(start), gc_shadow(page_end));
+        }
+
+        start = page_end;
+    }
+}
+
+static void gc_scan_object(void* obj) {
+    // we don't know the layout of the object, so everything but
+    // the vtable is scanned conservatively
+    gc_scan_object_range(obj + sizeof(void*), obj + gc_object_size(obj));
+}
+
+/**
+ * Find all the objects we dropped on the floor by scanning all the
+ * marked objects in the heap again
+ */
+static void gc_mark_rescan_heap(void) {
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+        void* watermark = gc_region_watermark(region);
+        for (void* block = region->bottom; block < watermark; block += region->size) {
+            if (gc_is_marked(block) && *(void* volatile*)gc_shadow(block) != NULL) {
+                gc_scan_object(block);
+            }
+        }
+    }
+
+    size_t size;
+    for (void* obj = gc_los_next_object(NULL, &size, NULL); obj != NULL;
+         obj = gc_los_next_object(obj + size, &size, NULL)) {
+        if (gc_is_marked(obj) && *(void* volatile*)gc_shadow(obj) != NULL) {
+            gc_scan_object_range(obj + sizeof(void*), obj + size);
+        }
+    }
+}
+
+/**
+ * Scan everything in our stacks until there is nothing left, sharing work with other markers if requested
+ */
+static void gc_marker_drain(gc_marker_t* marker, bool share) {
+    do {
+        while (marker->count != 0) {
+            if (share) {
+                gc_marker_share(marker);
+            }
+            gc_scan_object(marker->stack[--marker->count]);
+        }
+    } while (gc_marker_take(marker, marker));
+}
+
+/**
+ * Mark until there is no more work in any of the markers, the caller
+ * must have joined the phase before calling this
+ */
+static void gc_marker_work(gc_marker_t* marker) {
+    for (;;) {
+        gc_marker_drain(marker, true);
+        if (gc_marker_steal(marker)) {
+            continue;
+        }
+
+        // we have nothing, wait until someone shares work or until
+        // everyone is out of work, at which point we are done
+        atomic_fetch_sub(&m_gc_markers_active, 1);
+        size_t spins = 0;
+        for (;;) {
+            if (!gc_mark_work_available()) {
+                if (atomic_load(&m_gc_markers_active) == 0) {
+                    return;
+                }
+
+                // the mutators keep running while we mark, so don't hold the core
+                // for long, an active marker might have been preempted by one
+                if (spins < GC_MARKER_SPIN) {
+                    spins++;
+                    cpu_relax();
+                } else {
+                    scheduler_yield();
+                }
+                continue;
+            }
+
+            if (!gc_marker_join()) {
+                return;
+            }
+
+            if (gc_marker_steal(marker)) {
+                break;
+            }
+
+            atomic_fetch_sub(&m_gc_markers_active, 1);
+        }
+    }
+}
+
+void gc_mark_drain(void) {
+    gc_marker_t* marker = pcpu_get_pointer(&m_gc_marker);
+    for (;;) {
+        gc_marker_drain(marker, false);
+
+        if (!atomic_exchange(&m_gc_mark_stack_overflow, false)) {
+            break;
+        }
+        gc_mark_rescan_heap();
+    }
+}
+
+void gc_mark_parallel(void) {
+    gc_marker_t* marker = pcpu_get_pointer(&m_gc_marker);
+    for (;;) {
+        // the collector is the first marker, every other
+        // marker joins as long as there is work left
+        atomic_store(&m_gc_markers_active, 1);
+        for (int i = 0; i < g_cpu_count; i++) {
+            gc_marker_t* other = pcpu_get_pointer_of(&m_gc_marker, i);
+            if (other->thread != NULL && atomic_exchange(&other->state, GC_MARKER_KICKED) == GC_MARKER_PARKED) {
+                scheduler_wakeup_thread_on(other->thread, i);
+            }
+        }
+
+        gc_marker_work(marker);
+
+        if (!atomic_exchange(&m_gc_mark_stack_overflow, false)) {
+            break;
+        }
+        gc_mark_rescan_heap();
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Marker threads
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool gc_marker_park_callback(void* arg) {
+    gc_marker_t* marker = arg;
+    gc_marker_state_t expected = GC_MARKER_RUNNING;
+    return atomic_compare_exchange_strong(&marker->state, &expected, GC_MARKER_PARKED);
+}
+
+static void gc_marker_thread_entry(void* arg) {
+    gc_marker_t* marker = pcpu_get_pointer(&m_gc_marker);
+    for (;;) {
+        scheduler_park(gc_marker_park_callback, marker);
+        atomic_store(&marker->state, GC_MARKER_RUNNING);
+
+        // we might have been woken up too late, in which case the phase is done already
+        if (gc_marker_join()) {
+            gc_marker_work(marker);
+        }
+    }
+}
+
+err_t gc_init_markers(void) {
+    err_t err = NO_ERROR;
+
+    // the collector marks on its own core
+    int collector_cpu = get_cpu_id();
+    for (int i = 0; i < g_cpu_count; i++) {
+        gc_marker_t* marker = pcpu_get_pointer_of(&m_gc_marker, i);
+        marker->lock = IRQ_SPINLOCK_INIT;
+        marker->state = GC_MARKER_RUNNING;
+        if (i == collector_cpu) {
+            continue;
+        }
+
+        marker->thread = thread_create(gc_marker_thread_entry, NULL, "gc marker %d", i);
+        CHECK_ERROR(marker->thread != NULL, ERROR_OUT_OF_MEMORY);
+        scheduler_wakeup_thread_on(marker->thread, i);
+    }
+
+cleanup:
+    return err;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Dirty pages
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Remember a page that was written to since the last cycle
+ */
+static void gc_remember_card(uintptr_t page, void* ctx) {
+    size_t index = gc_card_index((void*)page);
+    GC_CARD_TABLE[index / 64] |= 1ull << (index % 64);
+}
+
+/**
+ * Clear the cards of the given range
+ */
+static void gc_clear_cards_range(void* start, void* end) {
+    if (start == end) {
+        return;
+    }
+
+    size_t first = gc_card_index(start) / 64;
+    size_t last = DIV_ROUND_UP(gc_card_index(end - 1) + 1, 64);
+    memset(&GC_CARD_TABLE[first], 0, (last - first) * sizeof(uint64_t));
+}
+
+void gc_clear_dirty(bool remember) {
+    virt_dirty_callback_t callback = remember ? gc_remember_card : NULL;
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+        void* watermark = gc_region_watermark(region);
+        if (watermark == region->bottom) {
+            continue;
+        }
+
+        // a full collection traces everything anyways
+        if (!remember) {
+            gc_clear_cards_range(region->bottom, watermark);
+        }
+        virt_clear_dirty_range((uintptr_t)region->bottom, SIZE_TO_PAGES(watermark - region->bottom), callback, NULL);
+    }
+
+    void* los_watermark = gc_los_watermark();
+    if (!remember) {
+        gc_clear_cards_range((void*)GC_LOS_ADDR, los_watermark);
+    }
+    virt_clear_dirty_range(GC_LOS_ADDR, SIZE_TO_PAGES(los_watermark - (void*)GC_LOS_ADDR), callback, NULL);
+
+    // make sure no core has the dirty bit cached
+    virt_flush_tlb_range(GC_HEAP_ADDR, SIZE_TO_PAGES(GC_HEAP_ADDR_END - GC_HEAP_ADDR));
+}
+
+/**
+ * Rescan the part of every marked object that is on the dirty page
+ */
+static void gc_mark_dirty_page(uintptr_t page, void* ctx) {
+    gc_region_t* region = ctx;
+    void* page_start = (void*)page;
+    void* page_end = page_start + PAGE_SIZE;
+
+    for (void* block = gc_region_block(region, page_start); block < page_end; block += region->size) {
+        if (!gc_is_marked(block) || *(void* volatile*)gc_shadow(block) == NULL) {
+            continue;
+        }
+
+        void* start = block > page_start ? block : page_start;
+        void* end = block + region->size < page_end ? block + region->size : page_end;
+        gc_scan_words(gc_shadow(start), gc_shadow(end));
+    }
+}
+
+/**
+ * Large objects are page aligned, so only the object the page
+ * is part of needs to be rescanned
+ */
+static void gc_mark_dirty_large_page(uintptr_t page, void* ctx) {
+    void* obj = gc_los_find_object(page);
+    if (obj != NULL && gc_is_marked(obj)) {
+        void* start = (void*)page > obj ? (void*)page : obj + sizeof(void*);
+        gc_scan_words(gc_shadow(start), gc_shadow((void*)page + PAGE_SIZE));
+    }
+}
+
+void gc_mark_dirty(void) {
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+        void* watermark = gc_region_watermark(region);
+        if (watermark == region->bottom) {
+            continue;
+        }
+        virt_clear_dirty_range((uintptr_t)region->bottom, SIZE_TO_PAGES(watermark - region->bottom),
+                               gc_mark_dirty_page, region);
+    }
+    virt_clear_dirty_range(GC_LOS_ADDR, SIZE_TO_PAGES(gc_los_watermark() - (void*)GC_LOS_ADDR),
+                           gc_mark_dirty_large_page, NULL);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Cards
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Call the callback for every remembered card in the range, clearing them as we go
+ */
+static void gc_mark_cards_range(void* start, void* end, virt_dirty_callback_t callback, void* ctx) {
+    if (start == end) {
+        return;
+    }
+
+    size_t first = gc_card_index(start) / 64;
+    size_t last = DIV_ROUND_UP(gc_card_index(end - 1) + 1, 64);
+    for (size_t i = first; i < last; i++) {
+        uint64_t cards = GC_CARD_TABLE[i];
+        if (cards == 0) {
+            continue;
+        }
+        GC_CARD_TABLE[i] = 0;
+
+        while (cards != 0) {
+            int bit = __builtin_ctzll(cards);
+            cards &= cards - 1;
+            callback(GC_HEAP_ADDR + ((i * 64 + bit) << PAGE_SHIFT), ctx);
+        }
+    }
+}
+
+void gc_mark_cards(void) {
+    // the old objects are the marked ones, so scanning the marked objects on
+    // a card is exactly what we do for pages that are dirtied while marking
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+        gc_mark_cards_range(region->bottom, gc_region_watermark(region), gc_mark_dirty_page, region);
+    }
+    gc_mark_cards_range((void*)GC_LOS_ADDR, gc_los_watermark(), gc_mark_dirty_large_page, NULL);
+}
@@ -0,0 +1,385 @@
+#include "gc.h"
+#include "gc_internal.h"
+
+#include <arch/apic.h>
+#include <arch/intr.h>
+#include <arch/intrin.h>
+#include <arch/smp.h>
+#include <lib/string.h>
+#include <mem/alloc.h>
+#include <runtime/tdn.h>
+#include <thread/pcpu.h>
+#include <thread/scheduler.h>
+
+#include "tomatodotnet/types/basic.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Stop the world
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct gc_stopped_cpu {
+    // the thread that was running when we stopped
+    thread_t* thread;
+
+    // the stack and frame pointers at the time of the stop,
+    // all the registers are spilled above the stack pointer
+    uintptr_t sp;
+    uintptr_t bp;
+} gc_stopped_cpu_t;
+
+static CPU_LOCAL gc_stopped_cpu_t m_gc_stopped_cpu;
+
+/**
+ * Set while the world should stay stopped
+ */
+static atomic_bool m_gc_stop_requested = false;
+
+/**
+ * The amount of cores that are currently stopped
+ */
+static atomic_size_t m_gc_stopped_count = 0;
+
+/**
+ * Should the stopped cores flush their tlb before resuming
+ */
+static bool m_gc_stop_flush_tlb = false;
+
+__attribute__((noinline))
+void gc_handle_stop_request(void) {
+    // spill all the callee saved registers into our frame, the
+    // interrupt frame already saved the rest of them
+    __builtin_unwind_init();
+
+    uintptr_t sp;
+    asm volatile ("mov %%rsp, %0" : "=r"(sp) :: "memory");
+
+    gc_stopped_cpu_t* stopped = pcpu_get_pointer(&m_gc_stopped_cpu);
+    stopped->thread = scheduler_get_current_thread();
+    stopped->sp = sp;
+    stopped->bp = (uintptr_t)__builtin_frame_address(0);
+
+    // the vector registers can hold references as well
+    if (stopped->thread != NULL) {
+        thread_save_extended_state(stopped->thread);
+    }
+
+    atomic_fetch_add_explicit(&m_gc_stopped_count, 1, memory_order_release);
+    while (atomic_load_explicit(&m_gc_stop_requested, memory_order_acquire)) {
+        cpu_relax();
+    }
+
+    if (m_gc_stop_flush_tlb) {
+        __writecr3(__readcr3());
+    }
+
+    atomic_fetch_sub_explicit(&m_gc_stopped_count, 1, memory_order_release);
+}
+
+void gc_stop_the_world(void) {
+    // we must not be switched out while the world is stopped
+    scheduler_preempt_disable();
+
+    atomic_store_explicit(&m_gc_stop_requested, true, memory_order_release);
+    if (g_cpu_count > 1) {
+        lapic_send_ipi_all_excluding_self(INTR_VECTOR_GC_STOP);
+
+        // wait with interrupts enabled, a core might be waiting
+        // for us to ack a tlb shootdown before it can stop
+        while (atomic_load_explicit(&m_gc_stopped_count, memory_order_acquire) != g_cpu_count - 1) {
+            cpu_relax();
+        }
+    }
+}
+
+void gc_resume_the_world(bool flush_tlb) {
+    m_gc_stop_flush_tlb = flush_tlb;
+    if (flush_tlb) {
+        __writecr3(__readcr3());
+    }
+
+    // release everyone and wait for them to leave, so the
+    // next stop won't see a stale stop state
+    atomic_store_explicit(&m_gc_stop_requested, false, memory_order_release);
+    while (atomic_load_explicit(&m_gc_stopped_count, memory_order_acquire) != 0) {
+        cpu_relax();
+    }
+
+    scheduler_preempt_enable();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Registered roots
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct gc_root_array {
+    void** items;
+    size_t count;
+    size_t capacity;
+} gc_root_array_t;
+
+/**
+ * The roots registered by the runtime, the lock is an
+ * irq lock so it can't be held by a stopped core
+ */
+static gc_root_array_t m_gc_roots = {};
+static irq_spinlock_t m_gc_roots_lock = IRQ_SPINLOCK_INIT;
+
+static void gc_root_array_add(gc_root_array_t* array, void* item) {
+    bool irq_state = irq_spinlock_acquire(&m_gc_roots_lock);
+
+    if (array->count == array->capacity) {
+        size_t capacity = array->capacity == 0 ? 64 : array->capacity * 2;
+        void** items = mem_realloc(array->items, capacity * sizeof(void*));
+        ASSERT(items != NULL, "gc: out of memory for roots");
+        array->items = items;
+        array->capacity = capacity;
+    }
+    array->items[array->count++] = item;
+
+    irq_spinlock_release(&m_gc_roots_lock, irq_state);
+}
+
+void tdn_host_gc_register_root(void* root) {
+    gc_root_array_add(&m_gc_roots, root);
+}
+
+void tdn_host_gc_pin_object(void* object) {
+    // the runtime might give us an interior pointer, like the data of an
+    // array, the handle must hold the object itself for it to be marked
+    void* obj = gc_find_object((uintptr_t)object);
+    if (obj == NULL) {
+        return;
+    }
+
+    // the runtime never unpins, so the handle is never freed
+    gc_handle_t* handle = gc_handle_alloc(GC_HANDLE_PINNED, obj, NULL);
+    ASSERT(handle != NULL, "gc: out of memory for handles");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Stack maps
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct gc_stack_map {
+    rb_node_t node;
+
+    // the return address of the call site
+    uintptr_t return_address;
+
+    // the offsets from the frame pointer of the caller
+    // of the slots that hold references
+    size_t slot_count;
+    int32_t slots[];
+} gc_stack_map_t;
+
+/**
+ * The stack maps of the jitted code, the jit code is never freed so neither
+ * are the maps, the lock is an irq lock so it can't be held by a stopped core
+ */
+static rb_root_t m_gc_stack_maps = {};
+static irq_spinlock_t m_gc_stack_maps_lock = IRQ_SPINLOCK_INIT;
+
+static bool gc_stack_map_less(rb_node_t* a, const rb_node_t* b) {
+    return containerof(a, gc_stack_map_t, node)->return_address <
+           containerof(b, gc_stack_map_t, node)->return_address;
+}
+
+static int gc_stack_map_cmp(const void* key, const rb_node_t* node) {
+    uintptr_t return_address = containerof(node, gc_stack_map_t, node)->return_address;
+    if ((uintptr_t)key < return_address) {
+        return -1;
+    } else if ((uintptr_t)key > return_address) {
+        return 1;
+    }
+    return 0;
+}
+
+bool tdn_host_gc_register_stack_map(void* return_address, const int32_t* slots, size_t slot_count) {
+    ASSERT((uintptr_t)return_address >= JIT_ADDR);
+
+    gc_stack_map_t* map = mem_alloc(sizeof(gc_stack_map_t) + slot_count * sizeof(int32_t));
+    if (map == NULL) {
+        return false;
+    }
+    map->return_address = (uintptr_t)return_address;
+    map->slot_count = slot_count;
+    memcpy(map->slots, slots, slot_count * sizeof(int32_t));
+
+    // a call site is only registered once, if it is registered
+    // again then the newer map replaces the old one
+    bool irq_state = irq_spinlock_acquire(&m_gc_stack_maps_lock);
+    rb_node_t* old = rb_find(return_address, &m_gc_stack_maps, gc_stack_map_cmp);
+    if (old != NULL) {
+        rb_replace_node(old, &map->node, &m_gc_stack_maps);
+    } else {
+        rb_add(&map->node, &m_gc_stack_maps, gc_stack_map_less);
+    }
+    irq_spinlock_release(&m_gc_stack_maps_lock, irq_state);
+
+    if (old != NULL) {
+        mem_free(containerof(old, gc_stack_map_t, node));
+    }
+
+    return true;
+}
+
+/**
+ * Find the stack map of a return address, must be called with the world stopped
+ * so the maps can't change under us (no one can hold the lock)
+ */
+static gc_stack_map_t* gc_find_stack_map(uintptr_t return_address) {
+    if (return_address < JIT_ADDR) {
+        return NULL;
+    }
+
+    rb_node_t* node = rb_find((void*)return_address, &m_gc_stack_maps, gc_stack_map_cmp);
+    return node != NULL ? containerof(node, gc_stack_map_t, node) : NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Root scanning
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The data and bss of the kernel and the runtime, conservatively scanned
+ */
+extern char __start_kernel_data[];
+extern char __stop_kernel_data[];
+
+/**
+ * Find the stack and frame pointers of a thread that was running on one
+ * of the cores we stopped, returns false if it was not running
+ */
+static bool gc_get_stopped_state(thread_t* thread, uintptr_t* sp, uintptr_t* bp) {
+    for (int i = 0; i < g_cpu_count; i++) {
+        gc_stopped_cpu_t* stopped = pcpu_get_pointer_of(&m_gc_stopped_cpu, i);
+        if (stopped->thread == thread &&
+            (uintptr_t)thread->stack_start <= stopped->sp &&
+            stopped->sp < (uintptr_t)thread->stack_end
+        ) {
+            *sp = stopped->sp;
+            *bp = stopped->bp;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Scan the reference slots of a frame that has a stack map, the
+ * slots must be between the low bound and the end of the stack
+ */
+static void gc_scan_stack_map(gc_stack_map_t* map, uintptr_t bp, uintptr_t low, uintptr_t stack_end) {
+    for (size_t i = 0; i < map->slot_count; i++) {
+        uintptr_t slot = bp + map->slots[i];
+        if (slot < low || slot + sizeof(void*) > stack_end) {
+            continue;
+        }
+
+        // references in managed frames can be interior
+        void* obj = gc_find_object(*(uintptr_t*)slot);
+        if (obj != NULL) {
+            gc_mark_object(obj);
+        }
+    }
+}
+
+/**
+ * Scan the stack by walking the frame pointer chain. Every frame record holds the frame pointer
+ * and return address into the caller, if the jit registered a stack map for the return address
+ * then the frame of the caller is scanned precisely, everything else (native frames, the frame
+ * records, the interrupted frame and the spilled registers) is scanned conservatively.
+ *
+ * We don't trust the chain, once it leaves the stack or stops moving up, the rest of the
+ * stack is scanned conservatively as a whole.
+ */
+static void gc_scan_stack(thread_t* thread, uintptr_t sp, uintptr_t bp) {
+    uintptr_t stack_end = (uintptr_t)thread->stack_end;
+
+    // the start of the part that was not scanned yet
+    uintptr_t low = sp;
+    while ((bp & 7) == 0 && low <= bp && bp + 16 <= stack_end) {
+        uintptr_t next = ((uintptr_t*)bp)[0];
+        uintptr_t return_address = ((uintptr_t*)bp)[1];
+        if (next <= bp || next > stack_end) {
+            break;
+        }
+
+        gc_stack_map_t* map = gc_find_stack_map(return_address);
+        if (map != NULL) {
+            // the frames below the caller are native, or managed frames that are
+            // not at a call site, so they are scanned conservatively, including
+            // the frame record, the frame of the caller only has the mapped slots
+            gc_scan_range((void*)low, (void*)(bp + 16));
+            gc_scan_stack_map(map, next, bp + 16, stack_end);
+            low = next;
+        }
+
+        bp = next;
+    }
+
+    gc_scan_range((void*)low, (void*)stack_end);
+}
+
+static void gc_mark_thread(thread_t* thread) {
+    // if the thread was running we use the state from the
+    // stop, otherwise the saved frame is at the top of the stack
+    uintptr_t sp;
+    uintptr_t bp;
+    if (!gc_get_stopped_state(thread, &sp, &bp)) {
+        sp = (uintptr_t)thread->cpu_state;
+        bp = 0;
+    }
+
+    if (sp < (uintptr_t)thread->stack_start || sp >= (uintptr_t)thread->stack_end) {
+        return;
+    }
+
+    // the saved frame is only read once we know it is on the stack
+    if (bp == 0) {
+        bp = thread->cpu_state->rbp;
+    }
+
+    gc_scan_stack(thread, sp, bp);
+
+    // the xmm registers of the legacy region
+    gc_scan_range(thread->extended_state + 160, thread->extended_state + 160 + 16 * 16);
+}
+
+void gc_mark_roots(void) {
+    // the registered roots are pointers to slots that hold references, if
+    // the runtime gave us an object instead then just keep that alive
+    for (size_t i = 0; i < m_gc_roots.count; i++) {
+        void* root = m_gc_roots.items[i];
+        void* obj = gc_find_object((uintptr_t)root);
+        if (obj == NULL) {
+            obj = gc_find_object(*(uintptr_t*)root);
+        }
+
+        if (obj != NULL) {
+            gc_mark_object(obj);
+        }
+    }
+
+    gc_mark_handles();
+
+    // globals of both the kernel and the runtime
+    gc_scan_range(__start_kernel_data, __stop_kernel_data);
+
+    // and the stacks of all the threads, other than our own
+    thread_t* current = scheduler_get_current_thread();
+    size_t count = thread_get_count();
+    for (size_t i = 0; i < count; i++) {
+        thread_t* thread = &THREADS[i];
+        if (thread == current) {
+            continue;
+        }
+
+        thread_status_t status = atomic_load_explicit(&thread->status, memory_order_acquire);
+        if (status == THREAD_STATUS_IDLE || status == THREAD_STATUS_DEAD) {
+            continue;
+        }
+
+        gc_mark_thread(thread);
+    }
+}
@@ -0,0 +1,169 @@
+#include "gc.h"
+#include "gc_internal.h"
+
+#include <debug/log.h>
+#include <lib/string.h>
+#include <mem/alloc.h>
+#include <mem/virt.h>
+
+#include "tomatodotnet/types/basic.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Heap dump
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The dump walks the heap while the mutators are running, so the counts are only a rough
+// picture of the heap, good enough to find out which types are taking all the memory. It is
+// done by the collector once it is done sweeping, so no part of the heap is decommitted under it.
+//
+
+/**
+ * The amount of distinct vtables that are tracked, the rest are counted together
+ */
+#define GC_DUMP_TABLE_SIZE      4096
+STATIC_ASSERT(GC_DUMP_TABLE_SIZE == 1 << 12);
+
+/**
+ * The amount of vtables printed
+ */
+#define GC_DUMP_TOP             20
+
+typedef struct gc_dump_entry {
+    void* vtable;
+    size_t count;
+    size_t bytes;
+} gc_dump_entry_t;
+
+typedef struct gc_dump {
+    gc_dump_entry_t* entries;
+    size_t used;
+
+    // objects whose vtable did not fit in the table
+    size_t other_count;
+    size_t other_bytes;
+} gc_dump_t;
+
+static void gc_dump_account(gc_dump_t* dump, void* vtable, size_t size) {
+    size_t index = (((uintptr_t)vtable >> 4) * 0x9E3779B97F4A7C15ull) >> (64 - 12);
+    while (dump->entries[index].vtable != NULL && dump->entries[index].vtable != vtable) {
+        index = (index + 1) % GC_DUMP_TABLE_SIZE;
+    }
+
+    gc_dump_entry_t* entry = &dump->entries[index];
+    if (entry->vtable == NULL) {
+        // keep some room so the probing stays short
+        if (dump->used >= GC_DUMP_TABLE_SIZE / 2) {
+            dump->other_count++;
+            dump->other_bytes += size;
+            return;
+        }
+        entry->vtable = vtable;
+        dump->used++;
+    }
+
+    entry->count++;
+    entry->bytes += size;
+}
+
+static void gc_dump_region(gc_dump_t* dump, gc_region_t* region) {
+    void* watermark = gc_region_watermark(region);
+    void* page = NULL;
+    bool mapped = false;
+
+    for (void* block = region->bottom; block + region->size <= watermark; block += region->size) {
+        // decommitted pages are not mapped, only check once per page
+        void* block_page = (void*)ALIGN_DOWN((uintptr_t)block, PAGE_SIZE);
+        if (block_page != page) {
+            page = block_page;
+            mapped = virt_is_mapped((uintptr_t)page);
+        }
+        if (!mapped) {
+            continue;
+        }
+
+        // free blocks have no vtable
+        void* vtable = ((Object)block)->VTable;
+        if (vtable != NULL) {
+            gc_dump_account(dump, vtable, region->size);
+        }
+    }
+}
+
+static void gc_dump_objects(void) {
+    gc_dump_t dump = {
+        .entries = mem_alloc(GC_DUMP_TABLE_SIZE * sizeof(gc_dump_entry_t)),
+    };
+    if (dump.entries == NULL) {
+        WARN("gc: out of memory dumping the heap");
+        return;
+    }
+
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_dump_region(&dump, &g_gc_regions[i]);
+    }
+
+    size_t size;
+    void* vtable;
+    void* obj = (void*)GC_LOS_ADDR;
+    while ((obj = gc_los_next_object(obj, &size, &vtable)) != NULL) {
+        if (vtable != NULL) {
+            gc_dump_account(&dump, vtable, size);
+        }
+        obj += size;
+    }
+
+    // vtables are printed by address, the type names are not reachable from here
+    TRACE("gc: objects by vtable:");
+    for (int i = 0; i < GC_DUMP_TOP; i++) {
+        gc_dump_entry_t* top = NULL;
+        for (int j = 0; j < GC_DUMP_TABLE_SIZE; j++) {
+            gc_dump_entry_t* entry = &dump.entries[j];
+            if (entry->vtable != NULL && entry->count != 0 && (top == NULL || entry->bytes > top->bytes)) {
+                top = entry;
+            }
+        }
+        if (top == NULL) {
+            break;
+        }
+
+        TRACE("gc: \tvtable %p: %lu objects, %lu bytes", top->vtable, top->count, top->bytes);
+        top->count = 0;
+    }
+
+    if (dump.other_count != 0) {
+        TRACE("gc: \tother vtables: %lu objects, %lu bytes", dump.other_count, dump.other_bytes);
+    }
+
+    mem_free(dump.entries);
+}
+
+void gc_dump_stats(void) {
+    gc_stats_t stats;
+    gc_get_stats(&stats);
+
+    TRACE("gc: %lu collections (%lu major)", stats.collections, stats.major_collections);
+    TRACE("gc: heap %lu/%lu bytes, %lu allocated and %lu freed in total",
+          stats.heap_in_use, stats.heap_goal, stats.total_allocated, stats.total_freed);
+
+    TRACE("gc: pauses (max %luus):", stats.max_pause_us);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (stats.pauses[i] != 0) {
+            TRACE("gc: \t%luus-%luus: %lu", i == 0 ? 0 : 1ul << i, 1ul << (i + 1), stats.pauses[i]);
+        }
+    }
+
+    // the live bytes are only updated by the sweep, so they lag behind
+    TRACE("gc: size classes:");
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+        void* watermark = gc_region_watermark(region);
+        if (watermark == region->bottom) {
+            continue;
+        }
+
+        size_t committed = (size_t)(watermark - region->bottom) - region->decommitted_bytes;
+        TRACE("gc: \t%lu bytes: %lu committed, %lu live", region->size, committed, region->live_bytes);
+    }
+
+    gc_dump_objects();
+}
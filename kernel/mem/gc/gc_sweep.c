@@ -0,0 +1,667 @@
+#include "gc_internal.h"
+
+#include <arch/intrin.h>
+#include <lib/string.h>
+#include <mem/alloc.h>
+#include <mem/phys.h>
+#include <mem/virt.h>
+
+/**
+ * The amount of bytes the collector sweeps at once, mutators only
+ * sweep a page worth of blocks when they need more memory
+ */
+#define GC_SWEEP_BATCH      (PAGE_SIZE * 64)
+
+/**
+ * The vtable and free link of a free block
+ */
+#define GC_FREE_HEADER      (sizeof(void*) * 2)
+
+/**
+ * Runs of free blocks are only decommitted if they cover at least this many pages, so
+ * the steady churn won't keep unmapping and faulting in the same pages
+ */
+#define GC_DECOMMIT_MIN_PAGES   16
+
+/**
+ * The most pages a single chunk can cover, and the most spans it can have
+ */
+#define GC_CHUNK_MAX_PAGES      SIZE_TO_PAGES(GC_SWEEP_BATCH + GC_MAX_SMALL_OBJECT)
+#define GC_CHUNK_MAX_SPANS      (GC_CHUNK_MAX_PAGES / GC_DECOMMIT_MIN_PAGES)
+
+/**
+ * The amount of bytes the collector may still decommit in this sweep,
+ * and the pages it decommitted, only touched by the collector
+ */
+static size_t m_gc_decommit_budget = 0;
+static size_t m_gc_decommitted_pages = 0;
+
+/**
+ * The amount of bytes freed by the current sweep
+ */
+static atomic_size_t m_gc_swept_bytes = 0;
+
+/**
+ * The amount of threads sweeping a chunk right now
+ */
+static atomic_size_t m_gc_sweepers = 0;
+
+/**
+ * Is the current sweep a minor one, only changed with the world stopped
+ */
+static bool m_gc_sweep_minor = false;
+
+/**
+ * The young table that is filled by the mutators, the other one belongs to the
+ * sweep, swapped with the world stopped
+ */
+static size_t m_gc_young_epoch = 0;
+
+/**
+ * Zero a freed block, so the next allocation will get a zeroed object and
+ * the allocation path never has to clear memory, pages of large blocks that
+ * were never touched are skipped
+ *
+ * Blocks that are not going to be used soon are zeroed with non-temporal
+ * stores so the sweep doesn't push the mutators' working set out of the cache
+ */
+static void gc_zero_block(void* block, size_t size, bool cold) {
+    if (!cold && size <= PAGE_SIZE) {
+        memset(block, 0, size);
+        return;
+    }
+
+    // the header words are cleared with normal stores, the sweep writes the
+    // free link right after, and that must not race with a weakly ordered store
+    ((uint64_t*)block)[0] = 0;
+    ((uint64_t*)block)[1] = 0;
+
+    // zero a page at a time, blocks don't have to be page aligned or a multiple of
+    // a page, so every chunk is clamped to both the page and the end of the block
+    void* end = block + size;
+    for (void* ptr = block + GC_FREE_HEADER; ptr < end;) {
+        void* next = (void*)ALIGN_DOWN((uintptr_t)ptr, PAGE_SIZE) + PAGE_SIZE;
+        if (next > end) {
+            next = end;
+        }
+        if (virt_is_mapped((uintptr_t)ptr)) {
+            memzero_nt(ptr, (size_t)(next - ptr));
+        }
+        ptr = next;
+    }
+}
+
+static bool gc_span_less(rb_node_t* a, const rb_node_t* b) {
+    return containerof(a, gc_span_t, node)->start < containerof(b, gc_span_t, node)->start;
+}
+
+/**
+ * Matches all the spans that end after the key, the spans don't
+ * overlap so the first match is the first span after the key
+ */
+static int gc_span_cmp_end(const void* key, const rb_node_t* node) {
+    return containerof(node, gc_span_t, node)->end <= key ? 1 : 0;
+}
+
+void* gc_take_decommitted(gc_region_t* region, size_t count, size_t* taken, gc_span_t** unused) {
+    *taken = 0;
+    *unused = NULL;
+
+    rb_node_t* node = rb_first(&region->decommitted);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    // take from the bottom of the lowest span, so the
+    // heap is kept as dense as possible
+    gc_span_t* span = containerof(node, gc_span_t, node);
+    size_t available = (size_t)(span->end - span->start) / region->size;
+    if (count > available) {
+        count = available;
+    }
+
+    void* block = span->start;
+    span->start += count * region->size;
+    region->decommitted_bytes -= count * region->size;
+    if (span->start == span->end) {
+        rb_erase(&span->node, &region->decommitted);
+        *unused = span;
+    }
+
+    *taken = count;
+    return block;
+}
+
+/**
+ * Insert a new span to the region, merging it with its neighbours, must be called with
+ * the region lock held, spans that were merged away are returned in unused
+ */
+static void gc_insert_span(gc_region_t* region, gc_span_t* span, gc_span_t* unused[2]) {
+    rb_add(&span->node, &region->decommitted, gc_span_less);
+    region->decommitted_bytes += (size_t)(span->end - span->start);
+
+    rb_node_t* prev = rb_prev(&span->node);
+    if (prev != NULL && containerof(prev, gc_span_t, node)->end == span->start) {
+        containerof(prev, gc_span_t, node)->end = span->end;
+        rb_erase(&span->node, &region->decommitted);
+        unused[0] = span;
+        span = containerof(prev, gc_span_t, node);
+    }
+
+    rb_node_t* next = rb_next(&span->node);
+    if (next != NULL && containerof(next, gc_span_t, node)->start == span->end) {
+        span->end = containerof(next, gc_span_t, node)->end;
+        rb_erase(next, &region->decommitted);
+        unused[1] = containerof(next, gc_span_t, node);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Young chunks
+//----------------------------------------------------------------------------------------------------------------------
+
+void gc_set_young_range(void* start, void* end) {
+    _Atomic(uint64_t)* table = GC_YOUNG_TABLE(m_gc_young_epoch);
+    for (size_t i = gc_young_index(start); i <= gc_young_index(end - 1); i++) {
+        // most of the time the chunk is young already, so don't write to the line
+        uint64_t bit = 1ull << (i % 64);
+        if ((atomic_load_explicit(&table[i / 64], memory_order_relaxed) & bit) == 0) {
+            atomic_fetch_or_explicit(&table[i / 64], bit, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Find the first block at or after the cursor that starts in a chunk that was
+ * young when the sweep started, returns the limit if there is none
+ */
+static void* gc_next_young_block(gc_region_t* region, void* cursor, void* limit) {
+    _Atomic(uint64_t)* table = GC_YOUNG_TABLE(m_gc_young_epoch ^ 1);
+    size_t index = gc_young_index(cursor);
+    size_t last = gc_young_index(limit - 1);
+    while (index <= last) {
+        uint64_t word = atomic_load_explicit(&table[index / 64], memory_order_relaxed) >> (index % 64);
+        if (word != 0) {
+            index += __builtin_ctzll(word);
+            break;
+        }
+        index = ALIGN_DOWN(index, 64) + 64;
+    }
+    if (index > last) {
+        return limit;
+    }
+
+    void* chunk = (void*)(GC_HEAP_ADDR + (index << GC_YOUNG_CHUNK_SHIFT));
+    if (chunk <= cursor) {
+        return cursor;
+    }
+
+    void* block = region->bottom + DIV_ROUND_UP((size_t)(chunk - region->bottom), region->size) * region->size;
+    return block < limit ? block : limit;
+}
+
+/**
+ * Clear the young table of the sweep once it is done, so it is empty by the time it is filled again
+ */
+static void gc_clear_young(void) {
+    _Atomic(uint64_t)* table = GC_YOUNG_TABLE(m_gc_young_epoch ^ 1);
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+        void* watermark = gc_region_watermark(region);
+        if (watermark == region->bottom) {
+            continue;
+        }
+
+        // the regions are aligned way above 64 chunks
+        size_t first = gc_young_index(region->bottom) / 64;
+        size_t last = DIV_ROUND_UP(gc_young_index(watermark - 1) + 1, 64);
+        memset((void*)&table[first], 0, (last - first) * sizeof(uint64_t));
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Sweep
+//----------------------------------------------------------------------------------------------------------------------
+
+void gc_sweep_start(bool minor) {
+    m_gc_sweep_minor = minor;
+
+    // the chunks given out from now on are young for the next cycle
+    m_gc_young_epoch ^= 1;
+
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+
+        // a full sweep rebuilds the freelist from scratch, a minor sweep adds to it, anything
+        // above the watermark was allocated after the marking so it is not swept
+        bool irq_state = irq_spinlock_acquire(&region->lock);
+        if (!minor) {
+            region->freelist = NULL;
+            region->live_bytes = 0;
+        }
+        region->sweep_cursor = region->bottom;
+        region->sweep_end = region->watermark;
+        irq_spinlock_release(&region->lock, irq_state);
+    }
+
+    gc_los_sweep_start();
+}
+
+/**
+ * Claim the next chunk of the region to sweep, the chunk is at least
+ * one block, returns false if the region is fully swept
+ */
+static bool gc_sweep_claim(gc_region_t* region, size_t bytes, void** start, void** end) {
+    bool claimed = false;
+
+    bool irq_state = irq_spinlock_acquire(&region->lock);
+
+    void* limit;
+    for (;;) {
+        // skip over the decommitted spans, there is nothing to sweep in them
+        // and we don't want to fault their pages back in
+        limit = region->sweep_end;
+        rb_node_t* node = rb_find_first(region->sweep_cursor, &region->decommitted, gc_span_cmp_end);
+        while (node != NULL && region->sweep_cursor < limit) {
+            gc_span_t* span = containerof(node, gc_span_t, node);
+            if (span->start > region->sweep_cursor) {
+                if (span->start < limit) {
+                    limit = span->start;
+                }
+                break;
+            }
+            region->sweep_cursor = span->end;
+            node = rb_next(node);
+        }
+
+        // a minor sweep skips the chunks no block was given out from, all the
+        // objects in them are old, the skip might land in another span
+        if (!m_gc_sweep_minor || region->sweep_cursor >= limit) {
+            break;
+        }
+        void* young = gc_next_young_block(region, region->sweep_cursor, limit);
+        if (young == region->sweep_cursor) {
+            break;
+        }
+        region->sweep_cursor = young;
+    }
+
+    if (region->sweep_cursor < limit) {
+        size_t count = DIV_ROUND_UP(bytes, region->size);
+        size_t left = (size_t)(limit - region->sweep_cursor) / region->size;
+        if (count > left) {
+            count = left;
+        }
+
+        *start = region->sweep_cursor;
+        *end = region->sweep_cursor + count * region->size;
+        region->sweep_cursor = *end;
+        atomic_fetch_add(&m_gc_sweepers, 1);
+        claimed = true;
+    }
+    irq_spinlock_release(&region->lock, irq_state);
+
+    return claimed;
+}
+
+/**
+ * Find the runs of free blocks in the chunk that are worth decommitting, only the mark bits
+ * are looked at so the memory itself is not touched, returns the amount of spans found
+ */
+static size_t gc_find_free_spans(gc_region_t* region, void* start, void* end, gc_span_t** spans) {
+    size_t count = 0;
+    void* run = NULL;
+
+    for (void* block = start; block <= end && count < GC_CHUNK_MAX_SPANS; block += region->size) {
+        // free blocks are never marked, and live blocks always are
+        if (block < end && !gc_is_marked(block)) {
+            if (run == NULL) {
+                run = block;
+            }
+            continue;
+        }
+
+        if (run == NULL) {
+            continue;
+        }
+
+        uintptr_t first = ALIGN_UP((uintptr_t)run, PAGE_SIZE);
+        uintptr_t last = ALIGN_DOWN((uintptr_t)block, PAGE_SIZE);
+        size_t bytes = (size_t)(block - run);
+        if (last > first && (last - first) / PAGE_SIZE >= GC_DECOMMIT_MIN_PAGES && m_gc_decommit_budget != 0) {
+            gc_span_t* span = mem_alloc(sizeof(gc_span_t));
+            if (span == NULL) {
+                break;
+            }
+            span->start = run;
+            span->end = block;
+            spans[count++] = span;
+            m_gc_decommit_budget = m_gc_decommit_budget > bytes ? m_gc_decommit_budget - bytes : 0;
+        }
+        run = NULL;
+    }
+
+    return count;
+}
+
+/**
+ * Return the pages of the spans found in the chunk, the TLB is flushed once for the whole
+ * chunk, for the heap and for its shadow, before the pages are freed, returns the amount of
+ * pages that were freed
+ */
+static size_t gc_decommit_spans(gc_region_t* region, gc_span_t** spans, size_t count) {
+    void* pages[GC_CHUNK_MAX_PAGES];
+    size_t page_count = 0;
+
+    uintptr_t low = UINTPTR_MAX;
+    uintptr_t high = 0;
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t first = ALIGN_UP((uintptr_t)spans[i]->start, PAGE_SIZE);
+        uintptr_t last = ALIGN_DOWN((uintptr_t)spans[i]->end, PAGE_SIZE);
+
+        // the pages we don't unmap are shared with other blocks, so zero
+        // just our part of them, the rest is zero once faulted in again
+        memzero_nt(spans[i]->start, first - (uintptr_t)spans[i]->start);
+        memzero_nt((void*)last, (uintptr_t)spans[i]->end - last);
+
+        page_count += virt_unmap_range(first, (last - first) / PAGE_SIZE, &pages[page_count]);
+        if (first < low) {
+            low = first;
+        }
+        if (last > high) {
+            high = last;
+        }
+    }
+
+    if (page_count != 0) {
+        virt_flush_tlb_range(low, (high - low) / PAGE_SIZE);
+        virt_flush_tlb_range((uintptr_t)gc_shadow((void*)low), (high - low) / PAGE_SIZE);
+        phys_free_bulk(pages, page_count);
+    }
+
+    // the zeroing must be visible before anyone can allocate from the spans
+    __sfence();
+
+    for (size_t i = 0; i < count; i++) {
+        gc_span_t* unused[2] = { NULL, NULL };
+
+        bool irq_state = irq_spinlock_acquire(&region->lock);
+        gc_insert_span(region, spans[i], unused);
+        irq_spinlock_release(&region->lock, irq_state);
+
+        mem_free(unused[0]);
+        mem_free(unused[1]);
+    }
+
+    return page_count;
+}
+
+/**
+ * Sweep a chunk of the region, all the blocks that are not live are linked in address
+ * order, so allocations from the chunk are sequential, cold chunks are not going to be
+ * allocated from right away, and are only swept by the collector
+ *
+ * A minor sweep only links the dead blocks, the free ones are still in the freelists
+ */
+static void* gc_sweep_chunk(gc_region_t* region, void* start, void* end, void** tail, size_t* count, bool cold) {
+    void* head = NULL;
+    size_t freed = 0;
+    size_t live = 0;
+
+    // the collector gives back long free runs, the
+    // mutators need the blocks so they don't bother
+    gc_span_t* spans[GC_CHUNK_MAX_SPANS];
+    size_t span_count = 0;
+    if (cold && m_gc_decommit_budget != 0) {
+        span_count = gc_find_free_spans(region, start, end, spans);
+    }
+
+    *tail = NULL;
+    *count = 0;
+    size_t span = 0;
+    for (void* block = start; block < end; block += region->size) {
+        void* vtable = __atomic_load_n((void**)block, __ATOMIC_ACQUIRE);
+
+        // blocks that are going to be decommitted are only counted
+        bool decommit = span < span_count && block >= spans[span]->start;
+        if (decommit && block + region->size == spans[span]->end) {
+            span++;
+        }
+
+        if (vtable != NULL) {
+            if (gc_is_marked(block)) {
+                live += region->size;
+                continue;
+            }
+
+            freed += region->size;
+            if (decommit) {
+                continue;
+            }
+
+            // dead, zero it so the next allocation gets a zeroed object
+            gc_zero_block(block, region->size, cold);
+        } else if (decommit || m_gc_sweep_minor) {
+            continue;
+        }
+
+        *gc_free_link(block) = NULL;
+        if (*tail == NULL) {
+            head = block;
+        } else {
+            *gc_free_link(*tail) = block;
+        }
+        *tail = block;
+        (*count)++;
+    }
+
+    // the non-temporal stores are weakly ordered, they must be
+    // visible before the blocks are given to anyone else
+    if (freed != 0) {
+        __sfence();
+    }
+
+    if (span_count != 0) {
+        m_gc_decommitted_pages += gc_decommit_spans(region, spans, span_count);
+    }
+
+    if (!m_gc_sweep_minor) {
+        __atomic_fetch_add(&region->live_bytes, live, __ATOMIC_RELAXED);
+    }
+    atomic_fetch_add_explicit(&m_gc_swept_bytes, freed, memory_order_relaxed);
+    atomic_fetch_sub(&m_gc_sweepers, 1);
+
+    return head;
+}
+
+void* gc_sweep_lazy(gc_region_t* region, void** tail, size_t* count) {
+    void* start;
+    void* end;
+    while (gc_sweep_claim(region, PAGE_SIZE, &start, &end)) {
+        void* head = gc_sweep_chunk(region, start, end, tail, count, false);
+        if (head != NULL) {
+            return head;
+        }
+    }
+    return NULL;
+}
+
+size_t gc_sweep(size_t retain, size_t* decommitted) {
+    // only give back what is above the amount we want to keep
+    // committed, the rest is going to be used again soon
+    size_t committed = 0;
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+        bool irq_state = irq_spinlock_acquire(&region->lock);
+        committed += (size_t)(region->watermark - region->bottom) - region->decommitted_bytes;
+        irq_spinlock_release(&region->lock, irq_state);
+    }
+    m_gc_decommit_budget = committed > retain ? committed - retain : 0;
+    m_gc_decommitted_pages = 0;
+
+    // the free blocks of a minor sweep are in the freelists, so
+    // the runs of unmarked blocks can't be given back
+    if (m_gc_sweep_minor) {
+        m_gc_decommit_budget = 0;
+    }
+
+    // sweep whatever the mutators did not sweep yet
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        gc_region_t* region = &g_gc_regions[i];
+
+        void* start;
+        void* end;
+        while (gc_sweep_claim(region, GC_SWEEP_BATCH, &start, &end)) {
+            void* tail;
+            size_t count;
+            void* head = gc_sweep_chunk(region, start, end, &tail, &count, true);
+            if (head == NULL) {
+                continue;
+            }
+
+            bool irq_state = irq_spinlock_acquire(&region->lock);
+            *gc_free_link(tail) = region->freelist;
+            region->freelist = head;
+            irq_spinlock_release(&region->lock, irq_state);
+        }
+    }
+
+    // wait for the mutators to finish the chunks they took
+    while (atomic_load(&m_gc_sweepers) != 0) {
+        cpu_relax();
+    }
+
+    gc_clear_young();
+
+    *decommitted = m_gc_decommitted_pages;
+
+    size_t freed = atomic_exchange_explicit(&m_gc_swept_bytes, 0, memory_order_relaxed);
+    freed += gc_los_sweep();
+    return freed;
+}
+
+size_t gc_decommit_free(size_t target_pages) {
+    size_t freed = 0;
+
+    // the large classes have the longest runs of free blocks
+    for (int i = GC_REGION_COUNT - 1; i >= 0 && freed < target_pages; i--) {
+        gc_region_t* region = &g_gc_regions[i];
+
+        // take the whole freelist, in the meantime the mutators
+        // allocate from the decommitted spans or the watermark
+        bool irq_state = irq_spinlock_acquire(&region->lock);
+        ASSERT(region->sweep_cursor >= region->sweep_end);
+        void* block = region->freelist;
+        region->freelist = NULL;
+        irq_spinlock_release(&region->lock, irq_state);
+
+        // every swept chunk is linked in address order, so the runs of adjacent free
+        // blocks are found by following the links, they are cut at the size of a
+        // chunk so the decommit can handle them
+        void* keep_head = NULL;
+        void* keep_tail = NULL;
+        while (block != NULL) {
+            void* run = block;
+            void* last = block;
+            block = *gc_free_link(last);
+            while (block == last + region->size && (size_t)(block - run) < GC_SWEEP_BATCH) {
+                last = block;
+                block = *gc_free_link(last);
+            }
+
+            uintptr_t first = ALIGN_UP((uintptr_t)run, PAGE_SIZE);
+            uintptr_t end = ALIGN_DOWN((uintptr_t)last + region->size, PAGE_SIZE);
+            gc_span_t* span = NULL;
+            if (freed < target_pages && end > first && (end - first) / PAGE_SIZE >= GC_DECOMMIT_MIN_PAGES) {
+                span = mem_alloc(sizeof(gc_span_t));
+            }
+
+            if (span != NULL) {
+                span->start = run;
+                span->end = last + region->size;
+                freed += gc_decommit_spans(region, &span, 1);
+                continue;
+            }
+
+            // not worth it, keep the run as is
+            if (keep_tail == NULL) {
+                keep_head = run;
+            } else {
+                *gc_free_link(keep_tail) = run;
+            }
+            keep_tail = last;
+        }
+
+        if (keep_tail != NULL) {
+            irq_state = irq_spinlock_acquire(&region->lock);
+            *gc_free_link(keep_tail) = region->freelist;
+            region->freelist = keep_head;
+            irq_spinlock_release(&region->lock, irq_state);
+        }
+    }
+
+    return freed;
+}
+
+#ifdef __DEBUG__
+
+//----------------------------------------------------------------------------------------------------------------------
+// Self test
+//----------------------------------------------------------------------------------------------------------------------
+
+void gc_sweep_self_test(void) {
+    // the blocks of a class above a page that is not a multiple of
+    // a page start and end in the middle of pages
+    gc_region_t* region = NULL;
+    for (int i = 0; i < GC_REGION_COUNT; i++) {
+        if (g_gc_regions[i].size > PAGE_SIZE && g_gc_regions[i].size % PAGE_SIZE != 0) {
+            region = &g_gc_regions[i];
+            break;
+        }
+    }
+    ASSERT(region != NULL);
+    ASSERT(region->watermark == region->bottom);
+
+    // three adjacent objects, only the middle one is dead
+    static uint64_t dummy_vtable;
+    void* blocks[3];
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = region->bottom + i * region->size;
+        memset(blocks[i], 0xCC, region->size);
+        *(void**)blocks[i] = &dummy_vtable;
+    }
+    gc_try_mark(blocks[0]);
+    gc_try_mark(blocks[2]);
+
+    region->sweep_cursor = blocks[0];
+    region->sweep_end = blocks[2] + region->size;
+
+    void* tail;
+    size_t count;
+    void* head = gc_sweep_lazy(region, &tail, &count);
+    ASSERT(head == blocks[1] && count == 1);
+    ASSERT(gc_sweep_lazy(region, &tail, &count) == NULL);
+
+    // the dead one is zeroed, and the live ones are untouched
+    for (size_t i = 0; i < region->size; i++) {
+        ASSERT(((uint8_t*)blocks[1])[i] == 0);
+    }
+    for (int i = 0; i < 3; i += 2) {
+        ASSERT(*(void**)blocks[i] == &dummy_vtable);
+        for (size_t j = sizeof(void*); j < region->size; j++) {
+            ASSERT(((uint8_t*)blocks[i])[j] == 0xCC);
+        }
+    }
+
+    // leave the heap as we found it, above the watermark everything is zero
+    for (int i = 0; i < 3; i++) {
+        gc_clear_mark(blocks[i]);
+        memset(blocks[i], 0, region->size);
+    }
+    region->sweep_cursor = NULL;
+    region->sweep_end = NULL;
+    region->live_bytes = 0;
+    atomic_store_explicit(&m_gc_swept_bytes, 0, memory_order_relaxed);
+}
+
+#endif
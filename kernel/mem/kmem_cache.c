@@ -0,0 +1,297 @@
+#include "kmem_cache.h"
+
+#include <stdatomic.h>
+
+#include "sync/spinlock.h"
+#include "thread/pcpu.h"
+#include "alloc.h"
+#include "reclaim.h"
+
+/**
+ * The max amount of caches we support, we need a fixed
+ * amount since the per-cpu caches are allocated statically
+ */
+#define KMEM_MAX_CACHES         32
+
+/**
+ * The size of the slabs we take from the kernel heap
+ */
+#define KMEM_SLAB_SIZE          SIZE_16KB
+
+/**
+ * The granularity of the cache coloring, we want each
+ * slab to start on a different cache line
+ */
+#define KMEM_COLOR_ALIGN        64
+
+/**
+ * The amount of objects each per-cpu magazine can hold, and the
+ * amount of objects we move from/to the cache at once
+ */
+#define KMEM_MAGAZINE_SIZE      16
+#define KMEM_MAGAZINE_BATCH     (KMEM_MAGAZINE_SIZE / 2)
+
+struct kmem_cache {
+    // the params the cache was created with
+    const char* name;
+    kmem_cache_ctor_t ctor;
+    kmem_cache_grow_t grow;
+
+    // the index of the per-cpu cache
+    int index;
+
+    // the distance between objects in a slab
+    size_t stride;
+
+    // where the free link is inside of the object
+    size_t free_offset;
+
+    // the amount of objects in each slab, the max color offset and the
+    // distance between colors, the amount of slabs picks the next color
+    size_t slab_objects;
+    size_t color_max;
+    size_t color_align;
+    atomic_size_t color_next;
+
+    // protects everything below
+    irq_spinlock_t lock;
+
+    // constructed objects that are free
+    void* freelist;
+};
+
+typedef struct kmem_magazine {
+    // the amount of objects in the magazine
+    size_t count;
+
+    // the objects themselves
+    void* objs[KMEM_MAGAZINE_SIZE];
+} kmem_magazine_t;
+
+/**
+ * The per-cpu magazines of each cache
+ */
+static CPU_LOCAL kmem_magazine_t m_kmem_magazines[KMEM_MAX_CACHES];
+
+/**
+ * The amount of caches allocated, and the caches by their index, an
+ * entry is NULL until the cache that claimed it is fully set up
+ */
+static atomic_int m_kmem_cache_count = 0;
+static _Atomic(kmem_cache_t*) m_kmem_caches[KMEM_MAX_CACHES];
+
+static void kmem_drain_cpu(void);
+
+/**
+ * The caches never give memory back, but draining the magazines
+ * lets any core reuse the objects the others were holding
+ */
+static shrinker_t m_kmem_shrinker = {
+    .name = "kmem caches",
+    .drain_cpu = kmem_drain_cpu,
+};
+
+kmem_cache_t* kmem_cache_create(const kmem_cache_params_t* params) {
+    kmem_cache_t* cache = mem_alloc(sizeof(kmem_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(*cache));
+
+    size_t align = params->align < sizeof(void*) ? sizeof(void*) : params->align;
+
+    cache->name = params->name;
+    cache->ctor = params->ctor;
+    cache->grow = params->grow;
+    cache->lock = IRQ_SPINLOCK_INIT;
+
+    // figure where to place the free link, without a ctor
+    // we can just use the start of the object
+    size_t size = params->size;
+    if (params->has_free_offset) {
+        cache->free_offset = params->free_offset;
+    } else if (params->ctor != NULL) {
+        size = ALIGN_UP(size, sizeof(void*));
+        cache->free_offset = size;
+        size += sizeof(void*);
+    } else {
+        cache->free_offset = 0;
+    }
+    cache->stride = ALIGN_UP(size, align);
+
+    // the leftover space of the slab is used to color it, so
+    // objects from different slabs won't fight over the same
+    // cache sets
+    if (cache->grow == NULL) {
+        size_t slab_size = cache->stride > KMEM_SLAB_SIZE ? cache->stride : KMEM_SLAB_SIZE;
+        cache->slab_objects = slab_size / cache->stride;
+        size_t leftover = slab_size - cache->slab_objects * cache->stride;
+        cache->color_align = align > KMEM_COLOR_ALIGN ? align : KMEM_COLOR_ALIGN;
+        cache->color_max = ALIGN_DOWN(leftover, cache->color_align);
+    }
+
+    // only take a per-cpu slot once nothing else can fail
+    int index = atomic_load(&m_kmem_cache_count);
+    do {
+        if (index >= KMEM_MAX_CACHES) {
+            ERROR("kmem: too many caches, can't create `%s`", params->name);
+            mem_free(cache);
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak(&m_kmem_cache_count, &index, index + 1));
+    cache->index = index;
+    atomic_store(&m_kmem_caches[index], cache);
+
+    if (index == 0) {
+        reclaim_register_shrinker(&m_kmem_shrinker);
+    }
+
+    return cache;
+}
+
+static void** kmem_free_link(kmem_cache_t* cache, void* obj) {
+    return obj + cache->free_offset;
+}
+
+/**
+ * Create new objects, returns one of them and puts the rest of the slab on the
+ * freelist, the memory is allocated and constructed without the lock held
+ */
+static void* kmem_cache_new_objects(kmem_cache_t* cache) {
+    if (cache->grow != NULL) {
+        void* obj = cache->grow();
+        if (obj != NULL && cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+        return obj;
+    }
+
+    size_t slab_size = cache->slab_objects * cache->stride + cache->color_max;
+    void* slab = mem_alloc_aligned(slab_size, cache->color_align);
+    if (slab == NULL) {
+        return NULL;
+    }
+
+    // color the slab, each new slab takes the next color
+    size_t colors = cache->color_max / cache->color_align + 1;
+    size_t color = atomic_fetch_add_explicit(&cache->color_next, 1, memory_order_relaxed) % colors;
+    slab += color * cache->color_align;
+
+    // construct the whole slab, the first object is returned
+    // and the rest are linked together for the freelist
+    void* head = NULL;
+    void* tail = NULL;
+    for (size_t i = 0; i < cache->slab_objects; i++) {
+        void* obj = slab + i * cache->stride;
+        if (cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+
+        if (i == 0) {
+            continue;
+        }
+
+        *kmem_free_link(cache, obj) = head;
+        head = obj;
+        if (tail == NULL) {
+            tail = obj;
+        }
+    }
+
+    if (head != NULL) {
+        bool irq_state = irq_spinlock_acquire(&cache->lock);
+        *kmem_free_link(cache, tail) = cache->freelist;
+        cache->freelist = head;
+        irq_spinlock_release(&cache->lock, irq_state);
+    }
+
+    return slab;
+}
+
+/**
+ * Fill the magazine with a batch of free objects, returns
+ * false if the cache has no free objects
+ */
+static bool kmem_magazine_fill(kmem_cache_t* cache, kmem_magazine_t* magazine) {
+    bool irq_state = irq_spinlock_acquire(&cache->lock);
+    while (magazine->count < KMEM_MAGAZINE_BATCH && cache->freelist != NULL) {
+        void* obj = cache->freelist;
+        cache->freelist = *kmem_free_link(cache, obj);
+        magazine->objs[magazine->count++] = obj;
+    }
+    irq_spinlock_release(&cache->lock, irq_state);
+
+    return magazine->count != 0;
+}
+
+/**
+ * Return a batch of objects from the magazine to the cache
+ */
+static void kmem_magazine_flush(kmem_cache_t* cache, kmem_magazine_t* magazine) {
+    bool irq_state = irq_spinlock_acquire(&cache->lock);
+    while (magazine->count > KMEM_MAGAZINE_SIZE - KMEM_MAGAZINE_BATCH) {
+        void* obj = magazine->objs[--magazine->count];
+        *kmem_free_link(cache, obj) = cache->freelist;
+        cache->freelist = obj;
+    }
+    irq_spinlock_release(&cache->lock, irq_state);
+}
+
+/**
+ * Return all the objects in the magazines of the current core to their caches
+ */
+static void kmem_drain_cpu(void) {
+    int count = atomic_load(&m_kmem_cache_count);
+    for (int i = 0; i < count; i++) {
+        kmem_cache_t* cache = atomic_load(&m_kmem_caches[i]);
+        if (cache == NULL) {
+            continue;
+        }
+
+        kmem_magazine_t* magazine = pcpu_get_pointer(&m_kmem_magazines[i]);
+        if (magazine->count == 0) {
+            continue;
+        }
+
+        bool irq_state = irq_spinlock_acquire(&cache->lock);
+        while (magazine->count != 0) {
+            void* obj = magazine->objs[--magazine->count];
+            *kmem_free_link(cache, obj) = cache->freelist;
+            cache->freelist = obj;
+        }
+        irq_spinlock_release(&cache->lock, irq_state);
+    }
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    void* obj = NULL;
+
+    bool irq_state = irq_save();
+    kmem_magazine_t* magazine = pcpu_get_pointer(&m_kmem_magazines[cache->index]);
+    if (magazine->count != 0 || kmem_magazine_fill(cache, magazine)) {
+        obj = magazine->objs[--magazine->count];
+    }
+    irq_restore(irq_state);
+
+    // the cache is empty, new objects are made without being
+    // tied to this core so interrupts are back on if they were
+    if (obj == NULL) {
+        obj = kmem_cache_new_objects(cache);
+    }
+
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (obj == NULL) {
+        return;
+    }
+
+    bool irq_state = irq_save();
+    kmem_magazine_t* magazine = pcpu_get_pointer(&m_kmem_magazines[cache->index]);
+    if (magazine->count == KMEM_MAGAZINE_SIZE) {
+        kmem_magazine_flush(cache, magazine);
+    }
+    magazine->objs[magazine->count++] = obj;
+    irq_restore(irq_state);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lib/except.h"
+
+typedef struct kmem_cache kmem_cache_t;
+
+/**
+ * Initialize a newly created object, objects keep their constructed
+ * state across free and alloc so this is only called once per object
+ */
+typedef void (*kmem_cache_ctor_t)(void* obj);
+
+/**
+ * Get the memory for a single new object, used by caches whose
+ * objects must live in a specific place
+ */
+typedef void* (*kmem_cache_grow_t)(void);
+
+typedef struct kmem_cache_params {
+    // the name of the cache, for debugging
+    const char* name;
+
+    // the size and alignment of each object
+    size_t size;
+    size_t align;
+
+    // optional constructor
+    kmem_cache_ctor_t ctor;
+
+    // optional, where in the object to keep the freelist link, the link is not
+    // part of the constructed state, if not given and there is a constructor the
+    // link is placed right after the object
+    bool has_free_offset;
+    size_t free_offset;
+
+    // optional, get memory for a new object, if not given the
+    // objects are allocated in colored slabs from the kernel heap
+    kmem_cache_grow_t grow;
+} kmem_cache_params_t;
+
+/**
+ * Create a new object cache, caches live forever
+ */
+kmem_cache_t* kmem_cache_create(const kmem_cache_params_t* params);
+
+/**
+ * Allocate an object from the cache, this is irq safe
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+/**
+ * Return an object to the cache, the object must be
+ * in its constructed state, this is irq safe
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
@@ -13,40 +13,17 @@
 // 0xFFFF8000_00000000 - 0xFFFF807F_FFFFFFFF: Direct memory map
 // 0xFFFF8080_00000000 - 0xFFFF80FF_FFFFFFFF: --- reserved ---
 //
-// 0xFFFF8100_00000000 - 0xFFFF817F_FFFFFFFF: GC Heap order 0  - 32
-// 0xFFFF8180_00000000 - 0xFFFF81FF_FFFFFFFF: GC Heap order 1  - 64
-// 0xFFFF8200_00000000 - 0xFFFF827F_FFFFFFFF: GC Heap order 2  - 128
-// 0xFFFF8280_00000000 - 0xFFFF82FF_FFFFFFFF: GC Heap order 3  - 256
-// 0xFFFF8300_00000000 - 0xFFFF837F_FFFFFFFF: GC Heap order 4  - 512
-// 0xFFFF8380_00000000 - 0xFFFF83FF_FFFFFFFF: GC Heap order 5  - 1k
-// 0xFFFF8400_00000000 - 0xFFFF847F_FFFFFFFF: GC Heap order 6  - 2k
-// 0xFFFF8480_00000000 - 0xFFFF84FF_FFFFFFFF: GC Heap order 7  - 4k
-// 0xFFFF8500_00000000 - 0xFFFF857F_FFFFFFFF: GC Heap order 8  - 8k
-// 0xFFFF8580_00000000 - 0xFFFF85FF_FFFFFFFF: GC Heap order 9  - 16k
-// 0xFFFF8600_00000000 - 0xFFFF867F_FFFFFFFF: GC Heap order 10 - 32k
-// 0xFFFF8680_00000000 - 0xFFFF86FF_FFFFFFFF: GC Heap order 11 - 64k
-// 0xFFFF8700_00000000 - 0xFFFF877F_FFFFFFFF: GC Heap order 12 - 128k
-// 0xFFFF8780_00000000 - 0xFFFF87FF_FFFFFFFF: GC Heap order 13 - 256k
-// 0xFFFF8800_00000000 - 0xFFFF887F_FFFFFFFF: GC Heap order 14 - 512k
-// 0xFFFF8880_00000000 - 0xFFFF88FF_FFFFFFFF: GC Heap order 15 - 1m
-// 0xFFFF8900_00000000 - 0xFFFF897F_FFFFFFFF: GC Heap order 16 - 2m
-// 0xFFFF8980_00000000 - 0xFFFF89FF_FFFFFFFF: GC Heap order 17 - 4m
-// 0xFFFF8A00_00000000 - 0xFFFF8A7F_FFFFFFFF: GC Heap order 18 - 8m
-// 0xFFFF8A80_00000000 - 0xFFFF8AFF_FFFFFFFF: GC Heap order 19 - 16m
-// 0xFFFF8B00_00000000 - 0xFFFF8B7F_FFFFFFFF: GC Heap order 20 - 32m
-// 0xFFFF8B80_00000000 - 0xFFFF8BFF_FFFFFFFF: GC Heap order 21 - 64m
-// 0xFFFF8C00_00000000 - 0xFFFF8C7F_FFFFFFFF: GC Heap order 22 - 128m
-// 0xFFFF8C80_00000000 - 0xFFFF8CFF_FFFFFFFF: GC Heap order 23 - 256m
-// 0xFFFF8D00_00000000 - 0xFFFF8D7F_FFFFFFFF: GC Heap order 24 - 512m
-// 0xFFFF8D80_00000000 - 0xFFFF8DFF_FFFFFFFF: GC Heap order 25 - 1gb
-// 0xFFFF8E00_00000000 - 0xFFFF8E7F_FFFFFFFF: GC Heap order 26 - 2gb
+// 0xFFFF8100_00000000 - 0xFFFF813F_FFFFFFFF: GC Heap size class 0  - 16
+// 0xFFFF8140_00000000 - 0xFFFF817F_FFFFFFFF: GC Heap size class 1  - 32
+// ...                                        (256GB for each of the 40 size classes)
+// 0xFFFF8AC0_00000000 - 0xFFFF8AFF_FFFFFFFF: GC Heap size class 39 - 32k
+// 0xFFFF8B00_00000000 - 0xFFFF8E7F_FFFFFFFF: GC Heap large objects
 // 0xFFFF8E80_00000000 - 0xFFFF8EFF_FFFFFFFF: --- barrier ---
 // 0xFFFF8F00_00000000 - 0xFFFF8F7F_FFFFFFFF: Stacks
 // 0xFFFF8F80_00000000 - 0xFFFF8FFF_FFFFFFFF: Small stacks
-// 0xFFFF9000_00000000 - 0xFFFF9F7F_FFFFFFFF: Managed Mappings
-// 0xFFFF9F80_00000000 - 0xFFFF9FFF_FFFFFFFF: Unused
+// 0xFFFF9000_00000000 - 0xFFFF9FFF_FFFFFFFF: RO copy of the GC heap + RW copy of the rest of the range above
 //
-// 0xFFFFA000_00000000 - 0xFFFFAFFF_FFFFFFFF: RO copy of the entire heap + RW copy of the stacks and managed mappings
+// 0xFFFFA000_00000000 - 0xFFFFA0FF_FFFFFFFF: GC metadata (mark bits and card table)
 //
 // 0xFFFFB000_00000000 - 0xFFFFB07F_FFFFFFFF: Thread structs
 //
@@ -67,6 +44,24 @@
  */
 #define DIRECT_MAP_OFFSET       0xFFFF800000000000ULL
 
+/**
+ * The GC heap, split into regions by size class and a large object space
+ */
+#define GC_HEAP_ADDR            (0xFFFF810000000000ULL)
+#define GC_HEAP_ADDR_END        (0xFFFF8E8000000000ULL)
+
+/**
+ * The offset of the RO shadow of the GC heap, the shadow shares the page tables
+ * of the heap so it always sees the same pages but can't be written through
+ */
+#define GC_HEAP_SHADOW_OFFSET   SIZE_16TB
+
+/**
+ * The metadata of the GC heap, allocated lazily as required
+ */
+#define GC_METADATA_ADDR        (0xFFFFA00000000000ULL)
+#define GC_METADATA_ADDR_END    (0xFFFFA10000000000ULL)
+
 /**
  * The bottom of the stack allocator
  *
@@ -1,5 +1,6 @@
 #include "phys.h"
 
+#include <cpuid.h>
 #include <limine_requests.h>
 
 #include "lib/string.h"
@@ -10,6 +11,8 @@
 #include "sync/spinlock.h"
 #include "limine.h"
 #include "thread/pcpu.h"
+#include "acpi/acpi.h"
+#include "reclaim.h"
 
 static const char* m_limine_memmap_type_str[] = {
     [LIMINE_MEMMAP_USABLE] = "Usable",
@@ -88,6 +91,18 @@ typedef struct memory_region {
 
     // the medata of the region
     page_metadata_t* metadata;
+
+    // the NUMA node this region belongs to
+    int node;
+
+    // the amount of free blocks in each of the free lists
+    size_t free_blocks[BUDDY_LEVEL_COUNT];
+
+    // the highest amount of free blocks each free list had
+    size_t free_blocks_peak[BUDDY_LEVEL_COUNT];
+
+    // the amount of free bytes in the region
+    size_t free_bytes;
 } memory_region_t;
 
 static inline page_metadata_t* page_metadata(memory_region_t* region, void* addr) {
@@ -118,6 +133,30 @@ static memory_region_t* m_memory_regions;
  */
 static size_t m_memory_region_count;
 
+/**
+ * The amount of NUMA nodes we have
+ */
+static int m_node_count = 1;
+
+/**
+ * For each node, the order of nodes to try when allocating, sorted
+ * by distance, the first entry is always the node itself
+ */
+static uint8_t m_node_fallback[ACPI_NUMA_MAX_NODES][ACPI_NUMA_MAX_NODES];
+
+/**
+ * The node of the current cpu
+ */
+static int CPU_LOCAL m_cpu_node;
+
+/**
+ * Global statistics, protected by the allocator lock
+ */
+static size_t m_total_bytes;
+static size_t m_free_bytes;
+static size_t m_free_bytes_low;
+static size_t m_alloc_failures[BUDDY_LEVEL_COUNT];
+
 /**
  * spinlock to protect against the allocator accesses
  */
@@ -163,6 +202,35 @@ static int get_level_by_size(uint32_t size) {
     return level - BUDDY_FIRST_LEVEL;
 }
 
+/**
+ * Add a block to the free list of the given level, updating the stats
+ */
+static void free_list_add(memory_region_t* region, int level, list_entry_t* block) {
+    list_add(&region->free_list[level], block);
+
+    size_t block_size = 1ull << (level + BUDDY_FIRST_LEVEL);
+    region->free_bytes += block_size;
+    m_free_bytes += block_size;
+
+    region->free_blocks[level]++;
+    if (region->free_blocks[level] > region->free_blocks_peak[level]) {
+        region->free_blocks_peak[level] = region->free_blocks[level];
+    }
+}
+
+/**
+ * Remove a block from the free list of the given level, updating the stats
+ */
+static void free_list_del(memory_region_t* region, int level, list_entry_t* block) {
+    list_del(block);
+
+    size_t block_size = 1ull << (level + BUDDY_FIRST_LEVEL);
+    region->free_bytes -= block_size;
+    m_free_bytes -= block_size;
+
+    region->free_blocks[level]--;
+}
+
 static void* allocate_from_level(memory_region_t* region, int level) {
     int block_at_level;
     list_entry_t* block = NULL;
@@ -186,7 +254,7 @@ static void* allocate_from_level(memory_region_t* region, int level) {
         block = freelist->next;
 
         // and we can remove it
-        list_del(block);
+        free_list_del(region, block_at_level, block);
         break;
     }
 
@@ -204,7 +272,7 @@ static void* allocate_from_level(memory_region_t* region, int level) {
 
         // split it to two, adding the higher half to the level below us
         list_entry_t* upper = (list_entry_t*)(((uintptr_t)block) + block_size / 2);
-        list_add(&region->free_list[block_at_level], upper);
+        free_list_add(region, block_at_level, upper);
 
         // mark the upper block as the new level it is at
         page_metadata_t* metadata = page_metadata(region, upper);
@@ -251,7 +319,7 @@ static void free_at_level(memory_region_t* region, void* ptr, int level) {
         }
 
         // remove from the current level
-        list_del(neighbor_entry);
+        free_list_del(region, level, neighbor_entry);
 
         // get the new pointer, if the neighbor was below then
         // get the neighbor entry
@@ -271,7 +339,141 @@ static void free_at_level(memory_region_t* region, void* ptr, int level) {
 
     // we now know the correct level, add the ptr to it
     list_entry_t* ptr_entry = ptr;
-    list_add(&region->free_list[level], ptr_entry);
+    free_list_add(region, level, ptr_entry);
+}
+
+/**
+ * Attempt to grow an allocated block in place, this works by merging it with
+ * the upper buddy as long as it is free and at the same level, until we reach
+ * the requested level
+ */
+static bool grow_at_level(memory_region_t* region, void* ptr, int level, int new_level) {
+    ASSERT(new_level < BUDDY_LEVEL_COUNT);
+
+    // first make sure that all the buddies we need are available, we can only
+    // grow if we are the lower half at each level since otherwise the address
+    // of the block would change
+    for (int i = level; i < new_level; i++) {
+        size_t block_size = 1ull << (i + BUDDY_FIRST_LEVEL);
+        if (((uintptr_t)ptr & ((block_size * 2) - 1)) != 0) {
+            return false;
+        }
+
+        page_metadata_t* buddy_pt = page_metadata(region, ptr + block_size);
+        if (buddy_pt == NULL || !buddy_pt->free || buddy_pt->level != i) {
+            return false;
+        }
+    }
+
+    // now take all of the buddies out of the free lists
+    for (int i = level; i < new_level; i++) {
+        size_t block_size = 1ull << (i + BUDDY_FIRST_LEVEL);
+        list_entry_t* buddy = ptr + block_size;
+        free_list_del(region, i, buddy);
+
+        // the buddy is now part of our allocation
+        page_metadata(region, buddy)->free = false;
+    }
+
+    // and mark the new level of the block
+    page_metadata_t* metadata = page_metadata(region, ptr);
+    ASSERT(metadata != NULL);
+    metadata->level = new_level;
+
+    return true;
+}
+
+/**
+ * Shrink an allocated block in place, returning the upper halves
+ * to the free lists
+ */
+static void shrink_at_level(memory_region_t* region, void* ptr, int level, int new_level) {
+    page_metadata_t* metadata = page_metadata(region, ptr);
+    ASSERT(metadata != NULL);
+
+    while (level > new_level) {
+        level--;
+
+        // the upper half is not going to merge with anything since the
+        // lower half is still allocated
+        size_t block_size = 1ull << (level + BUDDY_FIRST_LEVEL);
+        free_at_level(region, ptr + block_size, level);
+
+        // update the level as we go so the buddy checks will see the
+        // correct size of the block
+        metadata->level = level;
+    }
+}
+
+/**
+ * Carve an allocated block into blocks of the given level, the blocks
+ * that are not needed are returned to the free lists
+ */
+static size_t carve_block(memory_region_t* region, void* block, int block_level, int level, void** out, size_t count) {
+    size_t piece_size = 1ull << (level + BUDDY_FIRST_LEVEL);
+    size_t block_size = 1ull << (block_level + BUDDY_FIRST_LEVEL);
+
+    // take as many pieces as we need
+    size_t pieces = block_size / piece_size;
+    if (pieces > count) {
+        pieces = count;
+    }
+
+    for (size_t i = 0; i < pieces; i++) {
+        void* ptr = block + i * piece_size;
+        page_metadata_t* metadata = page_metadata(region, ptr);
+        ASSERT(metadata != NULL);
+        metadata->level = level;
+        metadata->free = false;
+        out[i] = ptr;
+    }
+
+    // and return the tail as the largest aligned blocks we can, the
+    // buddies of these are either allocated or part of the tail so
+    // there is nothing to merge with
+    size_t offset = pieces * piece_size;
+    while (offset < block_size) {
+        size_t size = offset & -offset;
+        int free_level = __builtin_ctzll(size) - BUDDY_FIRST_LEVEL;
+
+        list_entry_t* entry = block + offset;
+        page_metadata_t* metadata = page_metadata(region, entry);
+        ASSERT(metadata != NULL);
+        metadata->level = free_level;
+        metadata->free = true;
+        free_list_add(region, free_level, entry);
+
+        offset += size;
+    }
+
+    return pieces;
+}
+
+/**
+ * Allocate as many blocks of the given level as possible from the region,
+ * splitting each larger block we take in a single pass
+ */
+static size_t allocate_bulk_from_level(memory_region_t* region, int level, void** out, size_t count) {
+    size_t allocated = 0;
+    while (allocated < count) {
+        // find the smallest block that we can take from
+        int block_level;
+        for (block_level = level; block_level < BUDDY_LEVEL_COUNT; block_level++) {
+            if (!list_is_empty(&region->free_list[block_level])) {
+                break;
+            }
+        }
+
+        // region is out of memory
+        if (block_level == BUDDY_LEVEL_COUNT) {
+            break;
+        }
+
+        list_entry_t* block = region->free_list[block_level].next;
+        free_list_del(region, block_level, block);
+        allocated += carve_block(region, block, block_level, level, out + allocated, count - allocated);
+    }
+    return allocated;
 }
 
 static void add_memory_to_region(memory_region_t* region, void* base, size_t page_count) {
@@ -316,11 +518,21 @@ static err_t add_memory(uint64_t type) {
         if (entry->type == type) {
             void* base = PHYS_TO_DIRECT(entry->base);
             size_t page_count = entry->length / PAGE_SIZE;
-
-            memory_region_t* region = find_region(base);
-            CHECK(region != NULL);
-            add_memory_to_region(region, base, page_count);
             pages_added += page_count;
+
+            // the entry might be split across multiple regions
+            // if it crosses a NUMA node boundary
+            while (page_count != 0) {
+                memory_region_t* region = find_region(base);
+                CHECK(region != NULL);
+
+                size_t region_pages_left = (region->base + region->page_count * PAGE_SIZE - base) / PAGE_SIZE;
+                size_t count = page_count < region_pages_left ? page_count : region_pages_left;
+                add_memory_to_region(region, base, count);
+
+                base += count * PAGE_SIZE;
+                page_count -= count;
+            }
         }
     }
 
@@ -330,6 +542,18 @@ cleanup:
     return err;
 }
 
+/**
+ * Get the node of the given physical range, returning the end of the
+ * part of the range that is on the same node
+ */
+static int get_memory_node(uintptr_t base, uintptr_t end, uintptr_t* chunk_end) {
+    uint64_t range_end;
+    int node = acpi_numa_memory_node(base, &range_end);
+    range_end = ALIGN_UP(range_end, PAGE_SIZE);
+    *chunk_end = range_end < end ? range_end : end;
+    return node;
+}
+
 static err_t create_memory_regions(void) {
     err_t err = NO_ERROR;
 
@@ -343,6 +567,7 @@ static err_t create_memory_regions(void) {
     //
     uintptr_t total_usable_pages = 0;
     uintptr_t region_end = -1;
+    int region_node = -1;
     struct limine_memmap_entry* largest_region = NULL;
     for (int i = 0; i < response->entry_count; i++) {
         struct limine_memmap_entry* entry = response->entries[i];
@@ -366,19 +591,29 @@ static err_t create_memory_regions(void) {
             case LIMINE_MEMMAP_ACPI_RECLAIMABLE: {
                 total_usable_pages += (entry->length / PAGE_SIZE);
 
-                // if the last region end and the new base are not the same
-                // we have a new region
-                if (region_end != entry->base) {
-                    m_memory_region_count++;
+                // split the entry on NUMA node boundaries
+                uintptr_t base = entry->base;
+                uintptr_t end = entry->base + entry->length;
+                while (base < end) {
+                    uintptr_t chunk_end;
+                    int node = get_memory_node(base, end, &chunk_end);
+
+                    // if the last region end and the new base are not the same
+                    // or we moved to another node we have a new region
+                    if (region_end != base || region_node != node) {
+                        m_memory_region_count++;
+                    }
+
+                    region_end = chunk_end;
+                    region_node = node;
+                    base = chunk_end;
                 }
-
-                region_end = entry->base + entry->length;
-
             } break;
 
             default:
                 // unknown entry breaks the chain
                 region_end = -1;
+                region_node = -1;
                 break;
         }
     }
@@ -406,6 +641,7 @@ static err_t create_memory_regions(void) {
     // and now we need to set the regions
     int region_i = -1;
     region_end = -1;
+    region_node = -1;
     for (int i = 0; i < response->entry_count; i++) {
         struct limine_memmap_entry* entry = response->entries[i];
 
@@ -415,35 +651,45 @@ static err_t create_memory_regions(void) {
             case LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE:
             case LIMINE_MEMMAP_EXECUTABLE_AND_MODULES:
             case LIMINE_MEMMAP_ACPI_RECLAIMABLE: {
-                size_t page_count = entry->length / PAGE_SIZE;
-
-                // make sure we have space for this
-                CHECK(metadata_left >= page_count);
-                metadata_left -= page_count;
-
-                // if the last region end and the new base are not the same
-                // we have a new region
-                if (region_end != entry->base) {
-                    region_i++;
-                    CHECK(region_i < m_memory_region_count);
-                    m_memory_regions[region_i].base = PHYS_TO_DIRECT(entry->base);
-                    m_memory_regions[region_i].metadata = metadata;
+                uintptr_t base = entry->base;
+                uintptr_t end = entry->base + entry->length;
+                while (base < end) {
+                    uintptr_t chunk_end;
+                    int node = get_memory_node(base, end, &chunk_end);
+                    size_t page_count = (chunk_end - base) / PAGE_SIZE;
+
+                    // make sure we have space for this
+                    CHECK(metadata_left >= page_count);
+                    metadata_left -= page_count;
+
+                    // if the last region end and the new base are not the same
+                    // or we moved to another node we have a new region
+                    if (region_end != base || region_node != node) {
+                        region_i++;
+                        CHECK(region_i < m_memory_region_count);
+                        m_memory_regions[region_i].base = PHYS_TO_DIRECT(base);
+                        m_memory_regions[region_i].metadata = metadata;
+                        m_memory_regions[region_i].node = node;
+                    }
+
+                    // add the page count to the current region
+                    m_memory_regions[region_i].page_count += page_count;
+
+                    // set the region end
+                    region_end = chunk_end;
+                    region_node = node;
+                    base = chunk_end;
+
+                    // metadata entries were allocated no
+                    // matter which path we took
+                    metadata += page_count;
                 }
-
-                // add the page count to the current region
-                m_memory_regions[region_i].page_count += page_count;
-
-                // set the region end
-                region_end = entry->base + entry->length;
-
-                // metadata entries were allocated no
-                // matter which path we took
-                metadata += page_count;
             } break;
 
             default:
                 // unknown entry breaks the chain
                 region_end = -1;
+                region_node = -1;
                 break;
         }
     }
@@ -462,16 +708,54 @@ cleanup:
     return err;
 }
 
+/**
+ * Build the allocation fallback order of each node, we first try the node itself
+ * and then the rest by their distance, nodes with no path are only used last
+ * since threads are not bound to a node and can move anywhere anyways
+ */
+static void init_node_fallback(void) {
+    m_node_count = acpi_numa_node_count();
+
+    for (int node = 0; node < m_node_count; node++) {
+        uint8_t* order = m_node_fallback[node];
+
+        // insertion sort by the distance, stable so the node itself
+        // comes first even if the firmware reports a weird distance
+        order[0] = node;
+        int count = 1;
+        for (int other = 0; other < m_node_count; other++) {
+            if (other == node) {
+                continue;
+            }
+
+            uint8_t distance = acpi_numa_distance(node, other);
+            int i = count++;
+            while (i > 1 && acpi_numa_distance(node, order[i - 1]) > distance) {
+                order[i] = order[i - 1];
+                i--;
+            }
+            order[i] = other;
+        }
+    }
+}
+
 err_t init_phys() {
     err_t err = NO_ERROR;
 
     // we need this
     CHECK(g_limine_memmap_request.response != NULL);
 
+    // setup the numa fallback
+    init_node_fallback();
+
     // add the usable entries
     TRACE("memory: Adding physical memory");
     RETHROW(create_memory_regions());
 
+    // everything we have added is what we are managing
+    m_total_bytes = m_free_bytes;
+    m_free_bytes_low = m_free_bytes;
+
 cleanup:
     return err;
 }
@@ -536,15 +820,76 @@ void phys_reclaim_bootloader() {
 // Page allocation
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Update the low watermark of the free memory, must be called
+ * once the free lists are consistent again
+ */
+static void update_free_low_watermark(void) {
+    if (m_free_bytes < m_free_bytes_low) {
+        m_free_bytes_low = m_free_bytes;
+    }
+}
+
 static void* internal_phys_alloc(int level) {
-    void* ptr = NULL;
-    for (int i = 0; i < m_memory_region_count; i++) {
-        ptr = allocate_from_level(&m_memory_regions[i], level);
-        if (ptr != NULL) {
-            break;
+    // go over the nodes from the closest to the furthest, trying
+    // to allocate from the regions of each node
+    uint8_t* order = m_node_fallback[m_cpu_node];
+    for (int i = 0; i < m_node_count; i++) {
+        int node = order[i];
+        for (int j = 0; j < m_memory_region_count; j++) {
+            memory_region_t* region = &m_memory_regions[j];
+            if (region->node != node) {
+                continue;
+            }
+
+            void* ptr = allocate_from_level(region, level);
+            if (ptr != NULL) {
+                update_free_low_watermark();
+                return ptr;
+            }
         }
     }
-    return ptr;
+
+    // count the failure, it is a good indication of fragmentation
+    // when there is still enough free memory around
+    if (level != -1) {
+        m_alloc_failures[level]++;
+    }
+    return NULL;
+}
+
+static bool internal_phys_alloc_bulk(int level, void** out, size_t count) {
+    size_t allocated = 0;
+
+    // same order as the normal allocation
+    uint8_t* order = m_node_fallback[m_cpu_node];
+    for (int i = 0; i < m_node_count && allocated < count; i++) {
+        int node = order[i];
+        for (int j = 0; j < m_memory_region_count && allocated < count; j++) {
+            memory_region_t* region = &m_memory_regions[j];
+            if (region->node != node) {
+                continue;
+            }
+
+            allocated += allocate_bulk_from_level(region, level, out + allocated, count - allocated);
+        }
+    }
+
+    if (allocated == count) {
+        update_free_low_watermark();
+        return true;
+    }
+
+    // not enough memory, return everything we took
+    for (size_t i = 0; i < allocated; i++) {
+        memory_region_t* region = find_region(out[i]);
+        ASSERT(region != NULL);
+        free_at_level(region, out[i], level);
+        out[i] = NULL;
+    }
+    m_alloc_failures[level]++;
+
+    return false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -601,6 +946,24 @@ static void fill_irq_alloc() {
 // Implementation
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+static void* locked_phys_alloc(int level) {
+    // lock and record that we are the locker
+    bool irq_state = irq_spinlock_acquire(&m_memory_region_lock);
+    m_lock_cpu = get_cpu_id();
+
+    // perform the allocation safely
+    void* ptr = internal_phys_alloc(level);
+
+    // fill the IRQ allocation if need be
+    fill_irq_alloc();
+
+    // remove the lock
+    m_lock_cpu = -1;
+    irq_spinlock_release(&m_memory_region_lock, irq_state);
+
+    return ptr;
+}
+
 void* phys_alloc(size_t size) {
     // attempt to allocate using the irq alloc
     // if returns NULL then attempt to use the
@@ -616,12 +979,50 @@ void* phys_alloc(size_t size) {
         return NULL;
     }
 
+    ptr = locked_phys_alloc(level);
+
+    // we are out of memory, try to get some back from
+    // the shrinkers and then try again
+    if (ptr == NULL && reclaim_direct(SIZE_TO_PAGES(size)) != 0) {
+        ptr = locked_phys_alloc(level);
+    }
+
+    // now that we are outside of the lock check if we
+    // need to start reclaiming memory in the background
+    reclaim_check_pressure();
+
+    return ptr;
+}
+
+void phys_free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    bool irq_state = irq_spinlock_acquire(&m_memory_region_lock);
+
+    // get the region
+    memory_region_t* region = find_region(ptr);
+    ASSERT(region != NULL);
+
+    // get and verify the metadata
+    page_metadata_t* metadata = page_metadata(region, ptr);
+    int level = metadata->level;
+    ASSERT(((uintptr_t)ptr & ((1 << (level + BUDDY_FIRST_LEVEL)) - 1)) == 0);
+
+    // and now actually free it
+    free_at_level(region, ptr, level);
+
+    irq_spinlock_release(&m_memory_region_lock, irq_state);
+}
+
+static bool locked_phys_alloc_bulk(int level, void** out, size_t count) {
     // lock and record that we are the locker
     bool irq_state = irq_spinlock_acquire(&m_memory_region_lock);
     m_lock_cpu = get_cpu_id();
 
     // perform the allocation safely
-    ptr = internal_phys_alloc(level);
+    bool success = internal_phys_alloc_bulk(level, out, count);
 
     // fill the IRQ allocation if need be
     fill_irq_alloc();
@@ -630,34 +1031,255 @@ void* phys_alloc(size_t size) {
     m_lock_cpu = -1;
     irq_spinlock_release(&m_memory_region_lock, irq_state);
 
-    return ptr;
+    return success;
 }
 
-void phys_free(void* ptr) {
+err_t phys_alloc_bulk(size_t size, size_t count, void** out) {
+    err_t err = NO_ERROR;
+
+    // calculate the size
+    int level = get_level_by_size(size);
+    CHECK_ERROR(level != -1, ERROR_OUT_OF_MEMORY);
+
+    bool success = locked_phys_alloc_bulk(level, out, count);
+
+    // we are out of memory, try to get some back from
+    // the shrinkers and then try again
+    if (!success && reclaim_direct(SIZE_TO_PAGES(size) * count) != 0) {
+        success = locked_phys_alloc_bulk(level, out, count);
+    }
+
+    // now that we are outside of the lock check if we
+    // need to start reclaiming memory in the background
+    reclaim_check_pressure();
+
+    CHECK_ERROR(success, ERROR_OUT_OF_MEMORY);
+
+cleanup:
+    return err;
+}
+
+void phys_free_bulk(void** ptrs, size_t count) {
+    bool irq_state = irq_spinlock_acquire(&m_memory_region_lock);
+
+    for (size_t i = 0; i < count; i++) {
+        void* ptr = ptrs[i];
+        if (ptr == NULL) {
+            continue;
+        }
+
+        // get the region
+        memory_region_t* region = find_region(ptr);
+        ASSERT(region != NULL);
+
+        // get and verify the metadata
+        page_metadata_t* metadata = page_metadata(region, ptr);
+        int level = metadata->level;
+        ASSERT(((uintptr_t)ptr & ((1 << (level + BUDDY_FIRST_LEVEL)) - 1)) == 0);
+
+        // and now actually free it
+        free_at_level(region, ptr, level);
+    }
+
+    irq_spinlock_release(&m_memory_region_lock, irq_state);
+}
+
+void* phys_realloc(void* ptr, size_t size) {
     if (ptr == NULL) {
-        return;
+        return phys_alloc(size);
     }
 
+    if (size == 0) {
+        phys_free(ptr);
+        return NULL;
+    }
+
+    // calculate the size
+    int new_level = get_level_by_size(size);
+    if (new_level == -1) {
+        return NULL;
+    }
+
+    // lock and record that we are the locker
     bool irq_state = irq_spinlock_acquire(&m_memory_region_lock);
+    m_lock_cpu = get_cpu_id();
 
-    // get the region
     memory_region_t* region = find_region(ptr);
     ASSERT(region != NULL);
 
-    // get and verify the metadata
     page_metadata_t* metadata = page_metadata(region, ptr);
     int level = metadata->level;
     ASSERT(((uintptr_t)ptr & ((1 << (level + BUDDY_FIRST_LEVEL)) - 1)) == 0);
 
-    // and now actually free it
-    free_at_level(region, ptr, level);
+    // the metadata is tracked per page, so only blocks of at least a page
+    // can be safely resized in place, anything smaller will just keep its
+    // current block when shrinking
+    int page_level = get_level_by_size(PAGE_SIZE);
+
+    void* new_ptr = NULL;
+    if (new_level <= level) {
+        if (new_level >= page_level) {
+            shrink_at_level(region, ptr, level, new_level);
+        }
+        new_ptr = ptr;
+
+    } else if (level >= page_level && grow_at_level(region, ptr, level, new_level)) {
+        update_free_low_watermark();
+        new_ptr = ptr;
+    }
 
+    // fill the IRQ allocation if need be
+    fill_irq_alloc();
+
+    // remove the lock
+    m_lock_cpu = -1;
     irq_spinlock_release(&m_memory_region_lock, irq_state);
+
+    // we managed to resize it in place
+    if (new_ptr != NULL) {
+        return new_ptr;
+    }
+
+    // fallback to allocating a new block and moving the data over
+    new_ptr = phys_alloc(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, 1ull << (level + BUDDY_FIRST_LEVEL));
+    phys_free(ptr);
+
+    return new_ptr;
+}
+
+/**
+ * Get the APIC id of the current cpu, preferring the x2APIC id
+ */
+static uint32_t get_apic_id(void) {
+    uint32_t a, b, c, d;
+    if (__get_cpuid_max(0, NULL) >= 0xB) {
+        __cpuid_count(0xB, 0, a, b, c, d);
+        if (b != 0) {
+            return d;
+        }
+    }
+
+    __cpuid(1, a, b, c, d);
+    return b >> 24;
+}
+
+size_t phys_get_free_pages(void) {
+    // racy on purpose, this is only used as a hint
+    return m_free_bytes / PAGE_SIZE;
+}
+
+size_t phys_get_total_pages(void) {
+    return m_total_bytes / PAGE_SIZE;
 }
 
 void init_phys_per_cpu() {
+    // figure the node we are running on
+    m_cpu_node = acpi_numa_cpu_node(get_apic_id());
+    if (m_node_count > 1) {
+        TRACE("phys: CPU#%d is on NUMA node %d", get_cpu_id(), m_cpu_node);
+    }
+
     // make sure we have an available reserved page
     bool irq_state = irq_spinlock_acquire(&m_memory_region_lock);
     fill_irq_alloc();
     irq_spinlock_release(&m_memory_region_lock, irq_state);
 }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Calculate the unusable free space index of the level, in permille, this is
+ * the part of the free memory that can't be used to satisfy an allocation
+ * of the given level because it is in smaller blocks
+ */
+static size_t get_unusable_index(size_t* free_blocks, size_t free_bytes, int level) {
+    if (free_bytes == 0) {
+        return 0;
+    }
+
+    size_t usable = 0;
+    for (int i = level; i < BUDDY_LEVEL_COUNT; i++) {
+        usable += free_blocks[i] << (i + BUDDY_FIRST_LEVEL);
+    }
+
+    return ((free_bytes - usable) * 1000) / free_bytes;
+}
+
+/**
+ * Scale a block size down to the largest unit it is a multiple of,
+ * returns the name of the unit
+ */
+static const char* get_size_unit(size_t* size) {
+    if (*size % SIZE_1MB == 0) {
+        *size /= SIZE_1MB;
+        return "MiB";
+    } else if (*size % SIZE_1KB == 0) {
+        *size /= SIZE_1KB;
+        return "KiB";
+    } else {
+        return "B";
+    }
+}
+
+void phys_dump_stats(void) {
+    size_t total_free_blocks[BUDDY_LEVEL_COUNT] = {};
+    size_t alloc_failures[BUDDY_LEVEL_COUNT];
+
+    // take a snapshot of the globals, the free blocks are summed in the
+    // same snapshot so they are consistent with the free bytes
+    bool irq_state = irq_spinlock_acquire(&m_memory_region_lock);
+    size_t total_bytes = m_total_bytes;
+    size_t free_bytes = m_free_bytes;
+    size_t free_bytes_low = m_free_bytes_low;
+    memcpy(alloc_failures, m_alloc_failures, sizeof(alloc_failures));
+    for (int i = 0; i < m_memory_region_count; i++) {
+        for (int level = 0; level < BUDDY_LEVEL_COUNT; level++) {
+            total_free_blocks[level] += m_memory_regions[i].free_blocks[level];
+        }
+    }
+    irq_spinlock_release(&m_memory_region_lock, irq_state);
+
+    TRACE("phys: %zu/%zu KiB free, %zu KiB used at peak",
+          (size_t)(free_bytes / SIZE_1KB), (size_t)(total_bytes / SIZE_1KB),
+          (size_t)((total_bytes - free_bytes_low) / SIZE_1KB));
+
+    // we print each region from a snapshot so we won't log while holding the lock
+    for (int i = 0; i < m_memory_region_count; i++) {
+        irq_state = irq_spinlock_acquire(&m_memory_region_lock);
+        memory_region_t region = m_memory_regions[i];
+        irq_spinlock_release(&m_memory_region_lock, irq_state);
+
+        TRACE("phys: region %d: %016lx-%016lx (node %d), %zu KiB free",
+              i, DIRECT_TO_PHYS(region.base), DIRECT_TO_PHYS(region.base + region.page_count * PAGE_SIZE),
+              region.node, (size_t)(region.free_bytes / SIZE_1KB));
+
+        for (int level = 0; level < BUDDY_LEVEL_COUNT; level++) {
+            if (region.free_blocks_peak[level] == 0) {
+                continue;
+            }
+
+            size_t block_size = 1ull << (level + BUDDY_FIRST_LEVEL);
+            const char* unit = get_size_unit(&block_size);
+            TRACE("phys: \t%4zu %-3s blocks: %6zu free (peak %zu)",
+                  block_size, unit, region.free_blocks[level], region.free_blocks_peak[level]);
+        }
+    }
+
+    // the unusable free space index is only interesting for page sized
+    // allocations and above, smaller blocks are always satisfiable
+    TRACE("phys: unusable free space index:");
+    for (int level = get_level_by_size(PAGE_SIZE); level < BUDDY_LEVEL_COUNT; level++) {
+        size_t index = get_unusable_index(total_free_blocks, free_bytes, level);
+        size_t block_size = 1ull << (level + BUDDY_FIRST_LEVEL);
+        const char* unit = get_size_unit(&block_size);
+        TRACE("phys: \t%4zu %-3s: %3zu.%01zu%% (%zu failures)",
+              block_size, unit, index / 10, index % 10, alloc_failures[level]);
+    }
+}
@@ -28,12 +28,25 @@ void init_phys_per_cpu();
 void phys_reclaim_bootloader();
 
 /**
- * Allocate physical memory, up to 128mb of contig memory
+ * Allocate physical memory, up to 128mb of contig memory, when out of
+ * memory this will run the shrinkers if called from a context that can
  */
 void* phys_alloc(size_t size) __attribute__((alloc_size(1), malloc));
 
 /**
- * Performs a realloc operation
+ * Allocate count blocks of the same size, taking the lock only once,
+ * either all of the blocks are allocated or none of them are
+ */
+err_t phys_alloc_bulk(size_t size, size_t count, void** out);
+
+/**
+ * Free multiple blocks at once, NULL entries are ignored
+ */
+void phys_free_bulk(void** ptrs, size_t count);
+
+/**
+ * Performs a realloc operation, growing the block in place when the
+ * buddies above it are free and only copying when that is not possible
  */
 void* phys_realloc(void* ptr, size_t size) __attribute__((alloc_size(2)));
 
@@ -41,3 +54,19 @@ void* phys_realloc(void* ptr, size_t size) __attribute__((alloc_size(2)));
  * Free physical memory
  */
 void phys_free(void* ptr);
+
+/**
+ * Get the amount of free pages, this is only a snapshot
+ */
+size_t phys_get_free_pages(void);
+
+/**
+ * Get the amount of pages managed by the allocator
+ */
+size_t phys_get_total_pages(void);
+
+/**
+ * Dump the free lists and fragmentation statistics of
+ * the physical allocator to the debug log
+ */
+void phys_dump_stats(void);
@@ -0,0 +1,316 @@
+#include "reclaim.h"
+
+#include <stdatomic.h>
+
+#include "arch/smp.h"
+#include "sync/spinlock.h"
+#include "thread/pcpu.h"
+#include "thread/scheduler.h"
+#include "lib/atomic.h"
+#include "phys.h"
+
+/**
+ * The watermarks, as a fraction of the total memory, when we get below the
+ * low watermark we are going to kick the background reclaim which is going
+ * to free memory until we reach the high watermark
+ */
+#define RECLAIM_LOW_WATERMARK_SHIFT     6
+#define RECLAIM_HIGH_WATERMARK_SHIFT    5
+
+/**
+ * The least amount of pages we are going to ask for when doing
+ * direct reclaim, asking for too little is not worth the trouble
+ */
+#define RECLAIM_DIRECT_MIN_PAGES        32
+
+/**
+ * The shrinkers we have, and the lock that protects the list, the shrinkers take
+ * allocator locks so they are never called with the lock held, since shrinkers
+ * are never unregistered the list can be walked once we know where it ends
+ */
+static list_t m_shrinkers = LIST_INIT(&m_shrinkers);
+static irq_spinlock_t m_shrinkers_lock = IRQ_SPINLOCK_INIT;
+
+/**
+ * The thread currently running the shrinkers, only one reclaim can be in
+ * progress at a time, also used to prevent a shrinker from recursing into
+ * the reclaim
+ */
+static _Atomic(thread_t*) m_reclaim_owner = NULL;
+
+typedef enum reclaim_state {
+    // the thread is running reclaim
+    RECLAIM_STATE_RUNNING,
+
+    // the thread is parked waiting to be kicked
+    RECLAIM_STATE_PARKED,
+
+    // the thread was kicked while running, it
+    // should do another pass before parking
+    RECLAIM_STATE_KICKED,
+} reclaim_state_t;
+
+/**
+ * The background reclaim thread
+ */
+static thread_t* m_reclaim_thread = NULL;
+static _Atomic(reclaim_state_t) m_reclaim_state = RECLAIM_STATE_RUNNING;
+
+void reclaim_register_shrinker(shrinker_t* shrinker) {
+    bool irq_state = irq_spinlock_acquire(&m_shrinkers_lock);
+    list_add_tail(&m_shrinkers, &shrinker->link);
+    irq_spinlock_release(&m_shrinkers_lock, irq_state);
+
+    TRACE("reclaim: registered shrinker `%s`", shrinker->name);
+}
+
+bool reclaim_can_direct(void) {
+    // we need a thread context that can sleep
+    thread_t* current = scheduler_get_current_thread();
+    if (current == NULL || !is_irq_enabled() || scheduler_is_preempt_disabled()) {
+        return false;
+    }
+
+    // a shrinker ran out of memory, don't recurse
+    if (atomic_load_explicit(&m_reclaim_owner, memory_order_relaxed) == current) {
+        return false;
+    }
+
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Per-cpu caches
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct reclaim_drainer {
+    // the thread draining this core, pinned to it
+    thread_t* thread;
+    _Atomic(reclaim_state_t) state;
+} reclaim_drainer_t;
+
+static CPU_LOCAL reclaim_drainer_t m_reclaim_drainer;
+
+/**
+ * The last shrinker of the current drain, and the
+ * amount of cores that did not finish draining yet
+ */
+static list_entry_t* m_drain_last = NULL;
+static atomic_size_t m_drain_pending = 0;
+
+static void drain_current_cpu(list_entry_t* last) {
+    bool irq_state = irq_save();
+    for (list_entry_t* entry = m_shrinkers.next; entry != &m_shrinkers; entry = entry->next) {
+        shrinker_t* shrinker = containerof(entry, shrinker_t, link);
+        if (shrinker->drain_cpu != NULL) {
+            shrinker->drain_cpu();
+        }
+        if (entry == last) {
+            break;
+        }
+    }
+    irq_restore(irq_state);
+}
+
+/**
+ * Drain the per-cpu caches of all the cores, the current core is drained
+ * directly and the rest by their drainer, returns once all of them are done
+ */
+static void drain_all_cpus(list_entry_t* last) {
+    int current = get_cpu_id();
+
+    // set the count before kicking anyone so it won't reach zero early
+    size_t kicked = 0;
+    for (int i = 0; i < g_cpu_count; i++) {
+        if (i != current && pcpu_get_pointer_of(&m_reclaim_drainer, i)->thread != NULL) {
+            kicked++;
+        }
+    }
+    m_drain_last = last;
+    atomic_store(&m_drain_pending, kicked);
+
+    for (int i = 0; i < g_cpu_count; i++) {
+        reclaim_drainer_t* drainer = pcpu_get_pointer_of(&m_reclaim_drainer, i);
+        if (i == current || drainer->thread == NULL) {
+            continue;
+        }
+
+        if (atomic_exchange(&drainer->state, RECLAIM_STATE_KICKED) == RECLAIM_STATE_PARKED) {
+            scheduler_wakeup_thread_on(drainer->thread, i);
+        }
+    }
+
+    drain_current_cpu(last);
+
+    // the drainers might be on our core
+    while (atomic_load(&m_drain_pending) != 0) {
+        scheduler_yield();
+    }
+}
+
+static bool drainer_park_callback(void* arg) {
+    reclaim_drainer_t* drainer = arg;
+    reclaim_state_t expected = RECLAIM_STATE_RUNNING;
+    return atomic_compare_exchange_strong(&drainer->state, &expected, RECLAIM_STATE_PARKED);
+}
+
+static void drainer_thread_entry(void* arg) {
+    reclaim_drainer_t* drainer = pcpu_get_pointer(&m_reclaim_drainer);
+    for (;;) {
+        scheduler_park(drainer_park_callback, drainer);
+        atomic_store(&drainer->state, RECLAIM_STATE_RUNNING);
+
+        drain_current_cpu(m_drain_last);
+        atomic_fetch_sub(&m_drain_pending, 1);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Shrinkers
+//----------------------------------------------------------------------------------------------------------------------
+
+static size_t run_shrinkers(size_t target_pages) {
+    // wait for the reclaim in progress, we are in a thread context that can
+    // sleep so yield to it instead of spinning, it might be on our core
+    thread_t* current = scheduler_get_current_thread();
+    thread_t* expected = NULL;
+    while (!atomic_compare_exchange_weak_explicit(&m_reclaim_owner, &expected, current,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+        expected = NULL;
+        scheduler_yield();
+    }
+
+    // shrinkers registered from now on will only be used by the next reclaim
+    bool irq_state = irq_spinlock_acquire(&m_shrinkers_lock);
+    list_entry_t* last = m_shrinkers.prev;
+    irq_spinlock_release(&m_shrinkers_lock, irq_state);
+
+    // the per-cpu caches are drained first, so the
+    // shrinkers can give back what they were holding
+    drain_all_cpus(last);
+
+    size_t freed = 0;
+    for (list_entry_t* entry = m_shrinkers.next; entry != &m_shrinkers; entry = entry->next) {
+        shrinker_t* shrinker = containerof(entry, shrinker_t, link);
+        if (shrinker->reclaim != NULL) {
+            freed += shrinker->reclaim(target_pages - freed);
+        }
+        if (freed >= target_pages || entry == last) {
+            break;
+        }
+    }
+
+    atomic_store_explicit(&m_reclaim_owner, NULL, memory_order_release);
+
+    return freed;
+}
+
+size_t reclaim_direct(size_t target_pages) {
+    if (!reclaim_can_direct()) {
+        return 0;
+    }
+
+    if (target_pages < RECLAIM_DIRECT_MIN_PAGES) {
+        target_pages = RECLAIM_DIRECT_MIN_PAGES;
+    }
+
+    size_t freed = run_shrinkers(target_pages);
+    if (freed != 0) {
+        TRACE("reclaim: direct reclaim freed %zu/%zu pages", freed, target_pages);
+    }
+    return freed;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Background reclaim
+//----------------------------------------------------------------------------------------------------------------------
+
+static size_t get_low_watermark(void) {
+    return phys_get_total_pages() >> RECLAIM_LOW_WATERMARK_SHIFT;
+}
+
+static size_t get_high_watermark(void) {
+    return phys_get_total_pages() >> RECLAIM_HIGH_WATERMARK_SHIFT;
+}
+
+void reclaim_check_pressure(void) {
+    // not started yet
+    if (m_reclaim_thread == NULL) {
+        return;
+    }
+
+    // no pressure
+    if (phys_get_free_pages() >= get_low_watermark()) {
+        return;
+    }
+
+    // we can only wakeup threads from a normal thread context, and
+    // there is no need to kick ourselves
+    thread_t* current = scheduler_get_current_thread();
+    if (current == NULL || current == m_reclaim_thread || !is_irq_enabled()) {
+        return;
+    }
+
+    // kick the thread, if it was parked we need to wake it up
+    if (atomic_exchange(&m_reclaim_state, RECLAIM_STATE_KICKED) == RECLAIM_STATE_PARKED) {
+        scheduler_wakeup_thread(m_reclaim_thread);
+    }
+}
+
+static bool reclaim_park_callback(void* arg) {
+    // only park if no one kicked us while we were running
+    reclaim_state_t expected = RECLAIM_STATE_RUNNING;
+    return atomic_compare_exchange_strong(&m_reclaim_state, &expected, RECLAIM_STATE_PARKED);
+}
+
+static void reclaim_thread_entry(void* arg) {
+    for (;;) {
+        atomic_store(&m_reclaim_state, RECLAIM_STATE_RUNNING);
+
+        // reclaim until we reach the high watermark or until
+        // the shrinkers have nothing more to give
+        size_t high = get_high_watermark();
+        size_t total_freed = 0;
+        for (;;) {
+            size_t free_pages = phys_get_free_pages();
+            if (free_pages >= high) {
+                break;
+            }
+
+            size_t freed = run_shrinkers(high - free_pages);
+            if (freed == 0) {
+                break;
+            }
+            total_freed += freed;
+        }
+
+        if (total_freed != 0) {
+            TRACE("reclaim: background reclaim freed %zu pages", total_freed);
+        }
+
+        scheduler_park(reclaim_park_callback, NULL);
+    }
+}
+
+err_t init_reclaim(void) {
+    err_t err = NO_ERROR;
+
+    for (int i = 0; i < g_cpu_count; i++) {
+        reclaim_drainer_t* drainer = pcpu_get_pointer_of(&m_reclaim_drainer, i);
+        drainer->state = RECLAIM_STATE_RUNNING;
+
+        thread_t* thread = thread_create(drainer_thread_entry, NULL, "reclaim drain %d", i);
+        CHECK_ERROR(thread != NULL, ERROR_OUT_OF_MEMORY);
+        drainer->thread = thread;
+        scheduler_wakeup_thread_on(thread, i);
+    }
+
+    thread_t* thread = thread_create(reclaim_thread_entry, NULL, "reclaim");
+    CHECK_ERROR(thread != NULL, ERROR_OUT_OF_MEMORY);
+
+    m_reclaim_thread = thread;
+    scheduler_wakeup_thread(thread);
+
+cleanup:
+    return err;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "lib/except.h"
+#include "lib/list.h"
+
+/**
+ * A subsystem that holds on to memory it can give back
+ * to the physical allocator when we are low on memory
+ */
+typedef struct shrinker {
+    // the name of the shrinker, for debugging
+    const char* name;
+
+    // optional, try to free up to the given amount of pages, returning
+    // the amount of pages that were actually freed, this is
+    // called from thread context with interrupts enabled
+    size_t (*reclaim)(size_t target_pages);
+
+    // optional, give back whatever the current core keeps cached, called
+    // on every core with interrupts disabled before the shrinkers reclaim
+    void (*drain_cpu)(void);
+
+    // link in the shrinkers list
+    list_entry_t link;
+} shrinker_t;
+
+/**
+ * Start the background reclaim thread
+ */
+err_t init_reclaim(void);
+
+/**
+ * Register a shrinker, it will stay registered forever
+ */
+void reclaim_register_shrinker(shrinker_t* shrinker);
+
+/**
+ * Run all the shrinkers on the current thread, trying to free
+ * at least the given amount of pages, returns the amount of
+ * pages that were freed.
+ *
+ * Must be called from thread context with interrupts enabled,
+ * if called from a shrinker it will return 0
+ */
+size_t reclaim_direct(size_t target_pages);
+
+/**
+ * Check the free memory against the watermarks and kick the
+ * background reclaim if needed, this is safe to call from any
+ * context, but only does something from thread context
+ */
+void reclaim_check_pressure(void);
+
+/**
+ * Can we perform a direct reclaim from the current context
+ */
+bool reclaim_can_direct(void);
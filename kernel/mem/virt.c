@@ -5,6 +5,10 @@
 #include <arch/regs.h>
 
 #include "arch/intrin.h"
+#include "arch/apic.h"
+#include "arch/intr.h"
+#include "arch/smp.h"
+#include "thread/scheduler.h"
 #include "limine.h"
 #include "memory.h"
 #include "phys.h"
@@ -106,17 +110,38 @@ cleanup:
     return err;
 }
 
+/**
+ * The amount of pages we allocate at once when allocating a range
+ */
+#define VIRT_ALLOC_BATCH    64
+
 err_t virt_alloc_range(uintptr_t virt, size_t page_count) {
     err_t err = NO_ERROR;
 
+    // the pages we got from the physical allocator and
+    // have not used yet
+    void* pages[VIRT_ALLOC_BATCH];
+    size_t batch_count = 0;
+    size_t batch_used = 0;
+
     bool irq_state = irq_spinlock_acquire(&m_virt_lock);
 
     size_t i;
     for (i = 0; i < page_count; i++) {
         uintptr_t vaddr = virt + (i * SIZE_4KB);
 
-        void* phys = phys_alloc(PAGE_SIZE);
-        CHECK_ERROR(phys != NULL, ERROR_OUT_OF_MEMORY);
+        // get more pages if we ran out
+        if (batch_used == batch_count) {
+            size_t count = page_count - i;
+            if (count > ARRAY_LENGTH(pages)) {
+                count = ARRAY_LENGTH(pages);
+            }
+
+            batch_used = 0;
+            batch_count = 0;
+            RETHROW(phys_alloc_bulk(PAGE_SIZE, count, pages));
+            batch_count = count;
+        }
 
         page_entry_t* pml3 = get_next_level(&m_cr3[PML4_INDEX(vaddr)]);
         CHECK_ERROR(pml3 != NULL, ERROR_OUT_OF_MEMORY);
@@ -132,28 +157,25 @@ err_t virt_alloc_range(uintptr_t virt, size_t page_count) {
             .present = 1,
             .writeable = 1,
             .no_execute = 1,
-            .frame = DIRECT_TO_PHYS(phys) >> 12
+            .frame = DIRECT_TO_PHYS(pages[batch_used++]) >> 12
         };
     }
 
 cleanup:
+    // return the pages we did not end up using
+    phys_free_bulk(pages + batch_used, batch_count - batch_used);
+
     if (IS_ERROR(err)) {
         for (size_t j = 0; j < i; j++) {
-            uintptr_t vaddr = virt + (i * SIZE_4KB);
+            uintptr_t vaddr = virt + (j * SIZE_4KB);
 
+            // all the levels must be present already
             page_entry_t* pml3 = get_next_level(&m_cr3[PML4_INDEX(vaddr)]);
-            CHECK_ERROR(pml3 != NULL, ERROR_OUT_OF_MEMORY);
-
             page_entry_t* pml2 = get_next_level(&pml3[PML3_INDEX(vaddr)]);
-            CHECK_ERROR(pml2 != NULL, ERROR_OUT_OF_MEMORY);
-
             page_entry_t* pml1 = get_next_level(&pml2[PML2_INDEX(vaddr)]);
-            CHECK_ERROR(pml1 != NULL, ERROR_OUT_OF_MEMORY);
-
-            // must be present already
             ASSERT(pml1[PML1_INDEX(vaddr)].present);
 
-            // now set the writeable and no execute flags again
+            // free the page and unmap it
             phys_free(PHYS_TO_DIRECT(pml1[PML1_INDEX(vaddr)].frame << 12));
             pml1[PML1_INDEX(vaddr)].packed = 0;
         }
@@ -196,35 +218,202 @@ cleanup:
     return err;
 }
 
-bool virt_is_mapped(uintptr_t virt) {
-    bool irq_state = irq_spinlock_acquire(&m_virt_lock);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// TLB shootdown
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    page_entry_t* pml3 = get_next_level(&m_cr3[PML4_INDEX(virt)]);
-    if (pml3 == NULL) {
-        irq_spinlock_release(&m_virt_lock, irq_state);
-        return false;
+/**
+ * Above this amount of pages we just flush the entire TLB
+ */
+#define TLB_FLUSH_ALL_THRESHOLD     64
+
+/**
+ * Only one shootdown can be in progress at a time, the range
+ * is protected by the lock
+ */
+static spinlock_t m_tlb_shootdown_lock = SPINLOCK_INIT;
+static uintptr_t m_tlb_shootdown_virt;
+static size_t m_tlb_shootdown_page_count;
+
+/**
+ * The amount of cores that did not flush yet
+ */
+static atomic_size_t m_tlb_shootdown_pending = 0;
+
+static void flush_tlb_range(uintptr_t virt, size_t page_count) {
+    if (page_count > TLB_FLUSH_ALL_THRESHOLD) {
+        __writecr3(__readcr3());
+    } else {
+        for (size_t i = 0; i < page_count; i++) {
+            __invlpg((void*)(virt + i * PAGE_SIZE));
+        }
     }
+}
 
-    page_entry_t* pml2 = get_next_level(&pml3[PML3_INDEX(virt)]);
-    if (pml2 == NULL) {
-        irq_spinlock_release(&m_virt_lock, irq_state);
-        return false;
+void virt_handle_tlb_shootdown(void) {
+    flush_tlb_range(m_tlb_shootdown_virt, m_tlb_shootdown_page_count);
+    atomic_fetch_sub_explicit(&m_tlb_shootdown_pending, 1, memory_order_release);
+}
+
+void virt_flush_tlb_range(uintptr_t virt, size_t page_count) {
+    ASSERT(is_irq_enabled());
+
+    // we must not move cores in the middle
+    scheduler_preempt_disable();
+
+    flush_tlb_range(virt, page_count);
+
+    if (g_cpu_count > 1) {
+        // we keep interrupts enabled while waiting so we won't
+        // deadlock with another core that is waiting on us
+        spinlock_acquire(&m_tlb_shootdown_lock);
+
+        m_tlb_shootdown_virt = virt;
+        m_tlb_shootdown_page_count = page_count;
+        atomic_store_explicit(&m_tlb_shootdown_pending, g_cpu_count - 1, memory_order_release);
+
+        lapic_send_ipi_all_excluding_self(INTR_VECTOR_TLB_SHOOTDOWN);
+
+        while (atomic_load_explicit(&m_tlb_shootdown_pending, memory_order_acquire) != 0) {
+            cpu_relax();
+        }
+
+        spinlock_release(&m_tlb_shootdown_lock);
     }
 
-    page_entry_t* pml1 = get_next_level(&pml2[PML2_INDEX(virt)]);
-    if (pml1 == NULL) {
-        irq_spinlock_release(&m_virt_lock, irq_state);
-        return false;
+    scheduler_preempt_enable();
+}
+
+static page_entry_t* get_next_level_if_present(page_entry_t* entry) {
+    if (!entry->present) {
+        return NULL;
     }
+    return PHYS_TO_DIRECT(entry->frame << 12);
+}
 
-    // must be present already
-    bool mapped = pml1[PML1_INDEX(virt)].present;
+size_t virt_unmap_range(uintptr_t virt, size_t page_count, void** pages) {
+    size_t count = 0;
+
+    bool irq_state = irq_spinlock_acquire(&m_virt_lock);
+    for (size_t i = 0; i < page_count; i++) {
+        uintptr_t vaddr = virt + (i * SIZE_4KB);
+
+        page_entry_t* pml3 = get_next_level_if_present(&m_cr3[PML4_INDEX(vaddr)]);
+        if (pml3 == NULL) {
+            continue;
+        }
+
+        page_entry_t* pml2 = get_next_level_if_present(&pml3[PML3_INDEX(vaddr)]);
+        if (pml2 == NULL) {
+            continue;
+        }
+
+        page_entry_t* pml1 = get_next_level_if_present(&pml2[PML2_INDEX(vaddr)]);
+        if (pml1 == NULL) {
+            continue;
+        }
+
+        page_entry_t* entry = &pml1[PML1_INDEX(vaddr)];
+        if (!entry->present) {
+            continue;
+        }
+
+        pages[count++] = PHYS_TO_DIRECT(entry->frame << 12);
+        entry->packed = 0;
+    }
+    irq_spinlock_release(&m_virt_lock, irq_state);
+
+    return count;
+}
+
+size_t virt_decommit_range(uintptr_t virt, size_t page_count) {
+    size_t freed = 0;
+
+    // we do it in batches so we won't need to allocate
+    // memory to remember the pages we unmapped
+    void* pages[VIRT_ALLOC_BATCH];
+    while (page_count != 0) {
+        size_t batch = page_count < ARRAY_LENGTH(pages) ? page_count : ARRAY_LENGTH(pages);
+        size_t count = virt_unmap_range(virt, batch, pages);
+
+        // only once no one can access the pages we can free them
+        if (count != 0) {
+            virt_flush_tlb_range(virt, batch);
+            phys_free_bulk(pages, count);
+            freed += count;
+        }
+
+        virt += batch * SIZE_4KB;
+        page_count -= batch;
+    }
+
+    return freed;
+}
+
+bool virt_is_mapped(uintptr_t virt) {
+    bool irq_state = irq_spinlock_acquire(&m_virt_lock);
+
+    // don't allocate the levels just to find out they are empty
+    bool mapped = false;
+    page_entry_t* pml3 = get_next_level_if_present(&m_cr3[PML4_INDEX(virt)]);
+    page_entry_t* pml2 = pml3 != NULL ? get_next_level_if_present(&pml3[PML3_INDEX(virt)]) : NULL;
+    page_entry_t* pml1 = pml2 != NULL ? get_next_level_if_present(&pml2[PML2_INDEX(virt)]) : NULL;
+    if (pml1 != NULL) {
+        mapped = pml1[PML1_INDEX(virt)].present;
+    }
 
     irq_spinlock_release(&m_virt_lock, irq_state);
 
     return mapped;
 }
 
+void virt_clear_dirty_range(uintptr_t virt, size_t page_count, virt_dirty_callback_t callback, void* ctx) {
+    // the page tables are never freed, so we can walk them without the lock, the
+    // dirty bit is set by the cpu with a locked operation so we clear it atomically
+    uintptr_t end = virt + page_count * PAGE_SIZE;
+    while (virt < end) {
+        page_entry_t* pml3 = get_next_level_if_present(&m_cr3[PML4_INDEX(virt)]);
+        if (pml3 == NULL) {
+            virt = ALIGN_DOWN(virt, SIZE_512GB) + SIZE_512GB;
+            continue;
+        }
+
+        page_entry_t* pml2 = get_next_level_if_present(&pml3[PML3_INDEX(virt)]);
+        if (pml2 == NULL) {
+            virt = ALIGN_DOWN(virt, SIZE_1GB) + SIZE_1GB;
+            continue;
+        }
+
+        page_entry_t* pde = &pml2[PML2_INDEX(virt)];
+        page_entry_t* pml1 = get_next_level_if_present(pde);
+        if (pml1 == NULL) {
+            virt = ALIGN_DOWN(virt, SIZE_2MB) + SIZE_2MB;
+            continue;
+        }
+
+        // the cpu sets the accessed bit of the table whenever it walks through it, so
+        // if it is still clear none of its pages were written since we last cleared it,
+        // only done for whole tables since clearing it is only valid if all of it is walked
+        if (virt % SIZE_2MB == 0 && end - virt >= SIZE_2MB) {
+            if ((pde->packed & PAGE_ENTRY_ACCESSED) == 0) {
+                virt += SIZE_2MB;
+                continue;
+            }
+            __atomic_fetch_and(&pde->packed, ~(uint64_t)PAGE_ENTRY_ACCESSED, __ATOMIC_RELAXED);
+        }
+
+        page_entry_t* entry = &pml1[PML1_INDEX(virt)];
+        if (entry->present && (entry->packed & PAGE_ENTRY_DIRTY) != 0) {
+            __atomic_fetch_and(&entry->packed, ~(uint64_t)PAGE_ENTRY_DIRTY, __ATOMIC_RELAXED);
+            if (callback != NULL) {
+                callback(virt, ctx);
+            }
+        }
+
+        virt += PAGE_SIZE;
+    }
+}
+
 err_t init_virt() {
     err_t err = NO_ERROR;
 
@@ -278,11 +467,11 @@ err_t init_virt() {
 
     // initialize the first 16TB range with top level addressing, this is used later
     // to create RO shadows used by the GC while we are tracing the heap
-    for (int i = 0; i < SIZE_16TB / SIZE_512GB; i++) {
+    for (int i = 0; i < GC_HEAP_SHADOW_OFFSET / SIZE_512GB; i++) {
         uintptr_t virt = DIRECT_MAP_OFFSET + i * SIZE_512GB;
 
         page_entry_t* pml4 = &m_cr3[PML4_INDEX(virt)];
-        page_entry_t* shadow_pml4 = &m_cr3[PML4_INDEX(virt + SIZE_16TB)];
+        page_entry_t* shadow_pml4 = &m_cr3[PML4_INDEX(virt + GC_HEAP_SHADOW_OFFSET)];
 
         // allocate the pml4 if needed
         if (!pml4->present) {
@@ -302,7 +491,7 @@ err_t init_virt() {
 
         // the GC heap area is also marked as non-writable in the shadow, this is used
         // as a GC barrier while the GC is running in parallel to mutators
-        if (0xFFFF810000000000 <= virt && virt < 0xFFFF8E8000000000) {
+        if (GC_HEAP_ADDR <= virt && virt < GC_HEAP_ADDR_END) {
             shadow_pml4->writeable = 0;
         }
     }
@@ -322,12 +511,19 @@ void switch_page_table() {
 bool virt_handle_page_fault(uintptr_t addr) {
     err_t err = NO_ERROR;
 
+    if (GC_HEAP_ADDR + GC_HEAP_SHADOW_OFFSET <= addr && addr < GC_HEAP_ADDR_END + GC_HEAP_SHADOW_OFFSET) {
+        // the collector read a page of the heap that was never touched through
+        // the RO shadow, allocate the real page which will be seen by the shadow
+        addr -= GC_HEAP_SHADOW_OFFSET;
+    }
+
     if (
         (THREADS_ADDR <= addr && addr < THREADS_ADDR_END) ||
-        (0xFFFF810000000000 <= addr && addr < 0xFFFF8E8000000000) ||
+        (GC_HEAP_ADDR <= addr && addr < GC_HEAP_ADDR_END) ||
+        (GC_METADATA_ADDR <= addr && addr < GC_METADATA_ADDR_END) ||
         (0xFFFFC00000000000 <= addr && addr < 0xFFFFD00000000000)
     ) {
-        // thread structs and gc heap are allocated lazily as required
+        // thread structs, gc heap and its metadata are allocated lazily as required
 
     } else if (STACKS_ADDR <= addr && addr < STACKS_ADDR_END) {
         // stacks are allocated lazily as required, but we must not allocate if they
@@ -66,6 +66,16 @@ typedef union page_entry {
 } PACKED page_entry_t;
 STATIC_ASSERT(sizeof(page_entry_2mb_t) == sizeof(uint64_t));
 
+/**
+ * The accessed bit of any page entry, for atomic access to the packed value
+ */
+#define PAGE_ENTRY_ACCESSED BIT5
+
+/**
+ * The dirty bit of a 4kb page entry, for atomic access to the packed value
+ */
+#define PAGE_ENTRY_DIRTY    BIT6
+
 #define PML4_INDEX(va)      (((uintptr_t)(va) >> 39) & 0x1FFull)
 #define PML3_INDEX(va)      (((uintptr_t)(va) >> 30) & 0x1FFull)
 #define PML2_INDEX(va)      (((uintptr_t)(va) >> 21) & 0x1FFull)
@@ -105,6 +115,47 @@ err_t virt_remap_range(uintptr_t virt, size_t page_count, map_flags_t flags);
 
 bool virt_is_mapped(uintptr_t virt);
 
+/**
+ * Called for every page that was dirty
+ */
+typedef void (*virt_dirty_callback_t)(uintptr_t virt, void* ctx);
+
+/**
+ * Clear the dirty bit of all the present pages in the range, calling the callback (if any)
+ * for every page that was dirty. This does not flush the TLB, the caller must flush it on
+ * all the cores before relying on the dirty bits being set again.
+ *
+ * Page tables that are fully inside the range are skipped if they were not used since the
+ * last call, so the flush must also drop the paging-structure caches (a CR3 reload does).
+ */
+void virt_clear_dirty_range(uintptr_t virt, size_t page_count, virt_dirty_callback_t callback, void* ctx);
+
+/**
+ * Unmap all the present pages in the given range without flushing the TLB, the pages are
+ * stored in the given array which must have room for page_count entries, returns the amount
+ * of pages that were unmapped. The caller must flush the TLB before freeing the pages.
+ */
+size_t virt_unmap_range(uintptr_t virt, size_t page_count, void** pages);
+
+/**
+ * Unmap all the present pages in the given range, flushing the TLB of all the cores and
+ * returning the pages to the physical allocator, returns the amount of pages that were freed.
+ *
+ * Must be called from thread context with interrupts enabled
+ */
+size_t virt_decommit_range(uintptr_t virt, size_t page_count);
+
+/**
+ * Flush the given range from the TLB of all the cores, must
+ * be called from thread context with interrupts enabled
+ */
+void virt_flush_tlb_range(uintptr_t virt, size_t page_count);
+
+/**
+ * Handle a TLB shootdown request from another core
+ */
+void virt_handle_tlb_shootdown(void);
+
 /**
  * Switch to the kernel's page table
  */
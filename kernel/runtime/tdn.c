@@ -2,11 +2,14 @@
 #include <debug/log.h>
 #include <lib/string.h>
 #include <mem/alloc.h>
+#include <mem/arena.h>
 #include <mem/memory.h>
 #include <mem/phys.h>
 #include <mem/virt.h>
 #include <tomatodotnet/host.h>
 
+#include "tdn.h"
+
 void tdn_host_log_trace(const char* format, ...) {
     va_list ap;
     va_start(ap, format);
@@ -75,7 +78,7 @@ void tdn_host_close_file(tdn_file_t file) {
 //----------------------------------------------------------------------------------------------------------------------
 
 void* tdn_host_mallocz(size_t size, size_t align) {
-    void* ptr = mem_alloc(size);
+    void* ptr = mem_alloc_aligned(size, align);
     if (ptr != NULL) {
         memset(ptr, 0, size);
     }
@@ -91,6 +94,41 @@ void tdn_host_free(void* ptr) {
     mem_free(ptr);
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Arena allocator for transient allocations, everything
+// is freed at once when the arena is destroyed
+//----------------------------------------------------------------------------------------------------------------------
+
+void* tdn_host_arena_create(void) {
+    arena_t* arena = mem_alloc(sizeof(arena_t));
+    if (arena != NULL) {
+        arena_init(arena);
+    }
+    return arena;
+}
+
+void* tdn_host_arena_mallocz(void* arena, size_t size, size_t align) {
+    void* ptr = arena_alloc(arena, size, align);
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void* tdn_host_arena_realloc(void* arena, void* ptr, size_t size) {
+    return arena_realloc(arena, ptr, size);
+}
+
+void tdn_host_arena_free(void* arena, void* ptr) {
+    arena_free(arena, ptr);
+}
+
+void tdn_host_arena_destroy(void* arena) {
+    if (arena == NULL) return;
+    arena_reset(arena);
+    mem_free(arena);
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // Mapping memory for the jit
 //----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// The host hooks that the kernel provides on top of the ones declared by
+// tomatodotnet/host.h, so the runtime can call into them
+//
+
+//----------------------------------------------------------------------------------------------------------------------
+// Arena allocator for transient allocations
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Create an empty arena, returns NULL if out of memory
+ */
+void* tdn_host_arena_create(void);
+
+/**
+ * Allocate zeroed memory from the arena
+ */
+void* tdn_host_arena_mallocz(void* arena, size_t size, size_t align);
+
+/**
+ * Grow an allocation of the arena, the allocation keeps its alignment
+ */
+void* tdn_host_arena_realloc(void* arena, void* ptr, size_t size);
+
+/**
+ * Free an allocation of the arena, only the last allocation is actually reclaimed
+ */
+void tdn_host_arena_free(void* arena, void* ptr);
+
+/**
+ * Free the arena and everything that was allocated from it
+ */
+void tdn_host_arena_destroy(void* arena);
+
+//----------------------------------------------------------------------------------------------------------------------
+// GC statistics
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The bytes in use by the managed heap, GC.GetTotalMemory
+ */
+size_t tdn_host_gc_get_total_memory(bool force_full_collection);
+
+/**
+ * The amount of collections of the given generation, GC.CollectionCount
+ */
+size_t tdn_host_gc_collection_count(int generation);
+
+//----------------------------------------------------------------------------------------------------------------------
+// GC finalization
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Set the finalizer of all the objects of the given vtable, must be called
+ * before any object of the vtable is allocated, returns false if out of memory
+ */
+bool tdn_host_gc_register_finalizer(void* vtable, void (*finalizer)(void* object));
+
+//----------------------------------------------------------------------------------------------------------------------
+// GC handles
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The handle types, the values match System.Runtime.InteropServices.GCHandleType,
+ * weak handles that track resurrection are not supported
+ */
+typedef enum tdn_gc_handle_type {
+    TDN_GC_HANDLE_WEAK = 0,
+    TDN_GC_HANDLE_NORMAL = 2,
+    TDN_GC_HANDLE_PINNED = 3,
+
+    // used by DependentHandle
+    TDN_GC_HANDLE_DEPENDENT = 4,
+} tdn_gc_handle_type_t;
+
+/**
+ * Allocate a handle to the object, the secondary object is only used by
+ * dependent handles, returns NULL if out of memory
+ */
+void* tdn_host_gc_handle_alloc(tdn_gc_handle_type_t type, void* object, void* secondary);
+
+/**
+ * Free the handle, NULL is ignored
+ */
+void tdn_host_gc_handle_free(void* handle);
+
+/**
+ * Get the object of the handle, NULL once a weak or dependent handle was cleared
+ */
+void* tdn_host_gc_handle_get(void* handle);
+
+/**
+ * Set the object of the handle
+ */
+void tdn_host_gc_handle_set(void* handle, void* object);
+
+/**
+ * Get the secondary object of a dependent handle
+ */
+void* tdn_host_gc_handle_get_secondary(void* handle);
+
+/**
+ * Set the secondary object of a dependent handle
+ */
+void tdn_host_gc_handle_set_secondary(void* handle, void* secondary);
+
+//----------------------------------------------------------------------------------------------------------------------
+// GC stack maps
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Register the stack map of a call site in jitted code, the return address of the call is the key, and
+ * the slots are the offsets from the frame pointer of the caller that hold references (or interior
+ * references) while the call is in progress. The slots are copied. The frames of calls with a map
+ * are scanned precisely, so the jitted code must keep frame pointers and must not keep references
+ * in callee saved registers across the call. Returns false if out of memory
+ */
+bool tdn_host_gc_register_stack_map(void* return_address, const int32_t* slots, size_t slot_count);
@@ -57,8 +57,12 @@ cleanup:
 err_t pcpu_init_per_core(int cpu_id) {
     err_t err = NO_ERROR;
 
-    char* data = mem_alloc(__stop_pcpu_data - __start_pcpu_data);
+    // we can't use mem_alloc in here since until we set the fs base
+    // we are sharing the per-cpu data (and caches) of the BSP
+    size_t size = __stop_pcpu_data - __start_pcpu_data;
+    char* data = phys_alloc(size);
     CHECK_ERROR(data != NULL, ERROR_OUT_OF_MEMORY);
+    memset(data, 0, size);
 
     size_t offset =  data - __start_pcpu_data;
     __wrmsr(MSR_IA32_FS_BASE, offset);
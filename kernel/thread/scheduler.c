@@ -347,6 +347,26 @@ void scheduler_wakeup_thread(thread_t* thread) {
     scheduler_preempt_enable();
 }
 
+void scheduler_wakeup_thread_on(thread_t* thread, int cpu_id) {
+    if (cpu_id == get_cpu_id()) {
+        scheduler_wakeup_thread(thread);
+        return;
+    }
+
+    // Mark runnable
+    thread_switch_status(thread, THREAD_STATUS_WAITING, THREAD_STATUS_RUNNABLE);
+
+    // queue it on the other core
+    core_scheduler_context_t* core = pcpu_get_pointer_of(&m_core, cpu_id);
+    bool irq_state = irq_spinlock_acquire(&core->queue_lock);
+    list_add_tail(&core->queue, &thread->scheduler_node);
+    irq_spinlock_release(&core->queue_lock, irq_state);
+
+    // if the core is idle wake it up, otherwise it will
+    // get to the thread on its next reschedule
+    core_unpark(core->core_parker);
+}
+
 void scheduler_yield(void) {
     ASSERT(m_core.preempt_count == 0);
     scheduler_call(scheduler_yield_internal);
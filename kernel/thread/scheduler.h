@@ -28,6 +28,12 @@ void scheduler_start_per_core(void);
  */
 void scheduler_wakeup_thread(thread_t* thread);
 
+/**
+ * Wakeup a thread and let it run on the given core, threads
+ * don't migrate so it will keep running on that core
+ */
+void scheduler_wakeup_thread_on(thread_t* thread, int cpu_id);
+
 //----------------------------------------------------------------------------------------------------------------------
 // Primitives on the current thread
 //----------------------------------------------------------------------------------------------------------------------
@@ -5,6 +5,8 @@
 #include <lib/list.h>
 #include <lib/printf.h>
 #include <lib/string.h>
+#include <mem/kmem_cache.h>
+#include <stdalign.h>
 #include <sync/spinlock.h>
 
 #include "scheduler.h"
@@ -13,48 +15,63 @@
 /**
  * The amount of allocated threads we have
  */
-static size_t m_thread_top = 0;
+static atomic_size_t m_thread_top = 0;
 
 /**
- * Freelist of threads structs not in use
+ * The cache of thread structs not in use
  */
-static list_t m_thread_freelist = LIST_INIT(&m_thread_freelist);
+static kmem_cache_t* m_thread_cache = NULL;
 
 /**
- * Protect the thread list and the thread top variables
+ * Take the next unused thread slot
  */
-static spinlock_t m_thread_freelist_lock = SPINLOCK_INIT;
-
-static thread_t* thread_alloc() {
-    thread_t* thread = NULL;
-
-    spinlock_acquire(&m_thread_freelist_lock);
-
-    // try to get an already free thread
-    list_entry_t* entry = list_pop(&m_thread_freelist);
-    if (entry != NULL) {
-        thread = containerof(entry, thread_t, link);
-        memset(thread, 0, sizeof(*thread));
-    }
-
-    // increase the thread pool
-    if (thread == NULL && m_thread_top < UINT16_MAX) {
-        thread = &THREADS[m_thread_top];
-        m_thread_top++;
+static void* thread_cache_grow(void) {
+    size_t top = atomic_load_explicit(&m_thread_top, memory_order_relaxed);
+    do {
+        if (top >= UINT16_MAX) {
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&m_thread_top, &top, top + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return &THREADS[top];
+}
 
-        // switch to a dead state, just so we can wake it up properly
-        thread_switch_status(thread, THREAD_STATUS_IDLE, THREAD_STATUS_DEAD);
-    }
+/**
+ * Initialize the parts of the thread that stay the same across uses
+ */
+static void thread_cache_ctor(void* obj) {
+    thread_t* thread = obj;
 
-    // initialize anything that it needs, we multiply after the ++ because we want to get
+    // initialize anything that it needs, we add 8MB because we want to get
     // the top of the stack, not the bottom of it
     size_t stack_offset = STACKS_ADDR + SIZE_8MB * get_thread_id(thread);
     thread->stack_start = (void*)stack_offset + SIZE_2MB;
     thread->stack_end = (void*)stack_offset + SIZE_8MB;
 
-    spinlock_release(&m_thread_freelist_lock);
+    // switch to a dead state, just so we can wake it up properly
+    thread_switch_status(thread, THREAD_STATUS_IDLE, THREAD_STATUS_DEAD);
+}
 
-    return thread;
+size_t thread_get_count(void) {
+    return atomic_load_explicit(&m_thread_top, memory_order_acquire);
+}
+
+err_t init_threads(void) {
+    err_t err = NO_ERROR;
+
+    m_thread_cache = kmem_cache_create(&(kmem_cache_params_t){
+        .name = "thread",
+        .size = sizeof(thread_t),
+        .align = alignof(thread_t),
+        .ctor = thread_cache_ctor,
+        .has_free_offset = true,
+        .free_offset = offsetof(thread_t, link),
+        .grow = thread_cache_grow,
+    });
+    CHECK_ERROR(m_thread_cache != NULL, ERROR_OUT_OF_MEMORY);
+
+cleanup:
+    return err;
 }
 
 void thread_switch_status(thread_t* thread, thread_status_t old_value, thread_status_t new_value) {
@@ -67,12 +84,18 @@ void thread_switch_status(thread_t* thread, thread_status_t old_value, thread_st
 }
 
 thread_t* thread_create(thread_entry_t callback, void* arg, const char* name_fmt, ...) {
-    thread_t* thread = thread_alloc();
+    thread_t* thread = kmem_cache_alloc(m_thread_cache);
     if (thread == NULL) {
         return NULL;
     }
     ASSERT(thread->status == THREAD_STATUS_DEAD);
 
+    // clear the state left from the last use, the stack
+    // and status are kept by the cache
+    memset(thread->name, 0, sizeof(thread->name));
+    memset(&thread->link, 0, sizeof(thread->link));
+    memset(&thread->scheduler_node, 0, sizeof(thread->scheduler_node));
+
     // set the name
     va_list va;
     va_start(va, name_fmt);
@@ -89,7 +112,9 @@ thread_t* thread_create(thread_entry_t callback, void* arg, const char* name_fmt
     thread->cpu_state->rip = (uintptr_t)callback;
     thread->cpu_state->rdi = (uintptr_t)arg;
 
-    // setup the extended state
+    // setup the extended state, only the legacy region and the xsave
+    // header need to be clean, the rest is governed by the header
+    memset(thread->extended_state, 0, 512 + 64);
     xsave_legacy_region_t* extended_state = (xsave_legacy_region_t*)thread->extended_state;
     extended_state->mxscr = 0x00001f80;
 
@@ -124,11 +149,8 @@ void thread_save_extended_state(thread_t* thread) {
 }
 
 void thread_free(thread_t* thread) {
-    memset(thread, 0, sizeof(*thread));
-
-    spinlock_acquire(&m_thread_freelist_lock);
-    list_add(&m_thread_freelist, &thread->link);
-    spinlock_release(&m_thread_freelist_lock);
+    ASSERT(thread->status == THREAD_STATUS_DEAD);
+    kmem_cache_free(m_thread_cache, thread);
 }
 
 void thread_exit() {
@@ -4,6 +4,7 @@
 #include <mem/memory.h>
 
 #include "lib/defs.h"
+#include "lib/except.h"
 
 #include <stdatomic.h>
 #include <lib/list.h>
@@ -104,6 +105,12 @@ STATIC_ASSERT(sizeof(thread_t) <= SIZE_8MB);
  */
 #define THREADS ((thread_t*)THREADS_ADDR)
 
+/**
+ * Get the amount of thread slots that were ever handed out, every
+ * thread that exists is in THREADS below this index
+ */
+size_t thread_get_count(void);
+
 /**
  * Calculate the ID of the thread
  */
@@ -118,6 +125,11 @@ static inline size_t get_thread_id(thread_t* thread) { return thread - THREADS;
  */
 void thread_switch_status(thread_t* thread, thread_status_t old_value, thread_status_t new_value);
 
+/**
+ * Initialize the thread object cache
+ */
+err_t init_threads(void);
+
 /**
 * Create a new thread, you need to schedule it yourself
 */